@@ -1,11 +1,14 @@
 #include "FormulaAST.h"
 
-#include "FormulaBaseListener.h"
-#include "FormulaLexer.h"
-#include "FormulaParser.h"
+#include "formula.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <charconv>
+#include <climits>
 #include <cmath>
+#include <iterator>
 #include <memory>
 #include <optional>
 #include <sstream>
@@ -71,13 +74,25 @@ class Expr {
 public:
     virtual ~Expr() = default;
     virtual void Print(std::ostream& out) const = 0;
-    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(const SheetInterface& sheet) const = 0;
+    // positions of cells and ranges are printed shifted by offset
+    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence,
+                                Position offset) const = 0;
+    // appends the postfix code of the subtree to the program
+    virtual void Compile(Program& program) const = 0;
+    // appends the nodes of the subtree in postfix order
+    virtual void Serialize(std::vector<SerializedNode>& out) const = 0;
+
+    // appends the code of an argument of the function: its value and the
+    // number of values it stands for
+    virtual void CompileArgument(Program& program, Function /* function */) const {
+        Compile(program);
+        program.emplace_back(1.0);
+    }
 
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
 
-    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence, Position offset,
                       bool right_child = false) const {
         auto precedence = GetPrecedence();
         auto mask = right_child ? PR_RIGHT : PR_LEFT;
@@ -86,7 +101,7 @@ public:
             out << '(';
         }
 
-        DoPrintFormula(out, precedence);
+        DoPrintFormula(out, precedence, offset);
 
         if (parens_needed) {
             out << ')';
@@ -105,10 +120,10 @@ public:
     };
 
 public:
-    explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+    explicit BinaryOpExpr(Type type, const Expr* lhs, const Expr* rhs)
         : type_(type)
-        , lhs_(std::move(lhs))
-        , rhs_(std::move(rhs)) {
+        , lhs_(lhs)
+        , rhs_(rhs) {
     }
 
     void Print(std::ostream& out) const override {
@@ -119,10 +134,11 @@ public:
         out << ')';
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        lhs_->PrintFormula(out, precedence);
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence,
+                        Position offset) const override {
+        lhs_->PrintFormula(out, precedence, offset);
         out << static_cast<char>(type_);
-        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+        rhs_->PrintFormula(out, precedence, offset, /* right_child = */ true);
     }
 
     ExprPrecedence GetPrecedence() const override {
@@ -142,43 +158,41 @@ public:
         }
     }
 
-    double Evaluate(const SheetInterface& sheet) const override {
-        double result = 0;
-        double left = lhs_->Evaluate(sheet);
-        double right = rhs_->Evaluate(sheet);
+    void Compile(Program& program) const override {
+        lhs_->Compile(program);
+        rhs_->Compile(program);
 
         switch (type_) {
             case Add:
-                result = left + right;
+                program.emplace_back(Instruction::Op::Add);
                 break;
             case Subtract:
-                result = left - right;
+                program.emplace_back(Instruction::Op::Subtract);
                 break;
             case Multiply:
-                result = left * right;
+                program.emplace_back(Instruction::Op::Multiply);
                 break;
             case Divide:
-                if (right == 0) {
-                    throw FormulaError(FormulaError::Category::Arithmetic);
-                }
-                
-                result = left / right;
+                program.emplace_back(Instruction::Op::Divide);
                 break;
             default:
                 assert(false);
         }
+    }
 
-        if (!std::isfinite(result)) {
-            throw FormulaError(FormulaError::Category::Arithmetic);
-        }
-        
-        return result;
+    void Serialize(std::vector<SerializedNode>& out) const override {
+        lhs_->Serialize(out);
+        rhs_->Serialize(out);
+        SerializedNode node;
+        node.kind = SerializedNode::Kind::BinaryOp;
+        node.op = static_cast<char>(type_);
+        out.push_back(node);
     }
 
 private:
     Type type_;
-    std::unique_ptr<Expr> lhs_;
-    std::unique_ptr<Expr> rhs_;
+    const Expr* lhs_;
+    const Expr* rhs_;
 };
 
 class UnaryOpExpr final : public Expr {
@@ -189,9 +203,9 @@ public:
     };
 
 public:
-    explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
+    explicit UnaryOpExpr(Type type, const Expr* operand)
         : type_(type)
-        , operand_(std::move(operand)) {
+        , operand_(operand) {
     }
 
     void Print(std::ostream& out) const override {
@@ -200,22 +214,34 @@ public:
         out << ')';
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence,
+                        Position offset) const override {
         out << static_cast<char>(type_);
-        operand_->PrintFormula(out, precedence);
+        operand_->PrintFormula(out, precedence, offset);
     }
 
     ExprPrecedence GetPrecedence() const override {
         return EP_UNARY;
     }
 
-    double Evaluate(const SheetInterface& sheet) const override {
-        return type_ == UnaryPlus ? operand_->Evaluate(sheet) : -operand_->Evaluate(sheet);
+    void Compile(Program& program) const override {
+        operand_->Compile(program);
+        if (type_ == UnaryMinus) {
+            program.emplace_back(Instruction::Op::Negate);
+        }
+    }
+
+    void Serialize(std::vector<SerializedNode>& out) const override {
+        operand_->Serialize(out);
+        SerializedNode node;
+        node.kind = SerializedNode::Kind::UnaryOp;
+        node.op = static_cast<char>(type_);
+        out.push_back(node);
     }
 
 private:
     Type type_;
-    std::unique_ptr<Expr> operand_;
+    const Expr* operand_;
 };
 
 class CellExpr final : public Expr {
@@ -225,56 +251,39 @@ public:
     }
 
     void Print(std::ostream& out) const override {
-        if (!cell_->IsValid()) {
-            out << FormulaError::Category::Ref;
-        } else {
-            out << cell_->ToString();
-        }
+        PrintCell(out, *cell_);
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        Print(out);
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */,
+                        Position offset) const override {
+        PrintCell(out, Shift(*cell_, offset));
     }
 
     ExprPrecedence GetPrecedence() const override {
         return EP_ATOM;
     }
 
-    double Evaluate(const SheetInterface& sheet) const override {
-        // Пустая строка вернет nullptr.
-        const CellInterface* cell = sheet.GetCell(*cell_);
-        
-        // Пустая строка в формуле равна нулю
-        if (cell == nullptr) {
-            return 0;
-        }
-
-        auto val = cell->GetValue();
-        if (std::holds_alternative<std::string>(val)) {
-            std::string str = std::get<std::string>(val);
-
-            if (str.empty()) {
-                return 0;
-            }
-
-            std::istringstream iss(str);
+    void Compile(Program& program) const override {
+        program.emplace_back(*cell_);
+    }
 
-            double res;
-            if (iss >> res && iss.eof()) { 
-                return res;
-            }
+    void Serialize(std::vector<SerializedNode>& out) const override {
+        SerializedNode node;
+        node.kind = SerializedNode::Kind::Cell;
+        node.coords[0] = cell_->row;
+        node.coords[1] = cell_->col;
+        out.push_back(node);
+    }
 
-            throw FormulaError(FormulaError::Category::Value);
-        }
-        
-        if (std::holds_alternative<double>(val)) {
-            return std::get<double>(val);
+private:
+    static void PrintCell(std::ostream& out, Position cell) {
+        if (!cell.IsValid()) {
+            out << FormulaError::Category::Ref;
+        } else {
+            out << cell.ToString();
         }
-
-        throw std::get<FormulaError>(val);
     }
 
-private:
     const Position* cell_;
 };
 
@@ -288,7 +297,8 @@ public:
         out << value_;
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */,
+                        Position /* offset */) const override {
         out << value_;
     }
 
@@ -296,144 +306,504 @@ public:
         return EP_ATOM;
     }
 
-    double Evaluate(const SheetInterface&) const override {
-        return value_;
+    void Compile(Program& program) const override {
+        program.emplace_back(value_);
+    }
+
+    void Serialize(std::vector<SerializedNode>& out) const override {
+        SerializedNode node;
+        node.kind = SerializedNode::Kind::Number;
+        node.number = value_;
+        out.push_back(node);
     }
 
 private:
     double value_;
 };
 
-class ParseASTListener final : public FormulaBaseListener {
+// A range is not a value by itself, it only feeds an aggregate function
+class RangeExpr final : public Expr {
 public:
-    std::unique_ptr<Expr> MoveRoot() {
-        assert(args_.size() == 1);
-        auto root = std::move(args_.front());
-        args_.clear();
+    RangeExpr(Range range, std::uint32_t index)
+        : range_(range)
+        , index_(index) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << range_.ToString();
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */,
+                        Position offset) const override {
+        out << Shift(range_, offset).ToString();
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
 
-        return root;
+    void Compile(Program& /* program */) const override {
+        assert(false && "a range outside of a function");
     }
 
-    std::forward_list<Position> MoveCells() {
-        return std::move(cells_);
+    void CompileArgument(Program& program, Function function) const override {
+        program.emplace_back(Instruction::Op::LoadRange, function, index_);
     }
 
+    void Serialize(std::vector<SerializedNode>& out) const override {
+        SerializedNode node;
+        node.kind = SerializedNode::Kind::Range;
+        node.coords[0] = range_.from.row;
+        node.coords[1] = range_.from.col;
+        node.coords[2] = range_.to.row;
+        node.coords[3] = range_.to.col;
+        out.push_back(node);
+    }
+
+private:
+    Range range_;
+    std::uint32_t index_;
+};
+
+class FunctionExpr final : public Expr {
 public:
-    void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
-        assert(args_.size() >= 1);
+    FunctionExpr(Function function, std::pmr::vector<const Expr*> args)
+        : function_(function)
+        , args_(std::move(args)) {
+    }
 
-        auto operand = std::move(args_.back());
+    void Print(std::ostream& out) const override {
+        out << '(' << FunctionName(function_);
+        for (const auto& arg : args_) {
+            out << ' ';
+            arg->Print(out);
+        }
+        out << ')';
+    }
 
-        UnaryOpExpr::Type type;
-        if (ctx->SUB()) {
-            type = UnaryOpExpr::UnaryMinus;
-        } else {
-            assert(ctx->ADD() != nullptr);
-            type = UnaryOpExpr::UnaryPlus;
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */,
+                        Position offset) const override {
+        out << FunctionName(function_) << '(';
+        bool first = true;
+        for (const auto& arg : args_) {
+            if (!first) {
+                out << ',';
+            }
+            first = false;
+            // the argument list delimits the arguments like parentheses
+            arg->PrintFormula(out, EP_ATOM, offset);
         }
+        out << ')';
+    }
 
-        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-        args_.back() = std::move(node);
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
     }
 
-    void exitLiteral(FormulaParser::LiteralContext* ctx) override {
-        double value = 0;
-        auto valueStr = ctx->NUMBER()->getSymbol()->getText();
-        std::istringstream in(valueStr);
-        in >> value;
-        if (!in) {
-            throw ParsingError("Invalid number: " + valueStr);
+    void Compile(Program& program) const override {
+        for (const auto& arg : args_) {
+            arg->CompileArgument(program, function_);
         }
-
-        auto node = std::make_unique<NumberExpr>(value);
-        args_.push_back(std::move(node));
+        program.emplace_back(Instruction::Op::Aggregate, function_, static_cast<std::uint32_t>(args_.size()));
     }
 
-    void exitCell(FormulaParser::CellContext* ctx) override {
-        auto value_str = ctx->CELL()->getSymbol()->getText();
-        auto value = Position::FromString(value_str);
-        if (!value.IsValid()) {
-            throw FormulaException("Invalid position: " + value_str);
+    void Serialize(std::vector<SerializedNode>& out) const override {
+        for (const auto& arg : args_) {
+            arg->Serialize(out);
         }
+        SerializedNode node;
+        node.kind = SerializedNode::Kind::Function;
+        node.function = function_;
+        node.arg_count = static_cast<std::uint32_t>(args_.size());
+        out.push_back(node);
+    }
+
+private:
+    Function function_;
+    std::pmr::vector<const Expr*> args_;  // allocated from the same arena
+};
+
+// Reads a referenced cell as a number. Empty cells are zero, text has to be a
+// number as a whole.
+FormulaAST::Value LoadCell(const SheetInterface& sheet, Position pos) {
+    // Пустая строка вернет nullptr.
+    const CellInterface* cell = sheet.GetCell(pos);
+
+    // Пустая строка в формуле равна нулю
+    if (cell == nullptr) {
+        return 0.0;
+    }
+
+    // Числовое значение текста разобрано при записи ячейки
+    return cell->GetNumericValue();
+}
 
-        cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
-        args_.push_back(std::move(node));
+// The reductions keep four independent accumulators, so iterations do not wait
+// for each other and the compiler is free to vectorize the loops.
+double SumKernel(const double* data, std::size_t size) {
+    double acc0 = 0, acc1 = 0, acc2 = 0, acc3 = 0;
+    std::size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        acc0 += data[i];
+        acc1 += data[i + 1];
+        acc2 += data[i + 2];
+        acc3 += data[i + 3];
     }
+    for (; i < size; ++i) {
+        acc0 += data[i];
+    }
+    return (acc0 + acc1) + (acc2 + acc3);
+}
 
-    void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
-        assert(args_.size() >= 2);
+template <typename Select>
+double ReduceKernel(const double* data, std::size_t size, Select select) {
+    assert(size > 0);
+    double acc0 = data[0], acc1 = data[0], acc2 = data[0], acc3 = data[0];
+    std::size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        acc0 = select(acc0, data[i]);
+        acc1 = select(acc1, data[i + 1]);
+        acc2 = select(acc2, data[i + 2]);
+        acc3 = select(acc3, data[i + 3]);
+    }
+    for (; i < size; ++i) {
+        acc0 = select(acc0, data[i]);
+    }
+    return select(select(acc0, acc1), select(acc2, acc3));
+}
 
-        auto rhs = std::move(args_.back());
-        args_.pop_back();
+double Min(double lhs, double rhs) {
+    return rhs < lhs ? rhs : lhs;
+}
 
-        auto lhs = std::move(args_.back());
+double Max(double lhs, double rhs) {
+    return lhs < rhs ? rhs : lhs;
+}
 
-        BinaryOpExpr::Type type;
-        if (ctx->ADD()) {
-            type = BinaryOpExpr::Add;
-        } else if (ctx->SUB()) {
-            type = BinaryOpExpr::Subtract;
-        } else if (ctx->MUL()) {
-            type = BinaryOpExpr::Multiply;
-        } else {
-            assert(ctx->DIV() != nullptr);
-            type = BinaryOpExpr::Divide;
+// The partial aggregate of the values, meaningless for no values
+double PartialAggregate(Function function, const std::vector<double>& values) {
+    if (values.empty()) {
+        return 0;
+    }
+
+    switch (function) {
+        case Function::Min:
+            return ReduceKernel(values.data(), values.size(), Min);
+        case Function::Max:
+            return ReduceKernel(values.data(), values.size(), Max);
+        default:
+            return SumKernel(values.data(), values.size());
+    }
+}
+
+// Combines `count` (value, number of values) pairs. Empty cells of ranges are
+// skipped: MIN and MAX of nothing are zero, AVERAGE of nothing is an error.
+FormulaAST::Value Aggregate(Function function, const double* args, std::size_t count) {
+    double result = 0;
+    double values_count = 0;
+    bool found = false;
+
+    for (std::size_t i = 0; i < count; ++i) {
+        double value = args[2 * i];
+        double value_count = args[2 * i + 1];
+        if (value_count == 0) {
+            continue;
         }
 
-        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-        args_.back() = std::move(node);
+        switch (function) {
+            case Function::Min:
+                result = found ? Min(result, value) : value;
+                break;
+            case Function::Max:
+                result = found ? Max(result, value) : value;
+                break;
+            default:
+                result += value;
+        }
+        values_count += value_count;
+        found = true;
     }
 
-    void visitErrorNode(antlr4::tree::ErrorNode* node) override {
-        throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
+    if (function == Function::Average) {
+        if (values_count == 0) {
+            return FormulaError(FormulaError::Category::Arithmetic);
+        }
+        result /= values_count;
     }
 
-private:
-    std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
-};
+    return result;
+}
 
-class BailErrorListener : public antlr4::BaseErrorListener {
-public:
-    void syntaxError(antlr4::Recognizer* /* recognizer */, antlr4::Token* /* offendingSymbol */,
-                     size_t /* line */, size_t /* charPositionInLine */, const std::string& msg,
-                     std::exception_ptr /* e */
-                     ) override {
-        throw ParsingError("Error when lexing: " + msg);
+// The first error stops the program and becomes its result, so a broken input
+// costs the same as a clean one: no exception is thrown or unwound.
+FormulaAST::Value Run(const Program& program, const std::pmr::vector<Range>& ranges, double* stack,
+                      const SheetInterface& sheet, const RangeSource& range_source, Position offset) {
+    const FormulaError arithmetic_error(FormulaError::Category::Arithmetic);
+    double* top = stack;  // points past the last pushed value
+
+    for (const Instruction& instr : program) {
+        switch (instr.op) {
+            case Instruction::Op::PushNumber:
+                *top++ = instr.number;
+                continue;
+            case Instruction::Op::LoadCell: {
+                auto value = LoadCell(sheet, Shift(instr.cell, offset));
+                if (const auto* error = std::get_if<FormulaError>(&value)) {
+                    return *error;
+                }
+                *top++ = std::get<double>(value);
+                continue;
+            }
+            case Instruction::Op::LoadRange: {
+                // the buffer is taken over for the time of the call, so that
+                // a nested evaluation gets a buffer of its own
+                thread_local std::vector<double> buffer;
+                std::vector<double> values = std::move(buffer);
+                values.clear();
+
+                auto error = range_source.CollectRangeValues(Shift(ranges[instr.index], offset), values);
+                if (error) {
+                    buffer = std::move(values);
+                    return *error;
+                }
+
+                *top++ = PartialAggregate(instr.function, values);
+                *top++ = static_cast<double>(values.size());
+                buffer = std::move(values);
+                continue;
+            }
+            case Instruction::Op::Aggregate: {
+                top -= 2 * static_cast<std::size_t>(instr.index);
+                auto value = Aggregate(instr.function, top, instr.index);
+                if (const auto* error = std::get_if<FormulaError>(&value)) {
+                    return *error;
+                }
+                *top++ = std::get<double>(value);
+                break;
+            }
+            case Instruction::Op::Negate:
+                top[-1] = -top[-1];
+                continue;
+            case Instruction::Op::Add:
+                --top;
+                top[-1] += top[0];
+                break;
+            case Instruction::Op::Subtract:
+                --top;
+                top[-1] -= top[0];
+                break;
+            case Instruction::Op::Multiply:
+                --top;
+                top[-1] *= top[0];
+                break;
+            case Instruction::Op::Divide:
+                --top;
+                if (top[0] == 0) {
+                    return arithmetic_error;
+                }
+                top[-1] /= top[0];
+                break;
+        }
+
+        // binary operations must stay finite
+        if (!std::isfinite(top[-1])) {
+            return arithmetic_error;
+        }
     }
-};
 
+    assert(top == stack + 1);
+    return stack[0];
+}
+
+std::size_t MaxStackDepth(const Program& program) {
+    std::size_t depth = 0;
+    std::size_t max_depth = 0;
+
+    for (const Instruction& instr : program) {
+        switch (instr.op) {
+            case Instruction::Op::PushNumber:
+            case Instruction::Op::LoadCell:
+                max_depth = std::max(max_depth, ++depth);
+                break;
+            case Instruction::Op::LoadRange:
+                depth += 2;
+                max_depth = std::max(max_depth, depth);
+                break;
+            case Instruction::Op::Aggregate:
+                depth -= 2 * static_cast<std::size_t>(instr.index) - 1;
+                break;
+            case Instruction::Op::Negate:
+                break;
+            default:
+                --depth;
+        }
+    }
+
+    return max_depth;
+}
+
+}  // namespace
+
+namespace {
+constexpr std::string_view FUNCTION_NAMES[] = {"SUM", "MIN", "MAX", "AVERAGE"};
 }  // namespace
+
+std::optional<Function> FunctionFromName(std::string_view name) {
+    for (std::size_t i = 0; i < std::size(FUNCTION_NAMES); ++i) {
+        if (FUNCTION_NAMES[i] == name) {
+            return static_cast<Function>(i);
+        }
+    }
+    return std::nullopt;
+}
+
+std::string_view FunctionName(Function function) {
+    return FUNCTION_NAMES[static_cast<std::size_t>(function)];
+}
+
 }  // namespace ASTImpl
 
-FormulaAST ParseFormulaAST(std::istream& in) {
-    using namespace antlr4;
+FormulaASTBuilder::FormulaASTBuilder()
+    : arena_(std::make_unique<ASTImpl::Arena>())
+    , cells_(arena_->GetResource())
+    , ranges_(arena_->GetResource()) {
+    args_.reserve(16);
+}
+
+FormulaASTBuilder::~FormulaASTBuilder() = default;
+
+void FormulaASTBuilder::AddNumber(std::string_view text) {
+    double value = 0;
+    auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (ec == std::errc::result_out_of_range) {
+        // underflow is not an error for stream extraction; let it decide
+        std::istringstream in{std::string(text)};
+        in >> value;
+        ec = in ? std::errc() : ec;
+        ptr = text.data() + text.size();
+    }
+
+    if (ec != std::errc() || ptr != text.data() + text.size()) {
+        throw ParsingError("Invalid number: " + std::string(text));
+    }
+
+    AddNumber(value);
+}
+
+void FormulaASTBuilder::AddNumber(double value) {
+    args_.push_back(arena_->Make<ASTImpl::NumberExpr>(value));
+}
+
+void FormulaASTBuilder::AddCell(std::string_view text) {
+    auto value = Position::FromString(text);
+    if (!value.IsValid()) {
+        throw FormulaException("Invalid position: " + std::string(text));
+    }
+
+    AddCell(value);
+}
+
+void FormulaASTBuilder::AddCell(Position pos) {
+    if (!pos.IsValid()) {
+        throw FormulaException("Invalid position");
+    }
+
+    cells_.push_front(pos);
+    args_.push_back(arena_->Make<ASTImpl::CellExpr>(&cells_.front()));
+}
+
+void FormulaASTBuilder::AddRange(std::string_view from, std::string_view to) {
+    auto first = Position::FromString(from);
+    auto second = Position::FromString(to);
+    if (!first.IsValid() || !second.IsValid()) {
+        throw FormulaException("Invalid range: " + std::string(from) + ':' + std::string(to));
+    }
+
+    AddRange(Range::FromCorners(first, second));
+}
+
+void FormulaASTBuilder::AddRange(Range range) {
+    if (!range.from.IsValid() || !range.to.IsValid()) {
+        throw FormulaException("Invalid range");
+    }
+
+    ranges_.push_back(range);
+    args_.push_back(arena_->Make<ASTImpl::RangeExpr>(range, static_cast<std::uint32_t>(ranges_.size() - 1)));
+}
+
+void FormulaASTBuilder::AddFunction(std::string_view name, std::size_t arg_count) {
+    auto function = ASTImpl::FunctionFromName(name);
+    if (!function) {
+        throw ParsingError("Unknown function: " + std::string(name));
+    }
+
+    AddFunction(*function, arg_count);
+}
+
+void FormulaASTBuilder::AddFunction(ASTImpl::Function function, std::size_t arg_count) {
+    assert(arg_count >= 1 && args_.size() >= arg_count);
+
+    std::pmr::vector<const ASTImpl::Expr*> args(args_.end() - arg_count, args_.end(), arena_->GetResource());
+    args_.resize(args_.size() - arg_count);
+    args_.push_back(arena_->Make<ASTImpl::FunctionExpr>(function, std::move(args)));
+}
+
+void FormulaASTBuilder::AddUnaryOp(char op) {
+    assert(args_.size() >= 1);
+    assert(op == ASTImpl::UnaryOpExpr::UnaryPlus || op == ASTImpl::UnaryOpExpr::UnaryMinus);
+
+    args_.back() = arena_->Make<ASTImpl::UnaryOpExpr>(static_cast<ASTImpl::UnaryOpExpr::Type>(op),
+                                                      args_.back());
+}
+
+void FormulaASTBuilder::AddBinaryOp(char op) {
+    assert(args_.size() >= 2);
+
+    const ASTImpl::Expr* rhs = args_.back();
+    args_.pop_back();
 
-    ANTLRInputStream input(in);
+    args_.back() = arena_->Make<ASTImpl::BinaryOpExpr>(static_cast<ASTImpl::BinaryOpExpr::Type>(op),
+                                                       args_.back(), rhs);
+}
+
+FormulaAST FormulaASTBuilder::Build() {
+    assert(args_.size() == 1);
+    const ASTImpl::Expr* root = args_.front();
+    args_.clear();
 
-    FormulaLexer lexer(&input);
-    ASTImpl::BailErrorListener error_listener;
-    lexer.removeErrorListeners();
-    lexer.addErrorListener(&error_listener);
+    return FormulaAST(std::move(arena_), root, std::move(cells_), std::move(ranges_));
+}
 
-    CommonTokenStream tokens(&lexer);
+namespace {
+std::atomic<FormulaParserKind> formula_parser{FormulaParserKind::Pratt};
+}  // namespace
 
-    FormulaParser parser(&tokens);
-    auto error_handler = std::make_shared<BailErrorStrategy>();
-    parser.setErrorHandler(error_handler);
-    parser.removeErrorListeners();
+void SetFormulaParser(FormulaParserKind kind) {
+#ifndef SPREADSHEET_WITH_ANTLR
+    if (kind == FormulaParserKind::Antlr) {
+        throw std::logic_error("The ANTLR formula parser is not built");
+    }
+#endif
+    formula_parser.store(kind, std::memory_order_relaxed);
+}
 
-    tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
-    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+FormulaParserKind GetFormulaParser() {
+    return formula_parser.load(std::memory_order_relaxed);
+}
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+FormulaAST ParseFormulaAST(std::istream& in) {
+    std::string in_str{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    return ParseFormulaAST(in_str);
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+#ifdef SPREADSHEET_WITH_ANTLR
+    if (GetFormulaParser() == FormulaParserKind::Antlr) {
+        std::istringstream in(in_str);
+        return ParseFormulaASTAntlr(in);
+    }
+#endif
+    return ParseFormulaASTPratt(in_str);
 }
 
 void FormulaAST::PrintCells(std::ostream& out) const {
@@ -446,18 +816,117 @@ void FormulaAST::Print(std::ostream& out) const {
     root_expr_->Print(out);
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+void FormulaAST::PrintFormula(std::ostream& out, Position offset) const {
+    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM, offset);
+}
+
+void FormulaAST::Serialize(std::vector<ASTImpl::SerializedNode>& out) const {
+    root_expr_->Serialize(out);
+}
+
+FormulaAST FormulaAST::Deserialize(const ASTImpl::SerializedNode* nodes, std::size_t count) {
+    using Kind = ASTImpl::SerializedNode::Kind;
+
+    // the builder asserts a well-formed sequence, so the nodes are checked
+    // against a model of its stack: whether each entry is a range
+    std::vector<bool> is_range;
+    FormulaASTBuilder builder;
+
+    auto pop_values = [&is_range](std::size_t n) {
+        if (is_range.size() < n || std::find(is_range.end() - n, is_range.end(), true) != is_range.end()) {
+            throw ParsingError("Malformed serialized formula");
+        }
+        is_range.resize(is_range.size() - n);
+    };
+
+    try {
+        for (std::size_t i = 0; i < count; ++i) {
+            const auto& node = nodes[i];
+            switch (node.kind) {
+                case Kind::Number:
+                    builder.AddNumber(node.number);
+                    is_range.push_back(false);
+                    break;
+                case Kind::Cell:
+                    builder.AddCell(Position{node.coords[0], node.coords[1]});
+                    is_range.push_back(false);
+                    break;
+                case Kind::Range:
+                    builder.AddRange(Range::FromCorners({node.coords[0], node.coords[1]},
+                                                        {node.coords[2], node.coords[3]}));
+                    is_range.push_back(true);
+                    break;
+                case Kind::UnaryOp:
+                    if (node.op != '+' && node.op != '-') {
+                        throw ParsingError("Malformed serialized formula");
+                    }
+                    pop_values(1);
+                    builder.AddUnaryOp(node.op);
+                    is_range.push_back(false);
+                    break;
+                case Kind::BinaryOp:
+                    if (node.op != '+' && node.op != '-' && node.op != '*' && node.op != '/') {
+                        throw ParsingError("Malformed serialized formula");
+                    }
+                    pop_values(2);
+                    builder.AddBinaryOp(node.op);
+                    is_range.push_back(false);
+                    break;
+                case Kind::Function:
+                    if (node.function > ASTImpl::Function::Average || node.arg_count == 0
+                        || node.arg_count > is_range.size()) {
+                        throw ParsingError("Malformed serialized formula");
+                    }
+                    is_range.resize(is_range.size() - node.arg_count);
+                    builder.AddFunction(node.function, node.arg_count);
+                    is_range.push_back(false);
+                    break;
+                default:
+                    throw ParsingError("Malformed serialized formula");
+            }
+        }
+    } catch (const FormulaException&) {
+        throw ParsingError("Malformed serialized formula");
+    }
+
+    pop_values(1);
+    if (!is_range.empty()) {
+        throw ParsingError("Malformed serialized formula");
+    }
+    return builder.Build();
 }
 
-double FormulaAST::Execute(const SheetInterface& sheet) const {
-    return root_expr_->Evaluate(sheet);
+FormulaAST::Value FormulaAST::Execute(const SheetInterface& sheet, const RangeSource& range_source, Position offset) const {
+    // typical formulas are shallow, so the stack lives on the C++ stack
+    constexpr std::size_t LOCAL_STACK_SIZE = 32;
+    if (max_stack_depth_ <= LOCAL_STACK_SIZE) {
+        double stack[LOCAL_STACK_SIZE];
+        return ASTImpl::Run(program_, ranges_, stack, sheet, range_source, offset);
+    }
+
+    std::vector<double> stack(max_stack_depth_);
+    return ASTImpl::Run(program_, ranges_, stack.data(), sheet, range_source, offset);
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Arena> arena, const ASTImpl::Expr* root_expr,
+                       std::pmr::forward_list<Position> cells, std::pmr::vector<Range> ranges)
+    : arena_(std::move(arena))
+    , root_expr_(root_expr)
+    , cells_(std::move(cells))
+    , unique_cells_(arena_->GetResource())
+    , ranges_(std::move(ranges)) {
+    // the program is compiled into a reused buffer and copied once, so it
+    // takes exactly one allocation
+    thread_local ASTImpl::Program code;
+    code.clear();
+    root_expr_->Compile(code);
+    program_.assign(code.begin(), code.end());
+    max_stack_depth_ = ASTImpl::MaxStackDepth(program_);
+
     cells_.sort();  // to avoid sorting in GetReferencedCells
+    unique_cells_.assign(cells_.begin(), cells_.end());
+    unique_cells_.erase(std::unique(unique_cells_.begin(), unique_cells_.end()), unique_cells_.end());
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) = default;
 FormulaAST::~FormulaAST() = default;
@@ -1,45 +1,252 @@
 #pragma once
 
-#include "FormulaLexer.h"
 #include "common.h"
 
+#include <cstddef>
+#include <cstdint>
 #include <forward_list>
 #include <functional>
+#include <memory_resource>
+#include <new>
+#include <optional>
 #include <stdexcept>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+class RangeSource;
 
 namespace ASTImpl {
 class Expr;
+
+// Aggregate functions, they take expressions and ranges as arguments
+enum class Function : std::uint8_t {
+    Sum,
+    Min,
+    Max,
+    Average,
+};
+
+std::optional<Function> FunctionFromName(std::string_view name);
+std::string_view FunctionName(Function function);
+
+// A single instruction of the compiled formula. The program is stored in
+// postfix order and executed by a stack machine, so evaluation does not touch
+// the expression tree at all.
+struct Instruction {
+    enum class Op : std::uint8_t {
+        PushNumber,  // push `number`
+        LoadCell,    // push the numeric value of `cell`
+        LoadRange,   // push the partial `function` of range `index` and the number of its values
+        Aggregate,   // replace `index` (value, count) pairs with their `function`
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Negate,
+    };
+
+    explicit Instruction(Op op)
+        : op(op)
+        , number(0) {
+    }
+
+    explicit Instruction(double value)
+        : op(Op::PushNumber)
+        , number(value) {
+    }
+
+    explicit Instruction(Position pos)
+        : op(Op::LoadCell)
+        , cell(pos) {
+    }
+
+    Instruction(Op op, Function function, std::uint32_t index)
+        : op(op)
+        , function(function)
+        , index(index) {
+    }
+
+    Op op;
+    Function function = Function::Sum;
+    union {
+        double number;
+        Position cell;
+        std::uint32_t index;
+    };
+};
+
+using Program = std::vector<Instruction>;
+
+// A tree node in the postfix form kept by sheet snapshots. Unlike the printed
+// formula it keeps numbers exactly, and the tree is rebuilt from it without
+// lexing and parsing the text.
+struct SerializedNode {
+    enum class Kind : std::uint8_t {
+        Number,
+        Cell,
+        Range,
+        UnaryOp,
+        BinaryOp,
+        Function,
+    };
+
+    Kind kind = Kind::Number;
+    char op = 0;                        // UnaryOp, BinaryOp
+    Function function = Function::Sum;  // Function
+    std::uint8_t reserved = 0;
+    std::uint32_t arg_count = 0;        // Function
+    double number = 0;                  // Number
+    std::int32_t coords[4] = {};        // Cell: row, col; Range: from.row, from.col, to.row, to.col
+};
+
+// Memory of one formula: the tree nodes and the referenced positions are
+// placed in a buffer allocated together with the arena, so a typical formula
+// costs a single allocation. Only unusually large formulas take further blocks
+// from the default resource. Everything is released at once with the arena:
+// destructors of the nodes are not run, and whatever their members own must
+// come from the same arena.
+class Arena {
+public:
+    Arena()
+        : resource_(buffer_, sizeof(buffer_)) {
+    }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    template <typename T, typename... Args>
+    T* Make(Args&&... args) {
+        void* memory = resource_.allocate(sizeof(T), alignof(T));
+        return new (memory) T(std::forward<Args>(args)...);
+    }
+
+    std::pmr::memory_resource* GetResource() {
+        return &resource_;
+    }
+
+private:
+    static constexpr std::size_t INITIAL_SIZE = 256;
+
+    alignas(std::max_align_t) std::byte buffer_[INITIAL_SIZE];
+    std::pmr::monotonic_buffer_resource resource_;
+};
+
+inline Position Shift(Position pos, Position offset) {
+    return {pos.row + offset.row, pos.col + offset.col};
 }
 
+inline Range Shift(Range range, Position offset) {
+    return {Shift(range.from, offset), Shift(range.to, offset)};
+}
+}  // namespace ASTImpl
+
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
 class FormulaAST {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+    explicit FormulaAST(std::unique_ptr<ASTImpl::Arena> arena,
+                        const ASTImpl::Expr* root_expr,
+                        std::pmr::forward_list<Position> cells,
+                        std::pmr::vector<Range> ranges);
+    FormulaAST(FormulaAST&&);
+    // the lists keep the allocator of their arena, so a moved-into formula
+    // could not take over the nodes of another one
+    FormulaAST& operator=(FormulaAST&&) = delete;
     ~FormulaAST();
 
-    double Execute(const SheetInterface& sheet) const;
+    using Value = std::variant<double, FormulaError>;
+
+    // Errors are returned as values, evaluation never throws FormulaError.
+    // With a non-zero offset the formula is evaluated and printed as if every
+    // reference was shifted by it, so one tree serves all formulas of the same
+    // shape (e.g. a filled-down column), see FormulaTemplates.
+    // Range arguments are read from `range_source`, single cells from `sheet`.
+    Value Execute(const SheetInterface& sheet, const RangeSource& range_source, Position offset = {}) const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
+    void PrintFormula(std::ostream& out, Position offset = {}) const;
+
+    // Appends the tree in postfix order, see ASTImpl::SerializedNode
+    void Serialize(std::vector<ASTImpl::SerializedNode>& out) const;
+    // Rebuilds a serialized tree. Throws ParsingError if the nodes do not make
+    // a valid formula, e.g. when they were read from a damaged file
+    static FormulaAST Deserialize(const ASTImpl::SerializedNode* nodes, std::size_t count);
 
-    std::forward_list<Position>& GetCells() {
+    // references to single cells, sorted
+    std::pmr::forward_list<Position>& GetCells() {
         return cells_;
     }
 
-    const std::forward_list<Position>& GetCells() const {
+    const std::pmr::forward_list<Position>& GetCells() const {
         return cells_;
     }
 
+    // references to single cells, sorted and without duplicates, computed once
+    // when the tree is built
+    const std::pmr::vector<Position>& GetUniqueCells() const {
+        return unique_cells_;
+    }
+
+    // Ranges in the order of LoadRange indices, their cells are not in GetCells()
+    const std::pmr::vector<Range>& GetRanges() const {
+        return ranges_;
+    }
+
+private:
+    std::unique_ptr<ASTImpl::Arena> arena_;  // owns the tree and the lists below
+    const ASTImpl::Expr* root_expr_;         // used for printing only
+    std::pmr::forward_list<Position> cells_;
+    std::pmr::vector<Position> unique_cells_;
+    std::pmr::vector<Range> ranges_;
+    ASTImpl::Program program_;
+    std::size_t max_stack_depth_ = 0;
+};
+
+// Assembles a FormulaAST from nodes supplied in postfix order. Both parsers
+// feed it, so they produce identical trees.
+class FormulaASTBuilder {
+public:
+    FormulaASTBuilder();
+    ~FormulaASTBuilder();
+
+    void AddNumber(std::string_view text);  // throws ParsingError
+    void AddNumber(double value);
+    void AddCell(std::string_view text);    // throws FormulaException for an invalid position
+    void AddCell(Position pos);             // throws FormulaException
+    // a range may only be an argument of a function
+    void AddRange(std::string_view from, std::string_view to);  // throws FormulaException
+    void AddRange(Range range);                                 // throws FormulaException
+    void AddUnaryOp(char op);
+    void AddBinaryOp(char op);
+    // takes the last arg_count nodes as arguments
+    void AddFunction(std::string_view name, std::size_t arg_count);  // throws ParsingError
+    void AddFunction(ASTImpl::Function function, std::size_t arg_count);
+
+    FormulaAST Build();
+
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
-    std::forward_list<Position> cells_;
+    std::unique_ptr<ASTImpl::Arena> arena_;
+    std::vector<const ASTImpl::Expr*> args_;
+    std::pmr::forward_list<Position> cells_;
+    std::pmr::vector<Range> ranges_;
+};
+
+enum class FormulaParserKind {
+    Pratt,  // hand-written lexer and Pratt parser, the default
+    Antlr,  // generated from Formula.g4, built with SPREADSHEET_WITH_ANTLR only
 };
 
+// Selects the parser used by ParseFormulaAST, the setting is process-wide
+void SetFormulaParser(FormulaParserKind kind);
+FormulaParserKind GetFormulaParser();
+
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
\ No newline at end of file
+FormulaAST ParseFormulaAST(const std::string& in_str);
+
+FormulaAST ParseFormulaASTPratt(std::string_view in_str);
+#ifdef SPREADSHEET_WITH_ANTLR
+FormulaAST ParseFormulaASTAntlr(std::istream& in);
+#endif
\ No newline at end of file
@@ -0,0 +1,100 @@
+#include "FormulaAST.h"
+
+#include "FormulaBaseListener.h"
+#include "FormulaLexer.h"
+#include "FormulaParser.h"
+
+#include <cassert>
+#include <memory>
+
+namespace ASTImpl {
+namespace {
+class ParseASTListener final : public FormulaBaseListener {
+public:
+    FormulaAST Build() {
+        return builder_.Build();
+    }
+
+public:
+    void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
+        if (ctx->SUB()) {
+            builder_.AddUnaryOp('-');
+        } else {
+            assert(ctx->ADD() != nullptr);
+            builder_.AddUnaryOp('+');
+        }
+    }
+
+    void exitLiteral(FormulaParser::LiteralContext* ctx) override {
+        builder_.AddNumber(ctx->NUMBER()->getSymbol()->getText());
+    }
+
+    void exitCell(FormulaParser::CellContext* ctx) override {
+        builder_.AddCell(ctx->CELL()->getSymbol()->getText());
+    }
+
+    void exitRange(FormulaParser::RangeContext* ctx) override {
+        builder_.AddRange(ctx->CELL(0)->getSymbol()->getText(), ctx->CELL(1)->getSymbol()->getText());
+    }
+
+    void exitFunction(FormulaParser::FunctionContext* ctx) override {
+        builder_.AddFunction(ctx->FUNC()->getSymbol()->getText(), ctx->arg().size());
+    }
+
+    void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
+        if (ctx->ADD()) {
+            builder_.AddBinaryOp('+');
+        } else if (ctx->SUB()) {
+            builder_.AddBinaryOp('-');
+        } else if (ctx->MUL()) {
+            builder_.AddBinaryOp('*');
+        } else {
+            assert(ctx->DIV() != nullptr);
+            builder_.AddBinaryOp('/');
+        }
+    }
+
+    void visitErrorNode(antlr4::tree::ErrorNode* node) override {
+        throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
+    }
+
+private:
+    FormulaASTBuilder builder_;
+};
+
+class BailErrorListener : public antlr4::BaseErrorListener {
+public:
+    void syntaxError(antlr4::Recognizer* /* recognizer */, antlr4::Token* /* offendingSymbol */,
+                     size_t /* line */, size_t /* charPositionInLine */, const std::string& msg,
+                     std::exception_ptr /* e */
+                     ) override {
+        throw ParsingError("Error when lexing: " + msg);
+    }
+};
+
+}  // namespace
+}  // namespace ASTImpl
+
+FormulaAST ParseFormulaASTAntlr(std::istream& in) {
+    using namespace antlr4;
+
+    ANTLRInputStream input(in);
+
+    FormulaLexer lexer(&input);
+    ASTImpl::BailErrorListener error_listener;
+    lexer.removeErrorListeners();
+    lexer.addErrorListener(&error_listener);
+
+    CommonTokenStream tokens(&lexer);
+
+    FormulaParser parser(&tokens);
+    auto error_handler = std::make_shared<BailErrorStrategy>();
+    parser.setErrorHandler(error_handler);
+    parser.removeErrorListeners();
+
+    tree::ParseTree* tree = parser.main();
+    ASTImpl::ParseASTListener listener;
+    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+
+    return listener.Build();
+}
@@ -0,0 +1,335 @@
+#include "FormulaAST.h"
+
+#include <cctype>
+#include <string>
+#include <string_view>
+
+// Hand-written lexer and Pratt parser for the Formula.g4 grammar. It feeds the
+// same FormulaASTBuilder as the ANTLR listener, in the same postfix order, so
+// both parsers produce identical trees.
+
+namespace ASTImpl {
+namespace {
+
+enum class TokenType {
+    Number,
+    Cell,
+    Function,
+    Add,
+    Sub,
+    Mul,
+    Div,
+    LeftParen,
+    RightParen,
+    Colon,
+    Comma,
+    End,
+};
+
+struct Token {
+    TokenType type;
+    std::string_view text;
+};
+
+bool IsDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+bool IsUpper(char c) {
+    return c >= 'A' && c <= 'Z';
+}
+
+// Longest-match lexer over the input view, tokens reference the input
+class Lexer {
+public:
+    explicit Lexer(std::string_view input)
+        : input_(input) {
+        Advance();
+    }
+
+    const Token& Peek() const {
+        return current_;
+    }
+
+    Token Next() {
+        Token token = current_;
+        Advance();
+        return token;
+    }
+
+private:
+    char At(size_t pos) const {
+        return pos < input_.size() ? input_[pos] : '\0';
+    }
+
+    size_t SkipDigits(size_t pos) const {
+        while (IsDigit(At(pos))) {
+            ++pos;
+        }
+        return pos;
+    }
+
+    // NUMBER : UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+    size_t ScanNumber(size_t pos) const {
+        size_t end = SkipDigits(pos);
+        bool has_int = end != pos;
+
+        if (At(end) == '.' && IsDigit(At(end + 1))) {
+            end = SkipDigits(end + 1);
+        } else if (!has_int) {
+            return pos;
+        }
+
+        if (At(end) == 'e' || At(end) == 'E') {
+            size_t exp = end + 1;
+            if (At(exp) == '+' || At(exp) == '-') {
+                ++exp;
+            }
+            if (IsDigit(At(exp))) {
+                end = SkipDigits(exp);
+            }
+        }
+
+        return end;
+    }
+
+    // CELL : [A-Z]+[0-9]+
+    size_t ScanCell(size_t pos) const {
+        size_t letters_end = pos;
+        while (IsUpper(At(letters_end))) {
+            ++letters_end;
+        }
+
+        size_t end = SkipDigits(letters_end);
+        return end == letters_end ? pos : end;
+    }
+
+    // FUNC : 'SUM' | 'MIN' | 'MAX' | 'AVERAGE'
+    size_t ScanFunction(size_t pos) const {
+        size_t end = pos;
+        while (IsUpper(At(end))) {
+            ++end;
+        }
+
+        return FunctionFromName(input_.substr(pos, end - pos)) ? end : pos;
+    }
+
+    void Advance() {
+        while (pos_ < input_.size()
+               && (input_[pos_] == ' ' || input_[pos_] == '\t' || input_[pos_] == '\n' || input_[pos_] == '\r')) {
+            ++pos_;
+        }
+
+        if (pos_ == input_.size()) {
+            current_ = {TokenType::End, {}};
+            return;
+        }
+
+        size_t start = pos_;
+        size_t end = start + 1;
+        char c = input_[start];
+
+        switch (c) {
+            case '+':
+                current_.type = TokenType::Add;
+                break;
+            case '-':
+                current_.type = TokenType::Sub;
+                break;
+            case '*':
+                current_.type = TokenType::Mul;
+                break;
+            case '/':
+                current_.type = TokenType::Div;
+                break;
+            case '(':
+                current_.type = TokenType::LeftParen;
+                break;
+            case ')':
+                current_.type = TokenType::RightParen;
+                break;
+            case ':':
+                current_.type = TokenType::Colon;
+                break;
+            case ',':
+                current_.type = TokenType::Comma;
+                break;
+            default:
+                if (IsDigit(c) || c == '.') {
+                    current_.type = TokenType::Number;
+                    end = ScanNumber(start);
+                } else if (IsUpper(c)) {
+                    // a cell name is longer than a function name it starts with
+                    current_.type = TokenType::Cell;
+                    end = ScanCell(start);
+                    if (end == start) {
+                        current_.type = TokenType::Function;
+                        end = ScanFunction(start);
+                    }
+                } else {
+                    end = start;
+                }
+
+                if (end == start) {
+                    throw ParsingError("Error when lexing: token recognition error at: '"
+                                       + std::string(1, c) + "'");
+                }
+        }
+
+        current_.text = input_.substr(start, end - start);
+        pos_ = end;
+    }
+
+    std::string_view input_;
+    size_t pos_ = 0;
+    Token current_{TokenType::End, {}};
+};
+
+// Binding powers follow the order of alternatives in Formula.g4: the prefix
+// operators bind tighter than '*' and '/', which bind tighter than '+' and '-'.
+enum BindingPower {
+    BP_NONE,
+    BP_ADDITIVE,
+    BP_MULTIPLICATIVE,
+    BP_UNARY,
+};
+
+class Parser {
+public:
+    Parser(std::string_view input, FormulaASTBuilder& builder)
+        : lexer_(input)
+        , builder_(builder) {
+    }
+
+    // main : expr EOF
+    void ParseMain() {
+        ParseExpr(BP_NONE);
+        Expect(TokenType::End);
+    }
+
+private:
+    static BindingPower InfixPower(TokenType type) {
+        switch (type) {
+            case TokenType::Add:
+            case TokenType::Sub:
+                return BP_ADDITIVE;
+            case TokenType::Mul:
+            case TokenType::Div:
+                return BP_MULTIPLICATIVE;
+            default:
+                return BP_NONE;
+        }
+    }
+
+    void ParseExpr(BindingPower min_power) {
+        ParsePrefix();
+        ParseInfix(min_power);
+    }
+
+    // Operators of the same power associate to the left
+    void ParseInfix(BindingPower min_power) {
+        while (true) {
+            BindingPower power = InfixPower(lexer_.Peek().type);
+            if (power <= min_power) {
+                break;
+            }
+
+            Token op = lexer_.Next();
+            ParseExpr(power);
+            builder_.AddBinaryOp(op.text.front());
+        }
+    }
+
+    void ParsePrefix() {
+        Token token = lexer_.Next();
+
+        switch (token.type) {
+            case TokenType::Number:
+                builder_.AddNumber(token.text);
+                break;
+            case TokenType::Cell:
+                builder_.AddCell(token.text);
+                break;
+            case TokenType::Add:
+            case TokenType::Sub:
+                ParseExpr(BP_UNARY);
+                builder_.AddUnaryOp(token.text.front());
+                break;
+            case TokenType::LeftParen:
+                ParseExpr(BP_NONE);
+                Expect(TokenType::RightParen);
+                break;
+            case TokenType::Function:
+                ParseFunction(token);
+                break;
+            default:
+                Fail(token);
+        }
+    }
+
+    // FUNC '(' arg (',' arg)* ')'
+    void ParseFunction(const Token& name) {
+        Expect(TokenType::LeftParen);
+
+        size_t arg_count = 0;
+        do {
+            ParseArgument();
+            ++arg_count;
+        } while (Accept(TokenType::Comma));
+
+        Expect(TokenType::RightParen);
+        builder_.AddFunction(name.text, arg_count);
+    }
+
+    // arg : CELL ':' CELL | expr
+    void ParseArgument() {
+        if (lexer_.Peek().type != TokenType::Cell) {
+            ParseExpr(BP_NONE);
+            return;
+        }
+
+        Token from = lexer_.Next();
+        if (Accept(TokenType::Colon)) {
+            Token to = Expect(TokenType::Cell);
+            builder_.AddRange(from.text, to.text);
+            return;
+        }
+
+        // the cell starts an expression
+        builder_.AddCell(from.text);
+        ParseInfix(BP_NONE);
+    }
+
+    bool Accept(TokenType type) {
+        if (lexer_.Peek().type != type) {
+            return false;
+        }
+        lexer_.Next();
+        return true;
+    }
+
+    Token Expect(TokenType type) {
+        Token token = lexer_.Next();
+        if (token.type != type) {
+            Fail(token);
+        }
+        return token;
+    }
+
+    [[noreturn]] static void Fail(const Token& token) {
+        throw ParsingError("Error when parsing: "
+                           + (token.type == TokenType::End ? std::string("<EOF>") : std::string(token.text)));
+    }
+
+    Lexer lexer_;
+    FormulaASTBuilder& builder_;
+};
+
+}  // namespace
+}  // namespace ASTImpl
+
+FormulaAST ParseFormulaASTPratt(std::string_view in_str) {
+    FormulaASTBuilder builder;
+    ASTImpl::Parser(in_str, builder).ParseMain();
+    return builder.Build();
+}
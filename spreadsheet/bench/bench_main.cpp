@@ -0,0 +1,1142 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <streambuf>
+#include <random>
+#include <string>
+#include <thread>
+#include <variant>
+#include <vector>
+
+#include "FormulaAST.h"
+#include "cell.h"
+#include "common.h"
+#include "formula.h"
+#include "journal.h"
+#include "sheet.h"
+#include "storage.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#define SPREADSHEET_BENCH_RUSAGE
+#endif
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+namespace {
+
+// Счётчик выделений памяти во всей программе
+std::atomic<size_t> allocations{0};
+// Объём занятой через new памяти. Размер блока хранится перед ним, чтобы
+// освобождение без размера тоже учитывалось
+std::atomic<size_t> live_bytes{0};
+constexpr size_t ALLOCATION_HEADER = alignof(std::max_align_t);
+
+}  // namespace
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(ALLOCATION_HEADER + size)) {
+        live_bytes.fetch_add(size, std::memory_order_relaxed);
+        *static_cast<size_t*>(ptr) = size;
+        return static_cast<char*>(ptr) + ALLOCATION_HEADER;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    if (ptr == nullptr) {
+        return;
+    }
+    // Адрес блока вычисляется через целое, чтобы компилятор не считал его
+    // выходом за границы освобождаемого объекта
+    void* block = reinterpret_cast<void*>(reinterpret_cast<std::uintptr_t>(ptr) - ALLOCATION_HEADER);
+    size_t size;
+    std::memcpy(&size, block, sizeof(size));
+    live_bytes.fetch_sub(size, std::memory_order_relaxed);
+    std::free(block);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    operator delete(ptr);
+}
+
+namespace {
+
+// Замер времени и числа выделений памяти с момента создания
+class Timer {
+public:
+    Timer() : start_(std::chrono::steady_clock::now()), allocations_(allocations.load()) {}
+
+    double ElapsedNs() const {
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start_).count();
+    }
+
+    size_t Allocations() const {
+        return allocations.load() - allocations_;
+    }
+
+private:
+    std::chrono::steady_clock::time_point start_;
+    size_t allocations_;
+};
+
+// Результаты печатаются текстом или, с ключом --json, в формате JSON Lines:
+// по объекту на строку, чтобы результаты двух сборок можно было сравнить построчно
+bool json_output = false;
+// Имя выполняемого замера из таблицы BENCHMARKS
+const char* current_bench = "";
+
+// Число в JSON не может быть бесконечностью или NaN
+void PrintJsonNumber(double value) {
+    if (std::isfinite(value)) {
+        std::cout << value;
+    } else {
+        std::cout << "null";
+    }
+}
+
+// Время и число выделений памяти на операцию
+void Report(const std::string& name, const Timer& timer, size_t ops) {
+    const double ns_per_op = timer.ElapsedNs() / static_cast<double>(ops);
+    const double allocations_per_op = static_cast<double>(timer.Allocations()) / static_cast<double>(ops);
+    if (json_output) {
+        std::cout << "{\"bench\":\"" << current_bench << "\",\"name\":\"" << name << "\",\"ns_per_op\":";
+        PrintJsonNumber(ns_per_op);
+        std::cout << ",\"ops\":" << ops << ",\"allocations_per_op\":";
+        PrintJsonNumber(allocations_per_op);
+        std::cout << "}\n";
+    } else {
+        std::cout << name << ": " << ns_per_op << " ns/op (" << ops << " ops, " << allocations_per_op
+                  << " allocations/op)\n";
+    }
+}
+
+// Прочая величина замера в указанных единицах
+void ReportValue(const std::string& name, double value, const std::string& unit) {
+    if (json_output) {
+        std::cout << "{\"bench\":\"" << current_bench << "\",\"name\":\"" << name << "\",\"value\":";
+        PrintJsonNumber(value);
+        std::cout << ",\"unit\":\"" << unit << "\"}\n";
+    } else {
+        std::cout << name << ": " << value << " " << unit << "\n";
+    }
+}
+
+// Пиковый объём резидентной памяти процесса в КиБ, 0 - неизвестен.
+// В Linux пик сбрасывается перед каждым замером (ResetPeakRss), в других
+// системах он накапливается за всё время работы
+size_t PeakRssKib() {
+#ifdef __linux__
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind("VmHWM:", 0) == 0) {
+            return std::strtoull(line.c_str() + 6, nullptr, 10);
+        }
+    }
+#endif
+#ifdef SPREADSHEET_BENCH_RUSAGE
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+        return static_cast<size_t>(usage.ru_maxrss) / 1024;
+#else
+        return static_cast<size_t>(usage.ru_maxrss);
+#endif
+    }
+#endif
+    return 0;
+}
+
+void ResetPeakRss() {
+#ifdef __GLIBC__
+    // Память, освобождённая предыдущими замерами, возвращается системе,
+    // иначе она остаётся в резидентном объёме следующего
+    malloc_trim(0);
+#endif
+#ifdef __linux__
+    // Запись 5 в clear_refs сбрасывает VmHWM до текущего объёма
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    clear_refs << "5";
+#endif
+}
+
+// Плотный лист: 1000 x 1000 ячеек подряд
+std::vector<Position> DensePositions() {
+    std::vector<Position> result;
+    result.reserve(1'000'000);
+    for (int row = 0; row < 1000; ++row) {
+        for (int col = 0; col < 1000; ++col) {
+            result.push_back({row, col});
+        }
+    }
+    return result;
+}
+
+// Разреженный лист: 1M ячеек через одну строку и один столбец в области 2000 x 2000
+std::vector<Position> SparsePositions() {
+    std::vector<Position> result;
+    result.reserve(1'000'000);
+    for (int row = 0; row < 2000; row += 2) {
+        for (int col = 0; col < 2000; col += 2) {
+            result.push_back({row, col});
+        }
+    }
+    return result;
+}
+
+// Сравнение хранилищ на реальных ячейках: вставка, случайный поиск и построчный
+// обход ограничивающей области (так печатает лист)
+void BenchStorage(const std::string& workload, const std::vector<Position>& positions, Size area) {
+    Sheet sheet;
+
+    std::vector<Position> lookups = positions;
+    std::shuffle(lookups.begin(), lookups.end(), std::mt19937(42));
+
+    {
+        PositionMap<Cell> cells;
+        Timer insert_timer;
+        for (Position pos : positions) {
+            cells.emplace(pos, Cell(sheet, pos));
+        }
+        Report("map/" + workload + "/insert", insert_timer, positions.size());
+
+        size_t found = 0;
+        Timer lookup_timer;
+        for (Position pos : lookups) {
+            found += cells.find(pos) != cells.end();
+        }
+        Report("map/" + workload + "/lookup", lookup_timer, lookups.size());
+
+        size_t visited = 0;
+        Timer scan_timer;
+        for (int row = 0; row < area.rows; ++row) {
+            for (int col = 0; col < area.cols; ++col) {
+                visited += cells.count({row, col});
+            }
+        }
+        Report("map/" + workload + "/scan", scan_timer, visited);
+
+        if (found != positions.size() || visited != positions.size()) {
+            std::cerr << "map/" << workload << ": unexpected cell count\n";
+        }
+    }
+
+    {
+        TiledStorage<Cell> cells;
+        Timer insert_timer;
+        for (Position pos : positions) {
+            cells.Emplace(pos, sheet, pos);
+        }
+        Report("tiled/" + workload + "/insert", insert_timer, positions.size());
+
+        size_t found = 0;
+        Timer lookup_timer;
+        for (Position pos : lookups) {
+            found += cells.Find(pos) != nullptr;
+        }
+        Report("tiled/" + workload + "/lookup", lookup_timer, lookups.size());
+
+        size_t visited = 0;
+        Timer scan_timer;
+        cells.ForEach([&visited](Position, const Cell&) {
+            ++visited;
+        });
+        Report("tiled/" + workload + "/scan", scan_timer, visited);
+
+        if (found != positions.size() || visited != positions.size()) {
+            std::cerr << "tiled/" << workload << ": unexpected cell count\n";
+        }
+    }
+}
+
+void BenchStorageDense() {
+    BenchStorage("dense", DensePositions(), {1000, 1000});
+}
+
+void BenchStorageSparse() {
+    BenchStorage("sparse", SparsePositions(), {2000, 2000});
+}
+
+// Запись 100k ячеек по одной в пустой лист: тексты, числа и формулы,
+// ссылающиеся на числа соседнего блока
+void BenchSetCell() {
+    constexpr int ROWS = 10'000;
+    constexpr int COLS = 10;
+    constexpr size_t CELLS = static_cast<size_t>(ROWS) * COLS;
+
+    auto run = [](const std::string& name, Sheet& sheet, int first_col, auto text) {
+        std::vector<std::pair<Position, std::string>> cells;
+        cells.reserve(CELLS);
+        for (int row = 0; row < ROWS; ++row) {
+            for (int col = first_col; col < first_col + COLS; ++col) {
+                cells.emplace_back(Position{row, col}, text(row, col));
+            }
+        }
+
+        Timer timer;
+        for (auto& [pos, cell_text] : cells) {
+            sheet.SetCell(pos, std::move(cell_text));
+        }
+        Report(name, timer, CELLS);
+    };
+
+    {
+        Sheet sheet;
+        run("set_cell/text", sheet, 0, [](int row, int col) {
+            return "item" + std::to_string(row * COLS + col);
+        });
+    }
+
+    Sheet sheet;
+    run("set_cell/number", sheet, 0, [](int row, int col) {
+        return std::to_string(row * COLS + col) + ".5";
+    });
+    run("set_cell/formula", sheet, COLS, [](int row, int col) {
+        return "=" + Position{row, col - COLS}.ToString() + "*2+1";
+    });
+}
+
+// Пересчёт 10k формул, зависящих от одной входной ячейки, после каждой её правки.
+// При broken_input во входной ячейке текст, и все формулы вычисляются в #VALUE!
+void RunRecalc(const std::string& name, bool broken_input) {
+    constexpr int ROWS = 10'000;
+    constexpr int ROUNDS = 100;
+
+    Sheet sheet;
+    sheet.SetCell({0, 0}, "1");
+    for (int row = 0; row < ROWS; ++row) {
+        std::string r = std::to_string(row + 1);
+        sheet.SetCell({row, 1}, r);
+        sheet.SetCell({row, 2}, "=(A1+B" + r + ")*2-B" + r + "/3+-(A1*0.5)");
+    }
+
+    size_t errors = 0;
+    Timer timer;
+    for (int round = 0; round < ROUNDS; ++round) {
+        sheet.SetCell({0, 0}, (broken_input ? "x" : "") + std::to_string(round));
+        for (int row = 0; row < ROWS; ++row) {
+            errors += std::holds_alternative<FormulaError>(sheet.GetCell({row, 2})->GetValue());
+        }
+    }
+    Report(name, timer, static_cast<size_t>(ROWS) * ROUNDS);
+
+    if (errors != (broken_input ? static_cast<size_t>(ROWS) * ROUNDS : 0)) {
+        std::cerr << name << ": unexpected error count\n";
+    }
+}
+
+void BenchRecalc() {
+    RunRecalc("recalc/clean", false);
+}
+
+void BenchRecalcErrors() {
+    RunRecalc("recalc/errors", true);
+}
+
+// Поток правок одного входа (котировки) без чтения значений между ними.
+// Вход пересчитывается в курс B1, от которого зависят 10k формул: их кеши
+// сбрасываются только при первой правке, дальше обход останавливается на B1
+void BenchTicker() {
+    constexpr int ROWS = 10'000;
+    constexpr int TICKS = 100'000;
+
+    Sheet sheet;
+    sheet.SetCell({0, 0}, "1");
+    sheet.SetCell({0, 1}, "=A1*1.5");
+    for (int row = 0; row < ROWS; ++row) {
+        sheet.SetCell({row, 2}, "=B1*" + std::to_string(row + 1));
+    }
+    sheet.Recalculate();
+
+    size_t touched = 0;
+    Timer timer;
+    for (int tick = 0; tick < TICKS; ++tick) {
+        sheet.SetCell({0, 0}, std::to_string(tick));
+        touched += sheet.GetLastInvalidationCount();
+    }
+    Report("ticker/set_cell", timer, TICKS);
+    ReportValue("ticker/set_cell", static_cast<double>(touched) / TICKS, "cells touched/edit");
+}
+
+// Широкое ветвление: 100k формул ссылаются на одну входную ячейку.
+// Правка входа с пересчётом всех зависимых
+void BenchFanOut() {
+    constexpr int FORMULAS = 100'000;
+    constexpr int ROUNDS = 10;
+
+    std::vector<std::pair<Position, std::string>> cells{{{0, 0}, "1"}};
+    cells.reserve(FORMULAS + 1);
+    for (int i = 0; i < FORMULAS; ++i) {
+        cells.emplace_back(Position{i % Position::MAX_ROWS, i / Position::MAX_ROWS + 1},
+                           "=A1*" + std::to_string(i % 1000 + 1));
+    }
+
+    Sheet sheet;
+    sheet.SetCells(std::move(cells));
+    sheet.Recalculate();
+
+    Timer timer;
+    for (int round = 0; round < ROUNDS; ++round) {
+        sheet.SetCell({0, 0}, std::to_string(round + 2));
+        sheet.Recalculate();
+    }
+    Report("fan_out/recalculate", timer, static_cast<size_t>(FORMULAS) * ROUNDS);
+}
+
+// Пропускная способность разбора формул выбранным парсером
+void RunParse(const std::string& name, FormulaParserKind kind) {
+    std::vector<std::string> formulas;
+    size_t bytes = 0;
+    for (int row = 1; row <= 100'000; ++row) {
+        std::string r = std::to_string(row % 16000 + 1);
+        formulas.push_back(row % 2 == 0 ? "A" + r + "+1" : "(A" + r + "+B" + r + ")*2.5-C" + r + "/(D1+-3e2)");
+        bytes += formulas.back().size();
+    }
+
+    SetFormulaParser(kind);
+    size_t nodes_checksum = 0;
+    Timer timer;
+    for (const auto& formula : formulas) {
+        nodes_checksum += !ParseFormulaAST(formula).GetCells().empty();
+    }
+    Report(name, timer, formulas.size());
+    ReportValue(name, static_cast<double>(bytes) / timer.ElapsedNs() * 1e9 / (1 << 20), "MB/s");
+    SetFormulaParser(FormulaParserKind::Pratt);
+
+    if (nodes_checksum != formulas.size()) {
+        std::cerr << name << ": unexpected parse result\n";
+    }
+}
+
+void BenchParse() {
+    RunParse("parse/pratt", FormulaParserKind::Pratt);
+#ifdef SPREADSHEET_WITH_ANTLR
+    RunParse("parse/antlr", FormulaParserKind::Antlr);
+#endif
+}
+
+// Загрузка 100k формул по одной и одним пакетом
+void BenchImport() {
+    constexpr int ROWS = 100'000;
+    constexpr int COLS = 10;
+
+    std::vector<std::pair<Position, std::string>> cells;
+    cells.reserve(ROWS);
+    for (int i = 0; i < ROWS; ++i) {
+        Position pos{i / COLS, i % COLS + 1};
+        // Каждая формула ссылается на вход в столбце A и на соседнюю ячейку слева
+        cells.emplace_back(pos, "=A" + std::to_string(pos.row + 1) + "+" + Position{pos.row, pos.col - 1}.ToString());
+    }
+
+    {
+        Sheet sheet;
+        Timer timer;
+        for (const auto& [pos, text] : cells) {
+            sheet.SetCell(pos, text);
+        }
+        Report("import/set_cell", timer, cells.size());
+    }
+
+    {
+        Sheet sheet;
+        Timer timer;
+        sheet.SetCells(cells);
+        Report("import/set_cells", timer, cells.size());
+    }
+}
+
+// Вычисляемые столбцы на всю высоту листа (~200k формул одной формы в каждом
+// столбце): отдельный разбор каждой формулы против общих шаблонов
+void BenchFillDown() {
+    constexpr int COLS = 12;
+    const int rows = Position::MAX_ROWS;
+
+    std::vector<std::pair<Position, std::string>> cells;
+    cells.reserve(static_cast<size_t>(rows) * COLS);
+    for (int row = 0; row < rows; ++row) {
+        const std::string index = std::to_string(row + 1);
+        for (int col = 0; col < COLS; ++col) {
+            cells.emplace_back(Position{row, col + 2},
+                               "=A" + index + "*B" + index + "+" + std::to_string(col) + "/(1+A" + index + ")");
+        }
+    }
+
+    auto run = [&cells](const std::string& name, auto parse) {
+        std::vector<std::unique_ptr<FormulaInterface>> formulas;
+        formulas.reserve(cells.size());
+        Timer timer;
+        for (const auto& [pos, text] : cells) {
+            formulas.push_back(parse(text.substr(1), pos));
+        }
+        Report(name, timer, cells.size());
+    };
+
+    run("fill_down/parse_each", [](std::string text, Position) {
+        return ParseFormula(std::move(text));
+    });
+
+    FormulaTemplates templates;
+    run("fill_down/templates", [&templates](std::string text, Position pos) {
+        return templates.Parse(std::move(text), pos);
+    });
+
+    Sheet sheet;
+    for (int row = 0; row < rows; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(row));
+        sheet.SetCell({row, 1}, "2");
+    }
+    Timer timer;
+    sheet.SetCells(cells);
+    Report("fill_down/set_cells", timer, cells.size());
+}
+
+// Перезапуск с большим листом (~330k ячеек на всю высоту листа): загрузка
+// снимка против повторной записи всех текстов
+void BenchSnapshot() {
+    constexpr int INPUTS = 4;
+    constexpr int FORMULAS = 16;
+    const int rows = Position::MAX_ROWS;
+
+    std::vector<std::pair<Position, std::string>> cells;
+    cells.reserve(static_cast<size_t>(rows) * (INPUTS + FORMULAS));
+    for (int row = 0; row < rows; ++row) {
+        const std::string index = std::to_string(row + 1);
+        for (int col = 0; col < INPUTS; ++col) {
+            cells.emplace_back(Position{row, col}, std::to_string(row * INPUTS + col));
+        }
+        for (int col = 0; col < FORMULAS; ++col) {
+            // Формулы ссылаются на входы строки и на формулу слева, каждая
+            // четвёртая суммирует входы нескольких строк
+            std::string text = col % 4 == 0
+                ? "=SUM(A" + index + ":D" + std::to_string(std::min(row + 4, rows)) + ")/" + std::to_string(col + 1)
+                : "=" + Position{row, INPUTS + col - 1}.ToString() + "*A" + index + "+" + std::to_string(col);
+            cells.emplace_back(Position{row, INPUTS + col}, std::move(text));
+        }
+    }
+
+    const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_bench.snapshot").string();
+    {
+        Sheet sheet;
+        Timer timer;
+        sheet.SetCells(cells);
+        sheet.Recalculate();
+        Report("snapshot/set_cells+recalc", timer, cells.size());
+
+        timer = Timer();
+        sheet.SaveSnapshot(path);
+        Report("snapshot/save", timer, cells.size());
+    }
+    ReportValue("snapshot/file_size", static_cast<double>(std::filesystem::file_size(path)) / (1 << 20), "MiB");
+
+    Timer timer;
+    auto loaded = Sheet::LoadSnapshot(path);
+    Report("snapshot/load", timer, cells.size());
+
+    timer = Timer();
+    loaded->Recalculate();
+    Report("snapshot/recalc_after_load", timer, cells.size());
+
+    std::filesystem::remove(path);
+}
+
+// Загрузка TSV на всю высоту листа (16k строк x 40 столбцов): ImportTable
+// против чтения строк и записи каждого поля через SetCell
+void BenchImportTable() {
+    constexpr int COLS = 40;
+    const int rows = Position::MAX_ROWS;
+
+    auto make_table = [rows](bool with_formulas) {
+        std::string table;
+        for (int row = 0; row < rows; ++row) {
+            const std::string index = std::to_string(row + 1);
+            for (int col = 0; col < COLS; ++col) {
+                if (col > 0) {
+                    table += '\t';
+                }
+                if (with_formulas && col >= COLS - 4) {
+                    table += "=A" + index + "*B" + index + "+" + std::to_string(col);
+                } else if (col % 8 == 7) {
+                    table += "item-" + std::to_string(row % 97);
+                } else {
+                    table += std::to_string(row * COLS + col) + "." + std::to_string(col);
+                }
+            }
+            table += '\n';
+        }
+        return table;
+    };
+
+    const auto path = std::filesystem::temp_directory_path() / "spreadsheet_bench_import.tsv";
+    auto report = [](const std::string& name, const Timer& timer, size_t bytes, size_t fields) {
+        Report(name, timer, fields);
+        ReportValue(name, static_cast<double>(bytes) / timer.ElapsedNs() * 1e3, "MB/s");
+    };
+
+    for (bool with_formulas : {false, true}) {
+        const std::string table = make_table(with_formulas);
+        {
+            std::ofstream out(path, std::ios::binary);
+            out << table;
+        }
+        const size_t fields = static_cast<size_t>(rows) * COLS;
+        const std::string suffix = with_formulas ? "/formulas" : "/data";
+
+        {
+            Sheet sheet;
+            Timer timer;
+            std::ifstream input(path, std::ios::binary);
+            std::string line;
+            int row = 0;
+            while (std::getline(input, line)) {
+                int col = 0;
+                size_t begin = 0;
+                while (begin <= line.size()) {
+                    size_t end = std::min(line.find('\t', begin), line.size());
+                    if (end > begin) {
+                        sheet.SetCell({row, col}, line.substr(begin, end - begin));
+                    }
+                    begin = end + 1;
+                    ++col;
+                }
+                ++row;
+            }
+            report("import_table/set_cell" + suffix, timer, table.size(), fields);
+        }
+
+        {
+            Sheet sheet;
+            Timer timer;
+            std::ifstream input(path, std::ios::binary);
+            sheet.ImportTable(input, TableFormat::Tsv, {0, 0});
+            report("import_table/import" + suffix, timer, table.size(), fields);
+        }
+    }
+
+    std::filesystem::remove(path);
+}
+
+// Правки с журналом против правок без него, устойчивая запись всех правок и
+// восстановление из журнала
+void BenchJournal() {
+    constexpr int EDITS = 200'000;
+    constexpr int COLS = 10;
+
+    std::vector<std::pair<Position, std::string>> edits;
+    edits.reserve(EDITS);
+    for (int i = 0; i < EDITS; ++i) {
+        Position pos{(i / COLS) % Position::MAX_ROWS, i % COLS};
+        edits.emplace_back(pos, i % 2 == 0 ? std::to_string(i) : "=A" + std::to_string(pos.row + 1) + "+1");
+    }
+
+    {
+        Sheet sheet;
+        Timer timer;
+        for (const auto& [pos, text] : edits) {
+            sheet.SetCell(pos, text);
+        }
+        Report("journal/plain_set_cell", timer, edits.size());
+    }
+
+    const auto dir = std::filesystem::temp_directory_path() / "spreadsheet_bench_journal";
+    std::filesystem::remove_all(dir);
+    {
+        auto sheet = DurableSheet::Open(dir.string());
+        Timer timer;
+        for (const auto& [pos, text] : edits) {
+            sheet->SetCell(pos, text);
+        }
+        Report("journal/set_cell", timer, edits.size());
+
+        timer = Timer();
+        sheet->Sync();
+        Report("journal/sync_tail", timer, 1);
+
+        timer = Timer();
+        for (int i = 0; i < 100; ++i) {
+            sheet->SetCell({0, COLS}, std::to_string(i));
+            sheet->Sync();
+        }
+        Report("journal/set_cell+sync", timer, 100);
+    }
+
+    {
+        Timer timer;
+        auto sheet = DurableSheet::Open(dir.string());
+        Report("journal/replay", timer, sheet->GetReplayedCount());
+
+        timer = Timer();
+        sheet->Compact();
+        Report("journal/compact", timer, 1);
+    }
+
+    {
+        Timer timer;
+        auto sheet = DurableSheet::Open(dir.string());
+        Report("journal/open_after_compact", timer, 1);
+    }
+    std::filesystem::remove_all(dir);
+}
+
+// Цепочка из 100k формул, каждая ссылается на предыдущую: правка начала и пересчёт
+void BenchChain() {
+    constexpr int LENGTH = 100'000;
+    constexpr int ROUNDS = 10;
+    auto chain_pos = [](int i) {
+        return Position{i % Position::MAX_ROWS, i / Position::MAX_ROWS};
+    };
+
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> cells{{chain_pos(0), "0"}};
+    for (int i = 1; i < LENGTH; ++i) {
+        cells.emplace_back(chain_pos(i), "=" + chain_pos(i - 1).ToString() + "+1");
+    }
+    sheet.SetCells(std::move(cells));
+
+    Timer timer;
+    for (int round = 0; round < ROUNDS; ++round) {
+        sheet.SetCell(chain_pos(0), std::to_string(round));
+        sheet.Recalculate();
+    }
+    Report("chain/recalculate", timer, static_cast<size_t>(LENGTH) * ROUNDS);
+}
+
+// Проверка на циклы при правках цепочки из 1M формул (каждая ссылается на
+// предыдущую). Правка середины ссылкой назад не может замкнуть цикл, и обход
+// по рангам её не проходит; ссылка на конец цепочки замыкает цикл, и обход
+// ограничен ячейками между серединой и концом
+void BenchCycleCheck() {
+    constexpr int LENGTH = 1'000'000;
+    constexpr int EDITS = 1000;
+    constexpr int CYCLES = 5;
+    auto chain_pos = [](int i) {
+        return Position{i % Position::MAX_ROWS, i / Position::MAX_ROWS};
+    };
+
+    Sheet sheet;
+    {
+        std::vector<std::pair<Position, std::string>> cells{{chain_pos(0), "0"}};
+        cells.reserve(LENGTH);
+        for (int i = 1; i < LENGTH; ++i) {
+            cells.emplace_back(chain_pos(i), "=" + chain_pos(i - 1).ToString() + "+1");
+        }
+        Timer timer;
+        sheet.SetCells(std::move(cells));
+        Report("cycle_check/build_chain", timer, LENGTH);
+    }
+
+    auto edit = [&sheet, &chain_pos](const std::string& name, int index, auto text, int rounds) {
+        sheet.ResetStats();
+        size_t cycles = 0;
+        Timer timer;
+        for (int round = 0; round < rounds; ++round) {
+            try {
+                sheet.SetCell(chain_pos(index), text(round));
+            } catch (const CircularDependencyException&) {
+                ++cycles;
+            }
+        }
+        Report(name, timer, rounds);
+        ReportValue(name, static_cast<double>(sheet.GetStats().cycle_check_visits) / rounds, "cells visited/edit");
+        return cycles;
+    };
+
+    const std::string before_middle = chain_pos(LENGTH / 2 - 1).ToString();
+    edit("cycle_check/rewrite_middle", LENGTH / 2, [&before_middle](int round) {
+        return "=" + before_middle + "+" + std::to_string(round % 7 + 1);
+    }, EDITS);
+
+    const std::string before_tail = chain_pos(LENGTH - 2).ToString();
+    edit("cycle_check/rewrite_tail", LENGTH - 1, [&before_tail](int round) {
+        return "=" + before_tail + "+" + std::to_string(round % 7 + 1);
+    }, EDITS);
+
+    const std::string tail = chain_pos(LENGTH - 1).ToString();
+    size_t cycles = edit("cycle_check/close_cycle", LENGTH / 2, [&tail](int) {
+        return "=" + tail + "+1";
+    }, CYCLES);
+    if (cycles != CYCLES) {
+        std::cerr << "cycle_check: cycle not detected\n";
+    }
+}
+
+// Поток, отбрасывающий вывод без выделений памяти
+class NullBuffer : public std::streambuf {
+protected:
+    int overflow(int c) override {
+        return c;
+    }
+
+    std::streamsize xsputn(const char*, std::streamsize count) override {
+        return count;
+    }
+};
+
+// Цена трассировки: пересчёт цепочки из 100k формул с записью события на
+// каждую формулу против пересчёта без трассировки
+void BenchTracing() {
+    constexpr int LENGTH = 100'000;
+    constexpr int ROUNDS = 10;
+    auto chain_pos = [](int i) {
+        return Position{i % Position::MAX_ROWS, i / Position::MAX_ROWS};
+    };
+
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> cells{{chain_pos(0), "0"}};
+    for (int i = 1; i < LENGTH; ++i) {
+        cells.emplace_back(chain_pos(i), "=" + chain_pos(i - 1).ToString() + "+1");
+    }
+    sheet.SetCells(std::move(cells));
+
+    for (bool tracing : {false, true}) {
+        if (tracing) {
+            sheet.StartTracing(1 << 20);
+        }
+        Timer timer;
+        for (int round = 0; round < ROUNDS; ++round) {
+            sheet.SetCell(chain_pos(0), std::to_string(round));
+            sheet.Recalculate();
+        }
+        Report(tracing ? "tracing/on" : "tracing/off", timer, static_cast<size_t>(LENGTH) * ROUNDS);
+    }
+
+    NullBuffer buffer;
+    std::ostream output(&buffer);
+    Timer timer;
+    sheet.WriteTrace(output);
+    Report("tracing/write", timer, 1 << 20);
+}
+
+// Широкий лист: 1000 независимых столбцов по 100 формул, каждая ссылается на
+// формулу выше. Пересчёт после правки общего входа при числе потоков от 1 до N
+void BenchParallel() {
+    constexpr int ROWS = 100;
+    constexpr int COLS = 1000;
+    constexpr int ROUNDS = 10;
+
+    std::vector<std::pair<Position, std::string>> cells{{{0, 0}, "1"}};
+    for (int col = 1; col <= COLS; ++col) {
+        cells.emplace_back(Position{0, col}, "=A1*" + std::to_string(col));
+        for (int row = 1; row < ROWS; ++row) {
+            std::string above = Position{row - 1, col}.ToString();
+            cells.emplace_back(Position{row, col}, "=(" + above + "*1.0001+A1)/(" + above + "+2)-0.5");
+        }
+    }
+
+    Sheet sheet;
+    sheet.SetCells(std::move(cells));
+
+    // 1, 2, 4, ... и число ядер
+    const size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<size_t> thread_counts;
+    for (size_t threads = 1; threads < max_threads; threads *= 2) {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(max_threads);
+
+    double single_ns = 0;
+    for (size_t threads : thread_counts) {
+        sheet.SetRecalculationThreads(threads);
+
+        Timer timer;
+        for (int round = 0; round < ROUNDS; ++round) {
+            sheet.SetCell({0, 0}, std::to_string(round + 2));
+            sheet.Recalculate();
+        }
+        double elapsed = timer.ElapsedNs();
+        if (threads == 1) {
+            single_ns = elapsed;
+        }
+
+        const std::string name = "parallel/threads_" + std::to_string(threads);
+        Report(name, timer, static_cast<size_t>(ROWS) * COLS * ROUNDS);
+        ReportValue(name, single_ns / elapsed, "x speedup");
+    }
+}
+
+// Сумма столбца из 500 чисел: SUM(B1:B500) против B1+B2+...+B500.
+// Каждый раунд меняет первое слагаемое и заново вычисляет формулу
+void BenchAggregate() {
+    constexpr int ROWS = 500;
+    constexpr int ROUNDS = 10'000;
+
+    std::string chained = "=B1";
+    for (int row = 2; row <= ROWS; ++row) {
+        chained += "+B" + std::to_string(row);
+    }
+
+    for (const auto& [name, formula] : {std::pair{"aggregate/sum_range", "=SUM(B1:B" + std::to_string(ROWS) + ")"},
+                                        std::pair{"aggregate/chained_add", chained}}) {
+        Sheet sheet;
+        for (int row = 0; row < ROWS; ++row) {
+            sheet.SetCell({row, 1}, std::to_string(row % 97) + ".5");
+        }
+        sheet.SetCell({0, 0}, formula);
+
+        double checksum = 0;
+        Timer timer;
+        for (int round = 0; round < ROUNDS; ++round) {
+            sheet.SetCell({0, 1}, std::to_string(round));
+            sheet.Recalculate();
+            checksum += std::get<double>(sheet.GetCell({0, 0})->GetValue());
+        }
+        Report(name, timer, ROUNDS);
+
+        if (checksum <= 0) {
+            std::cerr << name << ": unexpected result\n";
+        }
+    }
+}
+
+// Формулы над полными столбцами: связывание диапазона не создаёт ячеек, а
+// правка ячейки вне диапазонов находит зависимых через индекс без перебора формул
+void BenchRangeDependencies() {
+    constexpr int FORMULAS = 1000;
+    constexpr int EDITS = 100'000;
+    const std::string full_column = "=SUM(A1:A" + std::to_string(Position::MAX_ROWS) + ")";
+
+    Sheet sheet;
+    Timer link_timer;
+    for (int row = 0; row < FORMULAS; ++row) {
+        sheet.SetCell({row, 1}, full_column);
+    }
+    Report("range_deps/link", link_timer, FORMULAS);
+
+    Timer edit_timer;
+    for (int i = 0; i < EDITS; ++i) {
+        sheet.SetCell({i % FORMULAS, 2}, std::to_string(i));
+    }
+    Report("range_deps/edit_outside", edit_timer, EDITS);
+
+    if (!(sheet.GetPrintableSize() == Size{FORMULAS, 3})) {
+        std::cerr << "range_deps: unexpected placeholder cells\n";
+    }
+}
+
+// Память на ячейку (вместе с тайлами хранилища и множествами зависимых) для
+// листов из 100k ячеек текста, чисел и формул, а также для чисел, разбросанных
+// по листу
+void BenchCellMemory() {
+    constexpr int ROWS = 10'000;
+    constexpr int COLS = 10;
+    constexpr double CELLS = ROWS * COLS;
+
+    ReportValue("cell_memory/sizeof_cell", sizeof(Cell), "bytes");
+
+    auto report = [](const std::string& name, size_t bytes_before, double cells) {
+        ReportValue(name, static_cast<double>(live_bytes.load() - bytes_before) / cells, "bytes/cell");
+    };
+
+    auto fill = [](Sheet& sheet, int first_col, auto text) {
+        for (int row = 0; row < ROWS; ++row) {
+            for (int col = first_col; col < first_col + COLS; ++col) {
+                sheet.SetCell({row, col}, text(row, col));
+            }
+        }
+    };
+
+    {
+        Sheet sheet;
+        size_t before = live_bytes.load();
+        fill(sheet, 0, [](int row, int col) {
+            return "item" + std::to_string(row * COLS + col);
+        });
+        report("cell_memory/text", before, CELLS);
+    }
+
+    {
+        Sheet sheet;
+        size_t before = live_bytes.load();
+        fill(sheet, 0, [](int row, int col) {
+            return std::to_string(row * COLS + col) + ".5";
+        });
+        report("cell_memory/number", before, CELLS);
+    }
+
+    {
+        // Формулы ссылаются на числа соседнего блока, в объём входят и их
+        // записи в множествах зависимых
+        Sheet sheet;
+        fill(sheet, 0, [](int row, int col) {
+            return std::to_string(row + col);
+        });
+        size_t before = live_bytes.load();
+        fill(sheet, COLS, [](int row, int col) {
+            return "=" + Position{row, col - COLS}.ToString() + "*2";
+        });
+        report("cell_memory/formula", before, CELLS);
+    }
+
+    // Те же числа вразброс: через строку и столбец (четверть слотов тайла) и по
+    // одной ячейке на тайл (сетка поменьше, чтобы тайлы уместились в памяти).
+    // Сюда входят и свободные слоты тайлов, их доля выводится отдельно по
+    // SheetStats
+    constexpr int SPARSE_ROWS = 100;
+    constexpr int SPARSE_COLS = 100;
+    constexpr double SPARSE_CELLS = SPARSE_ROWS * SPARSE_COLS;
+    for (int stride : {2, TiledStorage<Cell>::TILE_ROWS}) {
+        Sheet sheet;
+        size_t before = live_bytes.load();
+        for (int row = 0; row < SPARSE_ROWS; ++row) {
+            for (int col = 0; col < SPARSE_COLS; ++col) {
+                sheet.SetCell({row * stride, col * stride}, std::to_string(row * SPARSE_COLS + col) + ".5");
+            }
+        }
+        const std::string name = "cell_memory/number_stride_" + std::to_string(stride);
+        report(name, before, SPARSE_CELLS);
+        ReportValue(name + "_storage_overhead",
+                    static_cast<double>(sheet.GetStats().storage_overhead_bytes) / SPARSE_CELLS, "bytes/cell");
+    }
+}
+
+// Печать значений листа 1000 x 1000 из текстов длиннее буфера короткой строки:
+// через копирующий GetValue() и через PrintValues (GetValueView())
+void BenchPrintValues() {
+    constexpr int ROWS = 1000;
+    constexpr int COLS = 1000;
+
+    std::vector<std::pair<Position, std::string>> cells;
+    cells.reserve(static_cast<size_t>(ROWS) * COLS);
+    for (int row = 0; row < ROWS; ++row) {
+        for (int col = 0; col < COLS; ++col) {
+            cells.emplace_back(Position{row, col}, "'text value of cell " + std::to_string(col));
+        }
+    }
+    Sheet sheet;
+    sheet.SetCells(std::move(cells));
+
+    NullBuffer buffer;
+    std::ostream output(&buffer);
+    const size_t count = static_cast<size_t>(ROWS) * COLS;
+
+    {
+        Timer timer;
+        for (int row = 0; row < ROWS; ++row) {
+            for (int col = 0; col < COLS; ++col) {
+                std::visit([&output](const auto& value) {
+                    output << value << '\t';
+                }, sheet.GetCell({row, col})->GetValue());
+            }
+            output << '\n';
+        }
+        Report("print_values/get_value", timer, count);
+    }
+
+    {
+        Timer timer;
+        sheet.PrintValues(output);
+        Report("print_values/print_values", timer, count);
+    }
+
+    {
+        Timer timer;
+        sheet.PrintTexts(output);
+        Report("print_values/print_texts", timer, count);
+    }
+
+    // Разреженный лист: 10k чисел по диагоналям области 10000 x 1000.
+    // Стоимость печати на ячейку не должна зависеть от площади области
+    Sheet sparse;
+    for (int i = 0; i < 10'000; ++i) {
+        sparse.SetCell({i, (i * 7) % 1000}, std::to_string(i));
+    }
+
+    Timer timer;
+    sparse.PrintValues(output);
+    Report("print_values/sparse", timer, 10'000);
+}
+
+struct Benchmark {
+    const char* name;
+    void (*func)();
+};
+
+const Benchmark BENCHMARKS[] = {
+    {"storage_dense", BenchStorageDense},
+    {"storage_sparse", BenchStorageSparse},
+    {"set_cell", BenchSetCell},
+    {"recalc", BenchRecalc},
+    {"recalc_errors", BenchRecalcErrors},
+    {"ticker", BenchTicker},
+    {"fan_out", BenchFanOut},
+    {"parse", BenchParse},
+    {"import", BenchImport},
+    {"chain", BenchChain},
+    {"tracing", BenchTracing},
+    {"cycle_check", BenchCycleCheck},
+    {"parallel", BenchParallel},
+    {"print_values", BenchPrintValues},
+    {"aggregate", BenchAggregate},
+    {"range_deps", BenchRangeDependencies},
+    {"fill_down", BenchFillDown},
+    {"cell_memory", BenchCellMemory},
+    {"snapshot", BenchSnapshot},
+    {"journal", BenchJournal},
+    {"import_table", BenchImportTable},
+};
+
+}  // namespace
+
+// spreadsheet_bench [--json] [имя...]
+// Без имён запускаются все замеры, иначе только перечисленные. Для каждого
+// замера дополнительно выводится пиковый объём резидентной памяти
+int main(int argc, char* argv[]) {
+    std::vector<const char*> names;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--json") == 0) {
+            json_output = true;
+            continue;
+        }
+        const bool known = std::any_of(std::begin(BENCHMARKS), std::end(BENCHMARKS), [&](const Benchmark& bench) {
+            return std::strcmp(argv[i], bench.name) == 0;
+        });
+        if (!known) {
+            std::cerr << "unknown benchmark: " << argv[i] << "\n";
+            return 1;
+        }
+        names.push_back(argv[i]);
+    }
+
+    if (json_output) {
+        // Условия сборки и запуска, чтобы не сравнивать несравнимое
+#ifdef NDEBUG
+        const char* build_type = "release";
+#else
+        const char* build_type = "debug";
+#endif
+#ifdef SPREADSHEET_WITH_ANTLR
+        const char* antlr = "true";
+#else
+        const char* antlr = "false";
+#endif
+        std::cout << "{\"build_type\":\"" << build_type << "\",\"antlr\":" << antlr
+                  << ",\"hardware_threads\":" << std::thread::hardware_concurrency() << "}\n";
+    }
+
+    for (const auto& bench : BENCHMARKS) {
+        const bool selected = names.empty() || std::any_of(names.begin(), names.end(), [&](const char* name) {
+            return std::strcmp(name, bench.name) == 0;
+        });
+        if (!selected) {
+            continue;
+        }
+
+        current_bench = bench.name;
+        ResetPeakRss();
+        bench.func();
+        if (size_t peak = PeakRssKib(); peak > 0) {
+            ReportValue(std::string(bench.name) + "/peak_rss", static_cast<double>(peak) / 1024, "MiB");
+        }
+    }
+}
@@ -1,157 +1,668 @@
 #include "cell.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
+#include <cctype>
 #include <iostream>
+#include <limits>
+#include <sstream>
 #include <string>
+#include <string_view>
 #include <queue>
 
 #include "sheet.h"
+#include "thread_pool.h"
 
 
 Cell::Cell(Sheet& sheet, Position pos) 
-    : sheet_(&sheet), pos_(pos) {}
+    : sheet_(&sheet), pos_(pos), rank_(sheet.NextSourceRank()) {}
 
 Cell::~Cell() = default;
 
 
 namespace {
-    bool IsFormula(const std::string& str) {
+    bool IsFormula(std::string_view str) {
         return str.size() > 1 && str.front() == FORMULA_SIGN;
     }
+
+    bool IsDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    // Разбор числа с теми же правилами, что у чтения double из std::istringstream:
+    // допускаются пробелы в начале и знак, но не пробелы в конце, inf, nan и
+    // шестнадцатеричная запись. std::from_chars не зависит от локали и не выделяет память.
+    CellInterface::NumericValue ParseNumericText(std::string_view text) {
+        if (text.empty()) {
+            return 0.0;
+        }
+
+        const FormulaError value_error(FormulaError::Category::Value);
+
+        size_t pos = 0;
+        while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos]))) {
+            ++pos;
+        }
+
+        size_t digits = pos;
+        if (digits < text.size() && (text[digits] == '+' || text[digits] == '-')) {
+            ++digits;
+        }
+        if (digits == text.size() || !(IsDigit(text[digits]) || text[digits] == '.')) {
+            return value_error;
+        }
+
+        // from_chars не принимает '+'
+        if (text[pos] == '+') {
+            ++pos;
+        }
+
+        double result;
+        const char* end = text.data() + text.size();
+        auto [ptr, ec] = std::from_chars(text.data() + pos, end, result);
+
+        if (ec == std::errc::result_out_of_range) {
+            // Переполнение и потеря точности обрабатываются потоком по-своему
+            std::istringstream iss{std::string(text)};
+            if (iss >> result && iss.eof()) {
+                return result;
+            }
+            return value_error;
+        }
+
+        if (ec != std::errc() || ptr != end) {
+            return value_error;
+        }
+
+        return result;
+    }
 } // namespace
 
+template <typename Func>
+void Cell::ForEachDependent(Func&& func) const {
+    if (dependents_) {
+        dependents_->ForEach(func);
+    }
+    sheet_->range_dependents_.ForEachContaining(pos_, func);
+}
+
+bool Cell::HasDependents() const {
+    return dependents_ || sheet_->range_dependents_.Contains(pos_);
+}
+
+template <typename Func>
+void Cell::ForEachReference(Sheet& sheet, const Data& data, Func&& func) {
+    for (Position pos : GetSingleCellReferences(data)) {
+        if (Cell* cell = sheet.cells_.Find(pos); cell != nullptr) {
+            func(*cell);
+        }
+    }
+
+    // Несуществующие ячейки диапазона пусты и ни на что не ссылаются
+    for (Range range : GetRangeReferences(data)) {
+        sheet.cells_.ForEachInRange(range.from, range.to, [&func](Position, Cell& cell) {
+            func(cell);
+        });
+    }
+}
+
 void Cell::Set(std::string text) {
-    if (IsFormula(text)) {
-        SetFormula(std::move(text));
+    TraceSpan span(sheet_->tracer_, Tracer::Kind::SetCell, pos_);
+    Content content = Parse(std::move(text), *sheet_, pos_);
+
+    // Проверка на циклы в новой формуле
+    if (content.IsFormula() && HasCircularDependency(content.data_)) {
+        throw CircularDependencyException("Cycle detected");
+    }
+
+    // Инвалидация кеша, если это возможно
+    if (Apply(std::move(content))) {
+        CacheDisability();
     } else {
-        SetText(std::move(text));
+        sheet_->last_invalidation_count_ = 0;
+    }
+}
+
+Cell::Content Cell::Parse(std::string text, Sheet& sheet, Position pos) {
+    if (IsFormula(text)) {
+        return ParseFormula(std::string_view(text).substr(1), sheet, pos);
     }
+
+    if (text.empty()) {
+        return Content(std::monostate());
+    }
+
+    auto numeric = ParseNumericText(Text::Visible(text));
+    const double* number = std::get_if<double>(&numeric);
+    return Content(Text{std::move(text), number != nullptr ? *number : std::numeric_limits<double>::quiet_NaN()});
+}
+
+Cell::Content Cell::Parse(std::string_view text, Sheet& sheet, Position pos) {
+    if (IsFormula(text)) {
+        return ParseFormula(text.substr(1), sheet, pos);
+    }
+    return Parse(std::string(text), sheet, pos);
+}
+
+Cell::Content Cell::ParseFormula(std::string_view expression, Sheet& sheet, Position pos) {
+    StatTimer timer(sheet.stats_.parse_ns);
+    TraceSpan span(sheet.tracer_, Tracer::Kind::Parse, pos);
+    auto formula = sheet.formula_templates_.Parse(expression, pos);
+    sheet.stats_.formulas_parsed.Add();
+    return Content(Formula{std::move(formula), std::nullopt});
+}
+
+std::string Cell::GetText(const Data& data) {
+    if (const auto* text = std::get_if<Text>(&data)) {
+        return text->data;
+    }
+    if (const auto* formula = std::get_if<Formula>(&data)) {
+        return FORMULA_SIGN + formula->formula->GetExpression();
+    }
+    return "";
+}
+
+ReferenceSpan<Position> Cell::GetSingleCellReferences(const Data& data) {
+    const auto* formula = std::get_if<Formula>(&data);
+    return formula != nullptr ? formula->formula->GetSingleCellReferences() : ReferenceSpan<Position>{};
+}
+
+ReferenceSpan<Range> Cell::GetRangeReferences(const Data& data) {
+    const auto* formula = std::get_if<Formula>(&data);
+    return formula != nullptr ? formula->formula->GetRangeReferences() : ReferenceSpan<Range>{};
+}
+
+bool Cell::Apply(Content content) {
+    const bool is_formula = content.IsFormula();
+
+    // Формулы идентичны
+    if (is_formula && std::holds_alternative<Formula>(data_) && GetText() == GetText(content.data_)) {
+        return false;
+    }
+
+    // Формулу, от которой ничего не зависит, можно сразу поставить в конец
+    // топологического порядка, тогда связывание не потребует перестановок
+    if (is_formula && !HasDependents()) {
+        rank_ = sheet_->NextSinkRank();
+    }
+
+    // Невычисленная формула уже числится в списке на пересчёт
+    bool was_dirty = IsDirty();
+    bool was_empty = IsEmpty();
+
+    // Отвязываются зависимости старого содержимого и привязываются зависимости нового
+    UnlinkDependencies();
+    data_ = std::move(content.data_);
+    LinkDependencies();
+
+    if (is_formula && !was_dirty) {
+        sheet_->MarkDirty(pos_);
+    }
+
+    if (was_empty != IsEmpty()) {
+        sheet_->UpdateOccupancy(pos_, was_empty ? 1 : -1);
+    }
+
+    return true;
 }
 
 Cell::Value Cell::GetValue() const {
-    return impl_->GetValue();
+    if (const auto* text = std::get_if<Text>(&data_)) {
+        return std::string(text->Visible());
+    }
+
+    if (IsEmpty()) {
+        return std::string();
+    }
+
+    return std::visit([](auto value) -> Value {
+        return value;
+    }, GetNumericValue());
+}
+
+Cell::NumericValue Cell::GetNumericValue() const {
+    if (const auto* formula = std::get_if<Formula>(&data_)) {
+        if (formula->cache.has_value()) {
+            StatBatch::Add(sheet_->stats_.cache_hits);
+        } else {
+            sheet_->stats_.cache_misses.Add();
+            EvaluateUpstream();
+        }
+        return *formula->cache;
+    }
+
+    if (const auto* text = std::get_if<Text>(&data_)) {
+        return text->GetNumericValue();
+    }
+
+    return 0.0;
+}
+
+Cell::ValueView Cell::GetValueView() const {
+    if (const auto* text = std::get_if<Text>(&data_)) {
+        return text->Visible();
+    }
+
+    if (IsEmpty()) {
+        return std::string_view();
+    }
+
+    return std::visit([](auto value) -> ValueView {
+        return value;
+    }, GetNumericValue());
 }
 
 std::string Cell::GetText() const {
-    return impl_->GetText();
+    return GetText(data_);
 }
 
 std::vector<Position> Cell::GetReferencedCells() const {
-    return impl_->GetReferencedCells();
+    const auto* formula = std::get_if<Formula>(&data_);
+    return formula != nullptr ? formula->formula->GetReferencedCells() : std::vector<Position>{};
+}
+
+ReferenceSpan<Position> Cell::GetSingleCellReferences() const {
+    return GetSingleCellReferences(data_);
+}
+
+ReferenceSpan<Range> Cell::GetRangeReferences() const {
+    return GetRangeReferences(data_);
 }
 
 bool Cell::IsReferenced() const {
-    return !dependents_.empty();
+    return dependents_ != nullptr;
 }
 
 bool Cell::IsEmpty() const {
-    return impl_->IsEmpty();
+    return std::holds_alternative<std::monostate>(data_);
 }
 
-void Cell::CacheDisability() const {
-    PositionSet visits;
-    std::queue<Position> queue;
-    
-    visits.insert(pos_);
-    queue.push(pos_);
-
-    while (!queue.empty()) {
-        Position cur_pos = queue.front();
-        queue.pop();
-
-        Cell* cur_cell = sheet_->GetCell(cur_pos);
-        if (cur_cell == nullptr) {
-            continue;
-        }
+bool Cell::IsDirty() const {
+    const auto* formula = std::get_if<Formula>(&data_);
+    return formula != nullptr && !formula->cache.has_value();
+}
+
+bool Cell::ResetCache() const {
+    const auto* formula = std::get_if<Formula>(&data_);
+    if (formula == nullptr || !formula->cache.has_value()) {
+        return false;
+    }
+
+    formula->cache.reset();
+    return true;
+}
 
-        cur_cell->impl_->CacheDisability();
+void Cell::EvaluateFormula() const {
+    const auto* formula = std::get_if<Formula>(&data_);
+    if (formula != nullptr && !formula->cache.has_value()) {
+        TraceSpan span(sheet_->tracer_, Tracer::Kind::Evaluate, pos_);
+        formula->cache.emplace(formula->formula->Evaluate(*sheet_, *sheet_));
+        sheet_->stats_.evaluations.Add();
+    }
+}
 
-        for (Position dependent_pos : cur_cell->dependents_) {
-            if (visits.insert(dependent_pos).second) {
-                queue.push(dependent_pos);
+void Cell::EvaluateUpstream() const {
+    StatTimer timer(sheet_->stats_.evaluation_ns);
+    TraceSpan span(sheet_->tracer_, Tracer::Kind::EvaluateUpstream, pos_);
+    std::vector<const Cell*> pending;
+    std::vector<const Cell*> stack{this};
+    const std::uint64_t epoch = sheet_->NextVisitEpoch();
+    MarkVisited(epoch);
+
+    while (!stack.empty()) {
+        const Cell* cell = stack.back();
+        stack.pop_back();
+        pending.push_back(cell);
+
+        ForEachReference(*sheet_, cell->data_, [&stack, epoch](const Cell& ref_cell) {
+            if (ref_cell.IsDirty() && ref_cell.MarkVisited(epoch)) {
+                stack.push_back(&ref_cell);
             }
-        }
+        });
     }
+
+    EvaluateInOrder(pending);
 }
 
-bool Cell::HasCircularDependency(Position target, const FormulaImpl* formula) const {
-    PositionSet visits;
-    std::queue<Position> queue;
+void Cell::EvaluateInOrder(std::vector<const Cell*>& cells) {
+    std::sort(cells.begin(), cells.end(), [](const Cell* lhs, const Cell* rhs) {
+        return lhs->rank_ < rhs->rank_;
+    });
+    cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+    if (cells.empty()) {
+        return;
+    }
 
-    for (auto ref : formula->GetReferencedCells()) {
-        visits.insert(ref);
-        queue.push(ref);
+    // Ссылки каждой формулы стоят раньше неё, поэтому к моменту её вычисления
+    // уже закешированы, и рекурсии по цепочке не возникает
+    StatBatch hits(cells.front()->sheet_->stats_.cache_hits);
+    for (const Cell* cell : cells) {
+        cell->EvaluateFormula();
     }
+}
 
-    while (!queue.empty()) {
-        Position cur_pos = queue.front();
-        queue.pop();
-        if (cur_pos == target) {
-            return true;
+void Cell::EvaluateInLevels(std::vector<const Cell*>& cells, ThreadPool& pool) {
+    std::sort(cells.begin(), cells.end(), [](const Cell* lhs, const Cell* rhs) {
+        return lhs->rank_ < rhs->rank_;
+    });
+    cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+    if (cells.empty()) {
+        return;
+    }
+
+    // В порядке рангов уровни ссылок известны к моменту обработки формулы
+    PositionMap<size_t> level_of;
+    level_of.reserve(cells.size());
+    std::vector<std::vector<const Cell*>> levels;
+
+    for (const Cell* cell : cells) {
+        size_t level = 0;
+        ForEachReference(*cell->sheet_, cell->data_, [&level_of, &level](const Cell& ref_cell) {
+            auto it = level_of.find(ref_cell.pos_);
+            if (it != level_of.end()) {
+                level = std::max(level, it->second + 1);
+            }
+        });
+
+        level_of.emplace(cell->pos_, level);
+        if (level == levels.size()) {
+            levels.emplace_back();
         }
+        levels[level].push_back(cell);
+    }
 
-        auto cell = sheet_->GetCell(cur_pos);
+    // Узкие уровни (например, звенья длинной цепочки) выгоднее вычислить на месте.
+    // Широкие делятся на блоки, чтения из кеша считаются в потоке и переносятся
+    // в общий счётчик один раз на блок
+    constexpr size_t MIN_PARALLEL_LEVEL = 64;
+    constexpr size_t BLOCK_SIZE = 16;
+    StatCounter& cache_hits = cells.front()->sheet_->stats_.cache_hits;
+    for (const auto& level : levels) {
+        if (level.size() < MIN_PARALLEL_LEVEL) {
+            StatBatch hits(cache_hits);
+            for (const Cell* cell : level) {
+                cell->EvaluateFormula();
+            }
+        } else {
+            const size_t blocks = (level.size() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            pool.ParallelFor(blocks, [&level, &cache_hits](size_t block) {
+                StatBatch hits(cache_hits);
+                const size_t end = std::min(level.size(), (block + 1) * BLOCK_SIZE);
+                for (size_t i = block * BLOCK_SIZE; i < end; ++i) {
+                    level[i]->EvaluateFormula();
+                }
+            });
+        }
+    }
+}
+
+void Cell::CacheDisability() const {
+    InvalidateCaches(*sheet_, {pos_});
+}
+
+// Формула вычисляется только после своих ссылок, поэтому у формулы со
+// сброшенным кешем кеши всех зависимых тоже сброшены. Обход не заходит дальше
+// таких формул, и повторная правка того же входа до пересчёта стоит O(1).
+// Сброшенный кеш служит и отметкой посещения, отдельное множество не нужно.
+void Cell::InvalidateCaches(Sheet& sheet, const std::vector<Position>& sources) {
+    TraceSpan span(sheet.tracer_, Tracer::Kind::Invalidate, sources.size() == 1 ? sources.front() : Position::NONE);
+    std::vector<Position>& stack = sheet.invalidation_stack_;
+    size_t touched = 0;
+
+    // Содержимое источников изменилось, их зависимые обходятся всегда
+    for (Position pos : sources) {
+        const Cell* cell = sheet.GetCell(pos);
         if (cell == nullptr) {
             continue;
         }
 
-        for (auto ref : cell->GetReferencedCells()) {
-            if (visits.insert(ref).second) {
-                queue.push(ref);
-            }
+        ++touched;
+        if (cell->ResetCache()) {
+            sheet.MarkDirty(pos);
         }
+        cell->ForEachDependent([&stack](Position dependent) {
+            stack.push_back(dependent);
+        });
     }
 
-    return false;
+    while (!stack.empty()) {
+        Position cur_pos = stack.back();
+        stack.pop_back();
+        ++touched;
+
+        const Cell* cur_cell = sheet.GetCell(cur_pos);
+        if (cur_cell == nullptr || !cur_cell->ResetCache()) {
+            continue;
+        }
+
+        sheet.MarkDirty(cur_pos);
+        cur_cell->ForEachDependent([&stack](Position dependent) {
+            stack.push_back(dependent);
+        });
+    }
+
+    sheet.last_invalidation_count_ = touched;
+    sheet.stats_.invalidation_visits.Add(touched);
+    span.SetCount(touched);
 }
 
-void Cell::SetText(std::string str) {
-    if (str.empty()) {
-        impl_ = std::make_unique<EmptyImpl>();
-    } else {
-        impl_ = std::make_unique<TextImpl>(std::move(str));
+// Цикл есть, если ячейка достижима по ссылкам из нового содержимого. Ранг
+// каждой ячейки больше рангов ячеек, на которые она ссылается, поэтому путь до
+// этой ячейки проходит только через ячейки с рангом больше её ранга: остальные
+// не обходятся (как и при перестановке в Reorder). Если от ячейки ничего не
+// зависит, до неё не дойти вовсе, и проверяются только ссылки на неё саму.
+bool Cell::HasCircularDependency(const Data& data) const {
+    TraceSpan span(sheet_->tracer_, Tracer::Kind::CycleCheck, pos_);
+
+    for (Position ref : GetSingleCellReferences(data)) {
+        if (ref == pos_) {
+            return true;
+        }
+    }
+    for (Range range : GetRangeReferences(data)) {
+        if (range.Contains(pos_)) {
+            return true;
+        }
+    }
+    if (!HasDependents()) {
+        return false;
     }
 
-    // Инвалидация кеша, если это возможно
-    CacheDisability();
+    // Буфер обхода переиспользуется между проверками, а посещённые ячейки
+    // отмечаются номером обхода в них самих
+    std::vector<const Cell*>& stack = sheet_->cycle_check_stack_;
+    stack.clear();
+    const std::uint64_t epoch = sheet_->NextVisitEpoch();
+    auto visit = [this, epoch, &stack](const Cell& cell) {
+        if (cell.rank_ > rank_ && cell.MarkVisited(epoch)) {
+            stack.push_back(&cell);
+        }
+    };
+
+    ForEachReference(*sheet_, data, visit);
+    bool found = false;
+    size_t visited = 0;
+    while (!found && !stack.empty()) {
+        const Cell* cell = stack.back();
+        stack.pop_back();
+        ++visited;
+
+        ForEachReference(*sheet_, cell->data_, [this, &found, &visit](const Cell& ref_cell) {
+            if (&ref_cell == this) {
+                found = true;
+            } else {
+                visit(ref_cell);
+            }
+        });
+    }
+
+    sheet_->stats_.cycle_check_visits.Add(visited);
+    span.SetCount(visited);
+    return found;
 }
 
-void Cell::SetFormula(std::string formula) {
-    std::unique_ptr<FormulaImpl> new_impl_ = std::make_unique<FormulaImpl>(std::move(formula), *sheet_);
-    // Формулы идентичны
-    if (GetText() == new_impl_->GetText()) {
+size_t Cell::GetMemoryUsage() const {
+    size_t bytes = sizeof(Cell);
+    // Короткая строка хранится в самом объекте
+    const auto* text = std::get_if<Text>(&data_);
+    if (text != nullptr && text->data.capacity() > std::string().capacity()) {
+        bytes += text->data.capacity() + 1;
+    }
+    if (dependents_) {
+        bytes += sizeof(Dependents) + dependents_->GetMemoryUsage();
+    }
+    return bytes;
+}
+
+size_t Cell::Dependents::GetMemoryUsage() const {
+    if (set_) {
+        // Узел хранит позицию и указатель на следующий
+        return sizeof(PositionSet) + set_->size() * (sizeof(Position) + sizeof(void*))
+            + set_->bucket_count() * sizeof(void*);
+    }
+    return list_.capacity() * sizeof(Position);
+}
+
+void Cell::Dependents::Insert(Position pos) {
+    if (set_) {
+        set_->insert(pos);
         return;
     }
 
-    // Проверка на циклы в новой формуле
-    if (HasCircularDependency(pos_, new_impl_.get())) {
-        throw CircularDependencyException("Cycle detected");
+    if (std::find(list_.begin(), list_.end(), pos) != list_.end()) {
+        return;
     }
-    
-    // Раз циклов нет и формулы разные, можно отвязать зависимости старой формулы и привязать зависимости новой
-    UnlinkDependencies();
-    impl_ = std::move(new_impl_);
-    LinkDependencies();
 
-    // Инвалидация кеша, если это возможно
-    CacheDisability();
+    list_.push_back(pos);
+    if (list_.size() > MAX_LIST_SIZE) {
+        set_ = std::make_unique<PositionSet>(list_.begin(), list_.end());
+        list_ = {};
+    }
+}
+
+bool Cell::Dependents::Erase(Position pos) {
+    if (set_) {
+        set_->erase(pos);
+        return set_->empty();
+    }
+
+    if (auto it = std::find(list_.begin(), list_.end(), pos); it != list_.end()) {
+        *it = list_.back();
+        list_.pop_back();
+    }
+    return list_.empty();
 }
 
 void Cell::UnlinkDependencies() {
-    for (auto ref : GetReferencedCells()) {
+    for (auto ref : GetSingleCellReferences()) {
         Cell* cell = sheet_->GetCell(ref);
-        cell->dependents_.erase(pos_);
+        if (cell->dependents_->Erase(pos_)) {
+            cell->dependents_.reset();
+        }
+    }
+
+    for (Range range : GetRangeReferences()) {
+        sheet_->range_dependents_.Remove(range, pos_);
     }
 }
 
 void Cell::LinkDependencies() {
-    for (auto ref : GetReferencedCells()) {
+    for (auto ref : GetSingleCellReferences()) {
         // Если пустой ячейке в таблице не существовало, чтобы на нее суметь сослаться, ее надо создать
         if (sheet_->GetCell(ref) == nullptr) {
             sheet_->SetCell(ref, "");
         }
 
         Cell* cell = sheet_->GetCell(ref);
-        cell->dependents_.insert(pos_);
+        if (!cell->dependents_) {
+            cell->dependents_ = std::make_unique<Dependents>();
+        }
+        cell->dependents_->Insert(pos_);
+
+        if (cell->rank_ > rank_) {
+            Reorder(*cell, *this);
+        }
+    }
+
+    // Диапазон регистрируется в индексе один раз, пустые ячейки не создаются
+    for (Range range : GetRangeReferences()) {
+        sheet_->range_dependents_.Add(range, pos_);
+        sheet_->cells_.ForEachInRange(range.from, range.to, [this](Position, Cell& cell) {
+            if (cell.rank_ > rank_) {
+                Reorder(cell, *this);
+            }
+        });
+    }
+}
+
+// Перестановка Pearce-Kelly после добавления ребра ref -> dependent, нарушившего
+// порядок. Затрагиваются только ячейки с рангами между рангами концов ребра:
+// зависимые от dependent и ячейки, от которых зависит ref. Первые сдвигаются
+// после вторых на те же освободившиеся ранги.
+void Cell::Reorder(Cell& ref, Cell& dependent) {
+    const std::int64_t lower = dependent.rank_;
+    const std::int64_t upper = ref.rank_;
+    Sheet& sheet = *dependent.sheet_;
+
+    std::vector<Cell*> forward;
+    {
+        std::vector<Cell*> stack{&dependent};
+        const std::uint64_t epoch = sheet.NextVisitEpoch();
+        dependent.MarkVisited(epoch);
+        while (!stack.empty()) {
+            Cell* cell = stack.back();
+            stack.pop_back();
+            forward.push_back(cell);
+
+            cell->ForEachDependent([&](Position pos) {
+                Cell* next = sheet.GetCell(pos);
+                if (next != nullptr && next->rank_ < upper && next->MarkVisited(epoch)) {
+                    stack.push_back(next);
+                }
+            });
+        }
+    }
+
+    std::vector<Cell*> backward;
+    {
+        std::vector<Cell*> stack{&ref};
+        const std::uint64_t epoch = sheet.NextVisitEpoch();
+        ref.MarkVisited(epoch);
+        while (!stack.empty()) {
+            Cell* cell = stack.back();
+            stack.pop_back();
+            backward.push_back(cell);
+
+            ForEachReference(sheet, cell->data_, [&](Cell& next) {
+                if (next.rank_ > lower && next.MarkVisited(epoch)) {
+                    stack.push_back(&next);
+                }
+            });
+        }
+    }
+
+    auto by_rank = [](const Cell* lhs, const Cell* rhs) {
+        return lhs->rank_ < rhs->rank_;
+    };
+    std::sort(forward.begin(), forward.end(), by_rank);
+    std::sort(backward.begin(), backward.end(), by_rank);
+
+    std::vector<std::int64_t> ranks;
+    ranks.reserve(forward.size() + backward.size());
+    for (const Cell* cell : backward) {
+        ranks.push_back(cell->rank_);
+    }
+    for (const Cell* cell : forward) {
+        ranks.push_back(cell->rank_);
+    }
+    std::sort(ranks.begin(), ranks.end());
+
+    auto rank = ranks.begin();
+    for (Cell* cell : backward) {
+        cell->rank_ = *rank++;
+    }
+    for (Cell* cell : forward) {
+        cell->rank_ = *rank++;
     }
 }
\ No newline at end of file
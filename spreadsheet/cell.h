@@ -1,12 +1,18 @@
 #pragma once
 
+#include <cmath>
+#include <cstdint>
 #include <memory>
 #include <optional>
+#include <string>
+#include <string_view>
+#include <variant>
 
 #include "common.h"
 #include "formula.h"
 
 class Sheet;
+class ThreadPool;
 
 class Cell : public CellInterface {
 public:
@@ -18,121 +24,198 @@ public:
     void Set(std::string text);
 
     Value GetValue() const override;
+    NumericValue GetNumericValue() const override;
+    ValueView GetValueView() const override;
     std::string GetText() const override;
     std::vector<Position> GetReferencedCells() const override;
+    // Ссылки формулы, раздельно на отдельные ячейки и на диапазоны (без копирования)
+    ReferenceSpan<Position> GetSingleCellReferences() const;
+    ReferenceSpan<Range> GetRangeReferences() const;
+    // На ячейку ссылаются отдельной ссылкой (ссылки диапазонами не требуют
+    // существования ячейки)
     bool IsReferenced() const;
     bool IsEmpty() const;
+    // Формула, значение которой ещё не вычислено (или сброшено)
+    bool IsDirty() const;
 
 private:
-    class Impl {
-    public:
-        virtual ~Impl() = default;
-        virtual Value GetValue() const = 0;
-        virtual std::string GetText() const = 0;
-        virtual std::vector<Position> GetReferencedCells() const = 0;
-        virtual void CacheDisability() const = 0;
-        virtual bool IsEmpty() const = 0;
-    };
-
-    class EmptyImpl : public Impl {
-    public:
-        Value GetValue() const override {
-            return std::string();
-        };
+    // Снимок таблицы (snapshot.cpp) сохраняет и восстанавливает содержимое напрямую
+    friend class Sheet;
+
+    // Содержимое хранится прямо в ячейке (без отдельного объекта в куче):
+    // пустая ячейка, текст или формула
+    struct Text {
+        std::string data;
+        // Числовое значение текста определяется один раз при записи. NaN означает,
+        // что текст не число (#VALUE!): сам разбор NaN не возвращает
+        double number;
+
+        NumericValue GetNumericValue() const {
+            if (std::isnan(number)) {
+                return FormulaError(FormulaError::Category::Value);
+            }
+            return number;
+        }
 
-        std::string GetText() const override {
-            return "";
+        // Текст без экранирующего символа
+        std::string_view Visible() const {
+            return Visible(data);
         }
 
-        std::vector<Position> GetReferencedCells() const override {
-            return {};
+        static std::string_view Visible(std::string_view data) {
+            return data.substr(data.front() == ESCAPE_SIGN ? 1 : 0);
         }
+    };
+
+    struct Formula {
+        std::unique_ptr<FormulaInterface> formula;
+        mutable std::optional<NumericValue> cache; // Закешированное значение, возвращаемое методом GetValue()
+    };
 
-        void CacheDisability() const override {}
+    using Data = std::variant<std::monostate, Text, Formula>;
 
-        bool IsEmpty() const override {
-            return true;
+    // Формулы с отдельной ссылкой на ячейку. Обычно их единицы, и они хранятся
+    // в векторе, а множество заводится, только когда зависимых становится много
+    class Dependents {
+    public:
+        void Insert(Position pos);
+        // Возвращает true, если зависимых не осталось
+        bool Erase(Position pos);
+        // Память списка (для множества - оценка по числу элементов и корзин)
+        size_t GetMemoryUsage() const;
+
+        template <typename Func>
+        void ForEach(Func&& func) const {
+            if (set_) {
+                for (Position pos : *set_) {
+                    func(pos);
+                }
+            } else {
+                for (Position pos : list_) {
+                    func(pos);
+                }
+            }
         }
 
     private:
-        std::string data_;
-    };
+        static constexpr size_t MAX_LIST_SIZE = 16;
 
-    class TextImpl : public Impl {
-    public:
-        TextImpl(std::string str) : data_(std::move(str)) {}
+        std::vector<Position> list_;
+        std::unique_ptr<PositionSet> set_;
+    };
 
-        Value GetValue() const override {
-            return data_.front() != ESCAPE_SIGN ? data_ : data_.substr(1);
-        };
+    static std::string GetText(const Data& data);
+    static ReferenceSpan<Position> GetSingleCellReferences(const Data& data);
+    static ReferenceSpan<Range> GetRangeReferences(const Data& data);
 
-        std::string GetText() const override {
-            return data_;
+public:
+    // Разобранное, но ещё не записанное в ячейку содержимое. Пакетная запись
+    // (Sheet::SetCells) сначала разбирает все тексты, затем проверяет циклы для
+    // всего пакета и только после этого применяет изменения.
+    class Content {
+    public:
+        ReferenceSpan<Position> GetSingleCellReferences() const {
+            return Cell::GetSingleCellReferences(data_);
         }
 
-        std::vector<Position> GetReferencedCells() const override {
-            return {};
+        ReferenceSpan<Range> GetRangeReferences() const {
+            return Cell::GetRangeReferences(data_);
         }
 
-        void CacheDisability() const override {}
-
-        bool IsEmpty() const override {
-            return false;
+        bool IsFormula() const {
+            return std::holds_alternative<Formula>(data_);
         }
 
     private:
-        std::string data_;
-    };
-
-    class FormulaImpl : public Impl {
-    public:
-        FormulaImpl(std::string str, const SheetInterface& sheet)
-        : formula_(ParseFormula(str.substr(1))),
-          sheet_(sheet) {} // FormulaImpl формируется из формульной строки, которая длинее 1 символа и начинается с '='
-
-        Value GetValue() const override {
-            if (!cache_.has_value()) {
-                auto val = std::visit([this](auto&& res) -> Value {
-                    return std::forward<decltype(res)>(res);
-                }, formula_->Evaluate(this->sheet_));
-                
-                cache_.emplace(std::move(val));
-            }
+        friend class Cell;
+        explicit Content(Data data)
+            : data_(std::move(data)) {}
 
-            return *cache_;
-        };
+        Data data_;
+    };
 
-        std::string GetText() const override {
-            return '=' + formula_->GetExpression();
-        }
+    // Разбирает текст для ячейки pos. Бросает FormulaException, если формула некорректна
+    static Content Parse(std::string text, Sheet& sheet, Position pos);
+    // То же для текста, которым ячейка не владеет (например, поля импорта):
+    // строка выделяется, только если текст хранится в ячейке как есть
+    static Content Parse(std::string_view text, Sheet& sheet, Position pos);
+
+    // Записывает содержимое без проверки циклов и без сброса кешей.
+    // Возвращает false, если ячейка уже содержит ту же формулу
+    bool Apply(Content content);
+
+    // Сбрасывает кеши всех ячеек, зависящих от sources, за один обход.
+    // Обход останавливается на формулах, кеш которых уже сброшен
+    static void InvalidateCaches(Sheet& sheet, const std::vector<Position>& sources);
+
+    // Позиция в топологическом порядке: ячейка всегда стоит после ячеек, на
+    // которые ссылается. Порядок поддерживается инкрементально при каждом
+    // связывании зависимостей.
+    std::int64_t GetRank() const {
+        return rank_;
+    }
+
+    // Вычисляет значение формулы, предварительно вычислив (итеративно, в
+    // топологическом порядке) все невычисленные формулы, от которых она зависит
+    void EvaluateUpstream() const;
+
+    // Вычисляет формулы в топологическом порядке. Все невычисленные формулы,
+    // от которых они зависят, должны входить в cells
+    static void EvaluateInOrder(std::vector<const Cell*>& cells);
+
+    // То же, но параллельно: формулы делятся на уровни (уровень формулы на
+    // единицу больше максимального уровня невычисленных формул, на которые она
+    // ссылается), и формулы одного уровня вычисляются потоками пула.
+    // Кеш каждой формулы записывает ровно один поток, а читается он только на
+    // следующих уровнях, после завершения ParallelFor, поэтому блокировки не нужны.
+    static void EvaluateInLevels(std::vector<const Cell*>& cells, ThreadPool& pool);
 
-        std::vector<Position> GetReferencedCells() const override {
-            return formula_->GetReferencedCells();
-        }
+private:
+    // Разбирает выражение формулы (текст после знака '=')
+    static Content ParseFormula(std::string_view expression, Sheet& sheet, Position pos);
 
-        void CacheDisability() const override {
-            cache_.reset();
-        }
+    // Приведёт ли содержимое data в этой ячейке к циклу
+    bool HasCircularDependency(const Data& data) const;
+    void CacheDisability() const;
+    // Память ячейки вместе с текстом и зависимыми, без выражения формулы
+    size_t GetMemoryUsage() const;
 
-        bool IsEmpty() const override {
+    // Отмечает ячейку посещённой обходом epoch (Sheet::NextVisitEpoch).
+    // Возвращает false, если она уже была посещена этим обходом
+    bool MarkVisited(std::uint64_t epoch) const {
+        if (visit_epoch_ == epoch) {
             return false;
         }
+        visit_epoch_ = epoch;
+        return true;
+    }
+
+    // Сбрасывает вычисленное значение формулы. Возвращает true, если оно было
+    bool ResetCache() const;
+    // Вычисляет формулу, ссылки которой уже вычислены
+    void EvaluateFormula() const;
+
+    // Зависимыми считаются формулы с отдельной ссылкой на ячейку и формулы,
+    // диапазоны которых её содержат
+    bool HasDependents() const;
+    template <typename Func>
+    void ForEachDependent(Func&& func) const;
+
+    // Обходит существующие ячейки, на которые ссылается data: отдельные ссылки
+    // и занятые ячейки диапазонов
+    template <typename Func>
+    static void ForEachReference(Sheet& sheet, const Data& data, Func&& func);
 
-    private:
-        std::unique_ptr<FormulaInterface> formula_;
-        const SheetInterface& sheet_;
-        mutable std::optional<Value> cache_; // Закешированное значение, возвращаемое методом GetValue()
-    };
-
-    void SetText(std::string str);
-    void SetFormula(std::string formula);
-    bool HasCircularDependency(Position target, const FormulaImpl* formula) const;
-    void CacheDisability() const;
     void UnlinkDependencies();
     void LinkDependencies();
+    static void Reorder(Cell& ref, Cell& dependent);
 
-    std::unique_ptr<Impl> impl_ = std::make_unique<EmptyImpl>();
+    Data data_;
     Sheet* sheet_; // С хранением указателя вместо ссылки становится доступен перемещающий оператор и конструктор
     Position pos_;
-    PositionSet dependents_;
+    std::unique_ptr<Dependents> dependents_; // Создаётся при появлении первой зависимой формулы
+    std::int64_t rank_;
+    // Номер последнего обхода графа, посетившего ячейку. Заменяет множества
+    // посещённых позиций, которые пришлось бы заводить на каждый обход
+    mutable std::uint64_t visit_epoch_ = 0;
 };
\ No newline at end of file
@@ -1,7 +1,9 @@
 #pragma once
 
+#include <cstdint>
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -9,6 +11,7 @@
 #include <vector>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 
 // Позиция ячейки. Индексация с нуля.
 struct Position {
@@ -47,6 +50,23 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// Прямоугольная область листа от левой верхней ячейки from до правой нижней
+// ячейки to включительно, записывается как A1:B2
+struct Range {
+    Position from;
+    Position to;
+
+    bool operator==(Range rhs) const;
+
+    // Обе позиции корректны, и from не правее и не ниже to
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    std::string ToString() const;
+
+    // Упорядочивает углы: B2:A1 и A2:B1 становятся A1:B2
+    static Range FromCorners(Position first, Position second);
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError {
 public:
@@ -102,11 +122,22 @@ public:
     using std::runtime_error::runtime_error;
 };
 
+// Исключение, выбрасываемое при ошибке записи или чтения снимка таблицы
+// (файл недоступен, повреждён или записан несовместимой версией)
+class SnapshotException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
 class CellInterface {
 public:
     // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
     // формулы
     using Value = std::variant<std::string, double, FormulaError>;
+    // Значение ячейки в роли операнда формулы
+    using NumericValue = std::variant<double, FormulaError>;
+    // Значение без копирования текста, ссылается на данные ячейки
+    using ValueView = std::variant<std::string_view, double, FormulaError>;
 
     virtual ~CellInterface() = default;
 
@@ -123,11 +154,61 @@ public:
     // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек. В случае текстовой ячейки список пуст.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Возвращает значение ячейки как число для подстановки в формулу. Пустой
+    // текст равен нулю, текст, не являющийся числом, даёт ошибку #VALUE!.
+    virtual NumericValue GetNumericValue() const = 0;
+
+    // То же, что GetValue(), но текст не копируется. Представление остаётся
+    // действительным до изменения или удаления ячейки.
+    virtual ValueView GetValueView() const = 0;
 };
 
 inline constexpr char FORMULA_SIGN = '=';
 inline constexpr char ESCAPE_SIGN = '\'';
 
+// Формат текстовой таблицы для SheetInterface::ImportTable
+enum class TableFormat {
+    Tsv, // Поля разделены табуляцией, как в выводе PrintTexts()
+    Csv, // Поля разделены запятыми. Поле в двойных кавычках может содержать
+         // запятые и переводы строк, кавычка внутри него удваивается
+};
+
+// Статистика работы таблицы с момента создания или последнего ResetStats().
+// Счётчики не собираются в сборке с SPREADSHEET_NO_STATS и равны нулю
+struct SheetStats {
+    // Разобранные формулы и время их разбора
+    std::uint64_t formulas_parsed = 0;
+    std::uint64_t parse_ns = 0;
+    // Обращения к значению формулы: готовое из кеша или с вычислением
+    std::uint64_t cache_hits = 0;
+    std::uint64_t cache_misses = 0;
+    // Ячейки, пройденные при сбросе кешей после правок
+    std::uint64_t invalidation_visits = 0;
+    // Ячейки, пройденные при проверке новых формул на циклические зависимости
+    std::uint64_t cycle_check_visits = 0;
+    // Вычисленные формулы и общее время вычислений (пересчёта и вычислений по запросу)
+    std::uint64_t evaluations = 0;
+    std::uint64_t evaluation_ns = 0;
+
+    // Ячейки одного вида и занятая ими память: сама ячейка, текст и списки
+    // зависимых. Выражения формул общие для формул одной формы и учитываются
+    // отдельно, числом шаблонов
+    struct Memory {
+        size_t cells = 0;
+        size_t bytes = 0;
+    };
+    // Пустые ячейки, на которые ссылаются формулы
+    Memory empty;
+    Memory text;
+    Memory formula;
+    size_t formula_templates = 0;
+    // Память хранилища сверх самих ячеек: свободные слоты выделенных тайлов
+    // 16 x 16, полосы тайлов и их каталог. При редком заполнении листа она
+    // может во много раз превышать память ячеек
+    size_t storage_overhead_bytes = 0;
+};
+
 // Интерфейс таблицы
 class SheetInterface {
 public:
@@ -148,6 +229,21 @@ public:
     // начать текст со знака "=", но чтобы он не интерпретировался как формула.
     virtual void SetCell(Position pos, std::string text) = 0;
 
+    // Задаёт содержимое сразу нескольких ячеек. Результат такой же, как у
+    // последовательных вызовов SetCell() (для повторяющейся позиции действует
+    // последний текст), но все формулы разбираются заранее, циклы проверяются
+    // одним обходом для всего пакета, а кеши сбрасываются один раз.
+    // Запись атомарна: если хотя бы одна позиция некорректна, формула
+    // синтаксически некорректна или пакет приводит к циклической зависимости,
+    // бросается соответствующее исключение и ни одна ячейка не изменяется.
+    virtual void SetCells(std::vector<std::pair<Position, std::string>> cells) = 0;
+
+    // Загружает текстовую таблицу: строка потока становится строкой листа, а
+    // поле - ячейкой, начиная с позиции origin. Поле записывается как текст
+    // SetCell(), пустые поля пропускаются. Результат и атомарность такие же,
+    // как у SetCells() со всеми непустыми полями.
+    virtual void ImportTable(std::istream& input, TableFormat format, Position origin) = 0;
+
     // Возвращает значение ячейки.
     // Если ячейка пуста, может вернуть nullptr.
     virtual const CellInterface* GetCell(Position pos) const = 0;
@@ -169,7 +265,47 @@ public:
     // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Вычисляет все формулы, значения которых были сброшены изменениями.
+    // Формулы вычисляются итеративно в топологическом порядке, каждая ровно
+    // один раз, поэтому длинные цепочки ссылок не углубляют стек вызовов.
+    // Без явного вызова значения вычисляются лениво при обращении к ним.
+    virtual void Recalculate() = 0;
+
+    // Задаёт число потоков для Recalculate (по умолчанию 1). При нескольких
+    // потоках невычисленные формулы разбиваются на уровни зависимостей, и
+    // формулы одного уровня вычисляются параллельно.
+    virtual void SetRecalculationThreads(size_t threads) = 0;
+
+    // Число ячеек, просмотренных при сбросе кешей последней правкой (для
+    // мониторинга).
+    virtual size_t GetLastInvalidationCount() const = 0;
+
+    // Счётчики работы таблицы и память ячеек. Подсчёт памяти обходит все ячейки
+    virtual SheetStats GetStats() const = 0;
+    virtual void ResetStats() = 0;
+
+    // Трассировка разбора, проверок на циклы, сброса кешей и вычисления каждой
+    // формулы (с позициями ячеек). Хранятся последние capacity событий,
+    // повторный запуск начинает трассировку заново
+    virtual void StartTracing(size_t capacity) = 0;
+    // Останавливает запись, записанные события сохраняются
+    virtual void StopTracing() = 0;
+    // Записывает события в формате Chrome trace_event (JSON) для chrome://tracing
+    // или Perfetto. Без трассировки список событий пуст
+    virtual void WriteTrace(std::ostream& output) const = 0;
+
+    // Записывает таблицу в бинарный снимок: тексты, разобранные формулы и
+    // вычисленные значения. Граф зависимостей в снимок не входит и
+    // восстанавливается по ссылкам формул при загрузке. Бросает
+    // SnapshotException.
+    virtual void SaveSnapshot(const std::string& path) const = 0;
 };
 
 // Создаёт готовую к работе пустую таблицу.
-std::unique_ptr<SheetInterface> CreateSheet();
\ No newline at end of file
+std::unique_ptr<SheetInterface> CreateSheet();
+
+// Загружает таблицу из снимка, записанного SaveSnapshot. Файл отображается в
+// память, формулы не разбираются заново: дерево каждой формы формул
+// восстанавливается из снимка один раз. Бросает SnapshotException.
+std::unique_ptr<SheetInterface> LoadSnapshot(const std::string& path);
\ No newline at end of file
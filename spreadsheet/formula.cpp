@@ -5,8 +5,10 @@
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <optional>
 #include <sstream>
-#include <set>
+#include <string_view>
+#include <unordered_set>
 
 using namespace std::literals;
 
@@ -23,39 +25,296 @@ FormulaAST TryParseFormulaAST(std::string expression) {
 }
 
 namespace {
+// Значения диапазонов для листа, о хранилище которого ничего не известно:
+// каждая ячейка запрашивается через GetCell
+class CellwiseRangeSource : public RangeSource {
+public:
+    explicit CellwiseRangeSource(const SheetInterface& sheet)
+        : sheet_(sheet) {}
+
+    std::optional<FormulaError> CollectRangeValues(Range range, std::vector<double>& values) const override {
+        for (int row = range.from.row; row <= range.to.row; ++row) {
+            for (int col = range.from.col; col <= range.to.col; ++col) {
+                const CellInterface* cell = sheet_.GetCell({row, col});
+                if (cell == nullptr || cell->GetText().empty()) {
+                    continue;
+                }
+
+                auto value = cell->GetNumericValue();
+                if (const double* number = std::get_if<double>(&value)) {
+                    values.push_back(*number);
+                } else {
+                    return std::get<FormulaError>(value);
+                }
+            }
+        }
+        return std::nullopt;
+    }
+
+private:
+    const SheetInterface& sheet_;
+};
+
+// Формула хранит разобранное выражение совместно с формулами той же формы и
+// своё смещение относительно ячейки, для которой выражение разбиралось
 class Formula : public FormulaInterface {
 public:
 // Реализуйте следующие методы:
     explicit Formula(std::string expression)
-        : ast_(TryParseFormulaAST(std::move(expression))) {}
+        : ast_(std::make_shared<const FormulaAST>(TryParseFormulaAST(std::move(expression)))) {}
+
+    Formula(std::shared_ptr<const FormulaAST> ast, Position offset)
+        : ast_(std::move(ast)), offset_(offset) {}
 
     Value Evaluate(const SheetInterface& sheet) const override {
-        try {
-            return ast_.Execute(sheet);
-        } catch (const FormulaError& e) {
-            return e;
-        }
+        return Evaluate(sheet, CellwiseRangeSource(sheet));
+    }
+
+    Value Evaluate(const SheetInterface& sheet, const RangeSource& ranges) const override {
+        return ast_->Execute(sheet, ranges, offset_);
     }
 
     std::string GetExpression() const override {
         std::ostringstream oss;
-        ast_.PrintFormula(oss);
+        ast_->PrintFormula(oss, offset_);
         return oss.str();
     }
 
     std::vector<Position> GetReferencedCells() const override {
-        const auto& ref_list = ast_.GetCells();
-        //Список очищается от дубликатов и сортируется
-        std::set<Position> references(ref_list.begin(), ref_list.end());
-        // Формируется вектор
-        return {references.begin(), references.end()};
+        ReferenceSpan<Position> singles = GetSingleCellReferences();
+        std::vector<Position> references(singles.begin(), singles.end());
+        ReferenceSpan<Range> ranges = GetRangeReferences();
+        if (ranges.empty()) {
+            return references;
+        }
+
+        // Ячейки диапазонов перечисляются только здесь
+        for (Range range : ranges) {
+            for (int row = range.from.row; row <= range.to.row; ++row) {
+                for (int col = range.from.col; col <= range.to.col; ++col) {
+                    references.push_back({row, col});
+                }
+            }
+        }
+        std::sort(references.begin(), references.end());
+        references.erase(std::unique(references.begin(), references.end()), references.end());
+        return references;
+    }
+
+    // Сдвиг порядок ссылок не меняет, поэтому список выражения остаётся
+    // отсортированным и для этой формулы
+    ReferenceSpan<Position> GetSingleCellReferences() const override {
+        const auto& cells = ast_->GetUniqueCells();
+        return {cells.data(), cells.size(), offset_};
+    }
+
+    ReferenceSpan<Range> GetRangeReferences() const override {
+        const auto& ranges = ast_->GetRanges();
+        return {ranges.data(), ranges.size(), offset_};
+    }
+
+    const std::shared_ptr<const FormulaAST>& GetAST() const override {
+        return ast_;
+    }
+
+    Position GetOffset() const override {
+        return offset_;
     }
 
 private:
-    FormulaAST ast_;
+    std::shared_ptr<const FormulaAST> ast_;
+    Position offset_;
 };
+
+// Заменяет ссылки на ячейки смещениями относительно origin: A1*B1 в C2
+// становится R[-1]C[-2]*R[-1]C[-1]. Остальной текст сохраняется как есть, поэтому
+// тексты с одинаковым ключом разбираются в одинаковые с точностью до сдвига
+// деревья. Возвращает nullopt, если разбиение на лексемы неоднозначно
+// (тогда формула разбирается без шаблона).
+std::optional<std::string> ToRelativeForm(std::string_view expression, Position origin) {
+    auto is_digit = [](char c) {
+        return std::isdigit(static_cast<unsigned char>(c)) != 0;
+    };
+    auto is_upper = [](char c) {
+        return c >= 'A' && c <= 'Z';
+    };
+
+    std::string result;
+    result.reserve(expression.size() + 16);
+
+    size_t i = 0;
+    while (i < expression.size()) {
+        const char c = expression[i];
+
+        // Скобки R1C1 в исходном тексте сделали бы ключ неоднозначным
+        if (c == '[' || c == ']') {
+            return std::nullopt;
+        }
+
+        if (is_digit(c) || c == '.') {
+            size_t begin = i;
+            while (i < expression.size() && is_digit(expression[i])) {
+                ++i;
+            }
+            if (i < expression.size() && expression[i] == '.') {
+                ++i;
+                while (i < expression.size() && is_digit(expression[i])) {
+                    ++i;
+                }
+            }
+            if (i < expression.size() && (expression[i] == 'e' || expression[i] == 'E')) {
+                size_t exponent = i + 1;
+                if (exponent < expression.size() && (expression[exponent] == '+' || expression[exponent] == '-')) {
+                    ++exponent;
+                }
+                if (exponent < expression.size() && is_digit(expression[exponent])) {
+                    i = exponent;
+                    while (i < expression.size() && is_digit(expression[i])) {
+                        ++i;
+                    }
+                }
+            }
+            // Число, слитное с буквами или точкой, лексер может разбить иначе
+            if (i < expression.size() && (std::isalpha(static_cast<unsigned char>(expression[i])) || expression[i] == '.')) {
+                return std::nullopt;
+            }
+            result.append(expression.substr(begin, i - begin));
+            continue;
+        }
+
+        if (is_upper(c)) {
+            size_t begin = i;
+            while (i < expression.size() && is_upper(expression[i])) {
+                ++i;
+            }
+            size_t digits = i;
+            while (i < expression.size() && is_digit(expression[i])) {
+                ++i;
+            }
+
+            // Буквы без цифр - имя функции
+            if (digits == i) {
+                result.append(expression.substr(begin, i - begin));
+                continue;
+            }
+
+            Position pos = Position::FromString(expression.substr(begin, i - begin));
+            if (!pos.IsValid() || expression[digits] == '0') {
+                return std::nullopt;
+            }
+            result += "R[" + std::to_string(pos.row - origin.row) + "]C[" + std::to_string(pos.col - origin.col) + ']';
+            continue;
+        }
+
+        result += c;
+        ++i;
+    }
+
+    return result;
+}
+
+// Точная форма выражения: узлы дерева со ссылками относительно ячейки origin.
+// В отличие от печатного вида, числа в ней не округляются
+std::string ToStructuralForm(const FormulaAST& ast, Position origin) {
+    std::vector<ASTImpl::SerializedNode> nodes;
+    ast.Serialize(nodes);
+    for (auto& node : nodes) {
+        const int corners = node.kind == ASTImpl::SerializedNode::Kind::Cell    ? 1
+                            : node.kind == ASTImpl::SerializedNode::Kind::Range ? 2
+                                                                                : 0;
+        for (int i = 0; i < 2 * corners; i += 2) {
+            node.coords[i] -= origin.row;
+            node.coords[i + 1] -= origin.col;
+        }
+    }
+    return std::string(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(ASTImpl::SerializedNode));
+}
 }  // namespace
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     return std::make_unique<Formula>(std::move(expression));
+}
+
+FormulaTemplates::FormulaTemplates()
+    : prune_threshold_(1024) {}
+
+FormulaTemplates::~FormulaTemplates() = default;
+
+std::unique_ptr<FormulaInterface> FormulaTemplates::Parse(std::string_view expression, Position pos) {
+    auto key = ToRelativeForm(expression, pos);
+    if (!key) {
+        return ParseFormula(std::string(expression));
+    }
+
+    if (auto it = templates_.find(*key); it != templates_.end()) {
+        if (auto ast = it->second.ast.lock()) {
+            Position offset{pos.row - it->second.origin.row, pos.col - it->second.origin.col};
+            return std::make_unique<Formula>(std::move(ast), offset);
+        }
+    }
+
+    auto ast = std::make_shared<const FormulaAST>(TryParseFormulaAST(std::string(expression)));
+    if (!registered_.empty()) {
+        if (auto it = registered_.find(ToStructuralForm(*ast, pos)); it != registered_.end()) {
+            if (auto shared = it->second.ast.lock()) {
+                // Последующие формулы этого текста находят шаблон сразу
+                const Template tmpl = it->second;
+                templates_.insert_or_assign(std::move(*key), tmpl);
+                return std::make_unique<Formula>(std::move(shared),
+                                                 Position{pos.row - tmpl.origin.row, pos.col - tmpl.origin.col});
+            }
+        }
+    }
+    templates_.insert_or_assign(std::move(*key), Template{ast, pos});
+    if (templates_.size() + registered_.size() >= prune_threshold_) {
+        PruneExpired();
+    }
+
+    return std::make_unique<Formula>(std::move(ast), Position{0, 0});
+}
+
+std::unique_ptr<FormulaInterface> FormulaTemplates::Instantiate(std::shared_ptr<const FormulaAST> ast, Position offset) {
+    return std::make_unique<Formula>(std::move(ast), offset);
+}
+
+void FormulaTemplates::Register(const FormulaInterface& formula, Position pos) {
+    const Position offset = formula.GetOffset();
+    const Position origin{pos.row - offset.row, pos.col - offset.col};
+    auto key = ToStructuralForm(*formula.GetAST(), origin);
+    if (auto it = registered_.find(key); it != registered_.end() && !it->second.ast.expired()) {
+        return;
+    }
+
+    registered_.insert_or_assign(std::move(key), Template{formula.GetAST(), origin});
+    if (templates_.size() + registered_.size() >= prune_threshold_) {
+        PruneExpired();
+    }
+}
+
+size_t FormulaTemplates::GetLiveCount() const {
+    // Шаблон из снимка может быть найден и по тексту, и по форме дерева
+    std::unordered_set<const FormulaAST*> live;
+    for (const auto* templates : {&templates_, &registered_}) {
+        for (const auto& [key, tmpl] : *templates) {
+            if (auto ast = tmpl.ast.lock()) {
+                live.insert(ast.get());
+            }
+        }
+    }
+    return live.size();
+}
+
+// Шаблоны удалённых формул вычищаются, когда их становится столько же,
+// сколько было всего шаблонов после прошлой чистки
+void FormulaTemplates::PruneExpired() {
+    for (auto* templates : {&templates_, &registered_}) {
+        for (auto it = templates->begin(); it != templates->end();) {
+            if (it->second.ast.expired()) {
+                it = templates->erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    prune_threshold_ = std::max<size_t>(1024, 2 * (templates_.size() + registered_.size()));
 }
\ No newline at end of file
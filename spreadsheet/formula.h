@@ -2,9 +2,116 @@
 
 #include "common.h"
 
+#include <cstddef>
+#include <iterator>
 #include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
+class FormulaAST;
+
+// Ссылки формулы без копирования (как std::span из C++20): непрерывный массив
+// разобранного выражения, общего для формул одной формы, и смещение формулы,
+// которое прибавляется к элементу при чтении. Действителен, пока жива формула
+template <typename T>
+class ReferenceSpan {
+public:
+    class Iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = T;
+
+        Iterator(const T* ptr, Position offset)
+            : ptr_(ptr), offset_(offset) {}
+
+        T operator*() const {
+            return Shift(*ptr_, offset_);
+        }
+
+        Iterator& operator++() {
+            ++ptr_;
+            return *this;
+        }
+
+        Iterator operator++(int) {
+            Iterator result = *this;
+            ++ptr_;
+            return result;
+        }
+
+        bool operator==(const Iterator& rhs) const {
+            return ptr_ == rhs.ptr_;
+        }
+
+        bool operator!=(const Iterator& rhs) const {
+            return ptr_ != rhs.ptr_;
+        }
+
+    private:
+        const T* ptr_;
+        Position offset_;
+    };
+
+    ReferenceSpan() = default;
+
+    ReferenceSpan(const T* data, std::size_t size, Position offset)
+        : data_(data), size_(size), offset_(offset) {}
+
+    Iterator begin() const {
+        return {data_, offset_};
+    }
+
+    Iterator end() const {
+        return {data_ + size_, offset_};
+    }
+
+    std::size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    T operator[](std::size_t index) const {
+        return Shift(data_[index], offset_);
+    }
+
+    T front() const {
+        return (*this)[0];
+    }
+
+private:
+    static Position Shift(Position pos, Position offset) {
+        return {pos.row + offset.row, pos.col + offset.col};
+    }
+
+    static Range Shift(Range range, Position offset) {
+        return {Shift(range.from, offset), Shift(range.to, offset)};
+    }
+
+    const T* data_ = nullptr;
+    std::size_t size_ = 0;
+    Position offset_{0, 0};
+};
+
+// Источник значений диапазонов для вычисления формул. Лист реализует его,
+// отдавая ячейки диапазона прямо из хранилища
+class RangeSource {
+public:
+    virtual ~RangeSource() = default;
+
+    // Добавляет в values числовые значения непустых ячеек диапазона (построчно).
+    // Возвращает ошибку, если значение какой-либо ячейки нельзя трактовать как
+    // число; содержимое values при этом не определено.
+    virtual std::optional<FormulaError> CollectRangeValues(Range range, std::vector<double>& values) const = 0;
+};
+
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
@@ -25,6 +132,9 @@ public:
     // возвращается именно эта ошибка. Если таких ошибок несколько, возвращается
     // любая.
     virtual Value Evaluate(const SheetInterface& sheet) const = 0;
+    // То же, но значения диапазонов берутся из ranges, а не запросом каждой
+    // ячейки через GetCell
+    virtual Value Evaluate(const SheetInterface& sheet, const RangeSource& ranges) const = 0;
 
     // Возвращает выражение, которое описывает формулу.
     // Не содержит пробелов и лишних скобок.
@@ -34,8 +144,63 @@ public:
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Ссылки на отдельные ячейки (без ячеек диапазонов), отсортированные и без
+    // повторов. Список строится один раз при разборе, обращение не выделяет память
+    virtual ReferenceSpan<Position> GetSingleCellReferences() const = 0;
+
+    // Диапазоны из аргументов функций. Ячейки диапазонов отдельно не перечисляются,
+    // поэтому стоимость работы с зависимостями не зависит от размера диапазона
+    virtual ReferenceSpan<Range> GetRangeReferences() const = 0;
+
+    // Разобранное выражение, общее для формул одной формы, и смещение этой
+    // формулы относительно ячейки, для которой выражение разбиралось
+    virtual const std::shared_ptr<const FormulaAST>& GetAST() const = 0;
+    virtual Position GetOffset() const = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Разбирает формулы ячеек листа так, что формулы одинаковой формы разделяют
+// одно скомпилированное выражение. Ссылки приводятся к виду относительно ячейки
+// формулы (R[-1]C[0] и т.п.): например, =A1*B1 в C1 и =A2*B2 в C2 дают один
+// шаблон, а формулы отличаются только смещением. GetExpression() по-прежнему
+// возвращает абсолютные ссылки.
+class FormulaTemplates {
+public:
+    FormulaTemplates();
+    ~FormulaTemplates();
+
+    // Как ParseFormula, но для формулы в ячейке pos. Текст копируется, только
+    // если выражение такой формы ещё не разбиралось
+    std::unique_ptr<FormulaInterface> Parse(std::string_view expression, Position pos);
+
+    // Формула на основе готового выражения, например загруженного из снимка
+    static std::unique_ptr<FormulaInterface> Instantiate(std::shared_ptr<const FormulaAST> ast, Position offset);
+
+    // Делает выражение формулы в ячейке pos (например, загруженной из снимка)
+    // шаблоном её формы, если живого шаблона такой формы ещё нет: последующие
+    // формулы той же формы разделят его
+    void Register(const FormulaInterface& formula, Position pos);
+
+    // Число шаблонов, которые используются хотя бы одной формулой
+    size_t GetLiveCount() const;
+
+private:
+    struct Template {
+        std::weak_ptr<const FormulaAST> ast; // Шаблон живёт, пока на него ссылаются формулы
+        Position origin;                     // Ячейка, для которой шаблон был разобран
+    };
+
+    void PruneExpired();
+
+    // Шаблоны по тексту формулы в относительном виде
+    std::unordered_map<std::string, Template> templates_;
+    // Шаблоны, добавленные через Register, по точной форме дерева: текст, из
+    // которого они разбирались, неизвестен, поэтому новая формула, не найденная
+    // по тексту, сверяется с ними по своему разобранному дереву
+    std::unordered_map<std::string, Template> registered_;
+    size_t prune_threshold_;
+};
\ No newline at end of file
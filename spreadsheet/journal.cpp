@@ -0,0 +1,661 @@
+#include "journal.h"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <string_view>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#define SPREADSHEET_JOURNAL_FSYNC
+#endif
+
+#include "sheet.h"
+#include "table_reader.h"
+
+namespace fs = std::filesystem;
+
+// Сегмент журнала - последовательность записей:
+//   uint32 size     - размер правки в байтах
+//   uint32 checksum - CRC-32 правки
+//   правка: uint8 операция, затем
+//     SetCell, ClearCell: int32 строка, int32 столбец, текст (для SetCell)
+//     SetCells: uint32 число ячеек, для каждой int32 строка, int32 столбец,
+//               uint32 длина текста, текст
+// Запись, оборванная сбоем, не проходит проверку размера или контрольной
+// суммы, и чтение сегмента на ней заканчивается. Пакет правок занимает одну
+// запись, поэтому он восстанавливается либо целиком, либо никак.
+
+namespace {
+
+enum class Op : std::uint8_t {
+    Set,
+    Clear,
+    SetBatch,
+};
+
+constexpr size_t RECORD_HEADER_SIZE = 2 * sizeof(std::uint32_t);
+constexpr size_t EDIT_HEADER_SIZE = sizeof(Op) + 2 * sizeof(std::int32_t);
+
+constexpr std::array<std::uint32_t, 256> MakeCrcTable() {
+    std::array<std::uint32_t, 256> table{};
+    for (std::uint32_t i = 0; i < 256; ++i) {
+        std::uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+        }
+        table[i] = crc;
+    }
+    return table;
+}
+
+constexpr auto CRC_TABLE = MakeCrcTable();
+
+std::uint32_t Crc32(std::string_view data) {
+    std::uint32_t crc = 0xFFFFFFFFu;
+    for (char c : data) {
+        crc = CRC_TABLE[(crc ^ static_cast<unsigned char>(c)) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+template <typename T>
+void Put(std::string& out, T value) {
+    char bytes[sizeof(T)];
+    std::memcpy(bytes, &value, sizeof(T));
+    out.append(bytes, sizeof(T));
+}
+
+template <typename T>
+T Get(const char* data) {
+    T value;
+    std::memcpy(&value, data, sizeof(T));
+    return value;
+}
+
+// Резервирует место под заголовок записи, возвращает его смещение
+size_t BeginRecord(std::string& out) {
+    const size_t header = out.size();
+    out.resize(header + RECORD_HEADER_SIZE);
+    return header;
+}
+
+// Заполняет заголовок записи по правке, дописанной после него
+void EndRecord(std::string& out, size_t header) {
+    const std::string_view edit(out.data() + header + RECORD_HEADER_SIZE, out.size() - header - RECORD_HEADER_SIZE);
+    const std::uint32_t size = static_cast<std::uint32_t>(edit.size());
+    const std::uint32_t checksum = Crc32(edit);
+    std::memcpy(out.data() + header, &size, sizeof(size));
+    std::memcpy(out.data() + header + sizeof(size), &checksum, sizeof(checksum));
+}
+
+void EncodeEdit(std::string& out, Op op, Position pos, std::string_view text) {
+    const size_t header = BeginRecord(out);
+    Put(out, op);
+    Put(out, static_cast<std::int32_t>(pos.row));
+    Put(out, static_cast<std::int32_t>(pos.col));
+    out.append(text);
+    EndRecord(out, header);
+}
+
+void EncodeBatch(std::string& out, const std::vector<std::pair<Position, std::string>>& cells) {
+    const size_t header = BeginRecord(out);
+    Put(out, Op::SetBatch);
+    Put(out, static_cast<std::uint32_t>(cells.size()));
+    for (const auto& [pos, text] : cells) {
+        Put(out, static_cast<std::int32_t>(pos.row));
+        Put(out, static_cast<std::int32_t>(pos.col));
+        Put(out, static_cast<std::uint32_t>(text.size()));
+        out.append(text);
+    }
+    EndRecord(out, header);
+}
+
+// Разбирает пакет правок (без байта операции). Контрольная сумма уже
+// проверена, поэтому несоответствие длин означает порчу журнала
+std::vector<std::pair<Position, std::string>> DecodeBatch(std::string_view edit) {
+    auto take = [&edit](size_t size) {
+        if (edit.size() < size) {
+            throw JournalException("Malformed journal batch");
+        }
+        const char* data = edit.data();
+        edit.remove_prefix(size);
+        return data;
+    };
+
+    const auto count = Get<std::uint32_t>(take(sizeof(std::uint32_t)));
+    std::vector<std::pair<Position, std::string>> cells;
+    cells.reserve(std::min<size_t>(count, edit.size() / (3 * sizeof(std::uint32_t))));
+    for (std::uint32_t i = 0; i < count; ++i) {
+        const auto row = Get<std::int32_t>(take(sizeof(std::int32_t)));
+        const auto col = Get<std::int32_t>(take(sizeof(std::int32_t)));
+        const auto length = Get<std::uint32_t>(take(sizeof(std::uint32_t)));
+        cells.emplace_back(Position{row, col}, std::string(take(length), length));
+    }
+    if (!edit.empty()) {
+        throw JournalException("Malformed journal batch");
+    }
+    return cells;
+}
+
+std::string SnapshotPath(const std::string& dir, std::uint64_t seq) {
+    return (fs::path(dir) / ("snapshot-" + std::to_string(seq))).string();
+}
+
+std::string SegmentPath(const std::string& dir, std::uint64_t seq) {
+    return (fs::path(dir) / ("wal-" + std::to_string(seq))).string();
+}
+
+// Номер файла вида <prefix><N>, если имя имеет такой вид
+std::optional<std::uint64_t> ParseSeq(const std::string& name, std::string_view prefix) {
+    if (name.size() <= prefix.size() || name.compare(0, prefix.size(), prefix) != 0) {
+        return std::nullopt;
+    }
+    std::uint64_t seq = 0;
+    const char* end = name.data() + name.size();
+    auto [ptr, ec] = std::from_chars(name.data() + prefix.size(), end, seq);
+    if (ec != std::errc() || ptr != end || seq == 0) {
+        return std::nullopt;
+    }
+    return seq;
+}
+
+struct StorageFiles {
+    std::vector<std::uint64_t> snapshots;
+    std::vector<std::uint64_t> segments;
+};
+
+StorageFiles ScanDirectory(const std::string& dir) {
+    StorageFiles files;
+    for (const auto& entry : fs::directory_iterator(dir)) {
+        const std::string name = entry.path().filename().string();
+        if (auto seq = ParseSeq(name, "snapshot-")) {
+            files.snapshots.push_back(*seq);
+        } else if (auto seq = ParseSeq(name, "wal-")) {
+            files.segments.push_back(*seq);
+        }
+    }
+    std::sort(files.snapshots.begin(), files.snapshots.end());
+    std::sort(files.segments.begin(), files.segments.end());
+    return files;
+}
+
+// Переименования и новые файлы каталога переживают сбой только после его fsync
+void SyncPath(const std::string& path) {
+#ifdef SPREADSHEET_JOURNAL_FSYNC
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw JournalException("Cannot sync " + path);
+    }
+    const int result = ::fsync(fd);
+    ::close(fd);
+    if (result != 0) {
+        throw JournalException("Cannot sync " + path);
+    }
+#endif
+}
+
+void SyncFile(std::FILE* file, const std::string& path) {
+    if (std::fflush(file) != 0) {
+        throw JournalException("Cannot write journal: " + path);
+    }
+#ifdef SPREADSHEET_JOURNAL_FSYNC
+#ifdef __linux__
+    const int result = ::fdatasync(::fileno(file));
+#else
+    const int result = ::fsync(::fileno(file));
+#endif
+    if (result != 0) {
+        throw JournalException("Cannot sync journal: " + path);
+    }
+#endif
+}
+
+std::FILE* OpenSegment(const std::string& path) {
+    std::FILE* file = std::fopen(path.c_str(), "ab");
+    if (file == nullptr) {
+        throw JournalException("Cannot open journal: " + path);
+    }
+    return file;
+}
+
+// Применяет правки сегмента к таблице, возвращает их число (пакет считается
+// по числу ячеек)
+size_t ReplaySegment(const std::string& path, Sheet& sheet) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw JournalException("Cannot read journal: " + path);
+    }
+    const std::string data{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+
+    size_t count = 0;
+    size_t offset = 0;
+    while (data.size() - offset >= RECORD_HEADER_SIZE) {
+        const auto size = Get<std::uint32_t>(data.data() + offset);
+        const auto checksum = Get<std::uint32_t>(data.data() + offset + sizeof(size));
+        const size_t begin = offset + RECORD_HEADER_SIZE;
+        if (size < sizeof(Op) || size > data.size() - begin) {
+            break;
+        }
+        const std::string_view edit(data.data() + begin, size);
+        if (Crc32(edit) != checksum) {
+            break;
+        }
+
+        // Правки записаны после успешного выполнения и повторяются в том же
+        // порядке от того же состояния и тем же методом таблицы, поэтому
+        // ошибка означает порчу журнала
+        try {
+            const auto op = Get<Op>(edit.data());
+            if (op == Op::SetBatch) {
+                auto cells = DecodeBatch(edit.substr(sizeof(Op)));
+                count += cells.size();
+                sheet.SetCells(std::move(cells));
+            } else {
+                if (edit.size() < EDIT_HEADER_SIZE) {
+                    throw JournalException("Malformed journal edit");
+                }
+                const Position pos{Get<std::int32_t>(edit.data() + sizeof(Op)),
+                                   Get<std::int32_t>(edit.data() + sizeof(Op) + sizeof(std::int32_t))};
+                if (op == Op::Set) {
+                    sheet.SetCell(pos, std::string(edit.substr(EDIT_HEADER_SIZE)));
+                } else if (op == Op::Clear) {
+                    sheet.ClearCell(pos);
+                } else {
+                    throw JournalException("Unknown journal operation");
+                }
+                ++count;
+            }
+        } catch (const std::exception&) {
+            throw JournalException("Cannot replay journal: " + path);
+        }
+
+        offset = begin + size;
+    }
+    return count;
+}
+
+std::unique_ptr<Sheet> LoadBase(const std::string& dir, std::uint64_t snapshot_seq) {
+    if (snapshot_seq == 0) {
+        return std::make_unique<Sheet>();
+    }
+    return Sheet::LoadSnapshot(SnapshotPath(dir, snapshot_seq));
+}
+
+// Номер последнего снимка до seq (0, если его нет)
+std::uint64_t PreviousSnapshot(const StorageFiles& files, std::uint64_t seq) {
+    auto it = std::lower_bound(files.snapshots.begin(), files.snapshots.end(), seq);
+    return it == files.snapshots.begin() ? 0 : *std::prev(it);
+}
+
+bool HasSegments(const StorageFiles& files, std::uint64_t first, std::uint64_t last) {
+    for (std::uint64_t seq = first; seq <= last; ++seq) {
+        if (!std::binary_search(files.segments.begin(), files.segments.end(), seq)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Загружает последний снимок. Если он не загружается, а сегменты, которые он
+// включает, ещё не удалены, загружает предыдущий снимок, к которому затем
+// применяются эти сегменты. Возвращает номер загруженного снимка в snapshot_seq
+std::unique_ptr<Sheet> LoadLatest(const std::string& dir, const StorageFiles& files, std::uint64_t& snapshot_seq) {
+    snapshot_seq = files.snapshots.empty() ? 0 : files.snapshots.back();
+    try {
+        return LoadBase(dir, snapshot_seq);
+    } catch (const SnapshotException&) {
+        const std::uint64_t previous = PreviousSnapshot(files, snapshot_seq);
+        if (!HasSegments(files, previous + 1, snapshot_seq)) {
+            throw;
+        }
+        auto sheet = LoadBase(dir, previous);
+        // Повреждённый снимок больше не нужен: следующая свёртка заменит его
+        fs::remove(SnapshotPath(dir, snapshot_seq));
+        snapshot_seq = previous;
+        return sheet;
+    }
+}
+
+// Удаляет снимки до snapshot_seq и сегменты, которые он включает
+void RemoveFiles(const std::string& dir, std::uint64_t snapshot_seq) {
+    const StorageFiles files = ScanDirectory(dir);
+    for (std::uint64_t seq : files.snapshots) {
+        if (seq < snapshot_seq) {
+            fs::remove(SnapshotPath(dir, seq));
+        }
+    }
+    for (std::uint64_t seq : files.segments) {
+        if (seq <= snapshot_seq) {
+            fs::remove(SegmentPath(dir, seq));
+        }
+    }
+}
+
+// Сворачивает сегменты в снимок с номером последнего из них. Исходный снимок
+// и свёрнутые сегменты остаются на случай порчи нового снимка, а удаляются
+// файлы, которые заменяет исходный снимок
+void CompactSegments(const std::string& dir, std::uint64_t snapshot_seq, const std::vector<std::uint64_t>& segments) {
+    auto sheet = LoadBase(dir, snapshot_seq);
+    for (std::uint64_t seq : segments) {
+        ReplaySegment(SegmentPath(dir, seq), *sheet);
+    }
+    // Снимок сохраняется с вычисленными значениями, чтобы открытие не
+    // пересчитывало таблицу
+    sheet->Recalculate();
+
+    // Снимок записывается на диск до удаления файлов
+    sheet->SaveSnapshot(SnapshotPath(dir, segments.back()));
+    RemoveFiles(dir, snapshot_seq);
+}
+
+}  // namespace
+
+std::unique_ptr<DurableSheet> DurableSheet::Open(const std::string& dir) {
+    return Open(dir, Options{});
+}
+
+std::unique_ptr<DurableSheet> DurableSheet::Open(const std::string& dir, Options options) {
+    std::error_code error;
+    fs::create_directories(dir, error);
+    if (error) {
+        throw JournalException("Cannot create directory: " + dir);
+    }
+
+    const StorageFiles files = ScanDirectory(dir);
+    std::uint64_t snapshot_seq = 0;
+    auto sheet = LoadLatest(dir, files, snapshot_seq);
+
+    size_t replayed = 0;
+    std::vector<std::uint64_t> sealed;
+    for (std::uint64_t seq : files.segments) {
+        if (seq > snapshot_seq) {
+            replayed += ReplaySegment(SegmentPath(dir, seq), *sheet);
+            sealed.push_back(seq);
+        }
+    }
+    // Остатки прерванной свёртки
+    RemoveFiles(dir, PreviousSnapshot(files, snapshot_seq));
+
+    // Новые правки пишутся в новый сегмент, поэтому оборванная запись в конце
+    // прежнего остаётся последней в нём. Применённые сегменты сворачиваются в фоне
+    const std::uint64_t segment_seq = std::max(snapshot_seq, sealed.empty() ? 0 : sealed.back()) + 1;
+    std::unique_ptr<DurableSheet> result(
+        new DurableSheet(dir, options, std::move(sheet), snapshot_seq, segment_seq, std::move(sealed)));
+    result->replayed_count_ = replayed;
+    return result;
+}
+
+DurableSheet::DurableSheet(std::string dir, Options options, std::unique_ptr<Sheet> sheet, std::uint64_t snapshot_seq,
+                           std::uint64_t segment_seq, std::vector<std::uint64_t> sealed)
+    : dir_(std::move(dir))
+    , options_(options)
+    , sheet_(std::move(sheet))
+    , segment_seq_(segment_seq)
+    , sealed_(std::move(sealed))
+    , snapshot_seq_(snapshot_seq) {
+    const std::string path = SegmentPath(dir_, segment_seq_);
+    segment_file_ = OpenSegment(path);
+    SyncPath(dir_);
+
+    flusher_ = std::thread([this] {
+        FlushLoop();
+    });
+    compactor_ = std::thread([this] {
+        CompactLoop();
+    });
+}
+
+DurableSheet::~DurableSheet() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    flush_cv_.notify_one();
+    compact_cv_.notify_one();
+    flusher_.join();
+    compactor_.join();
+    std::fclose(segment_file_);
+}
+
+void DurableSheet::SetCell(Position pos, std::string text) {
+    CheckFailure();
+    record_.clear();
+    EncodeEdit(record_, Op::Set, pos, text);
+    sheet_->SetCell(pos, std::move(text));
+    Append();
+}
+
+void DurableSheet::SetCells(std::vector<std::pair<Position, std::string>> cells) {
+    CheckFailure();
+    record_.clear();
+    // Пакет пишется одной записью и повторяется через SetCells: по отдельности
+    // его правки могут образовать временный цикл или содержать отброшенную
+    // пакетом некорректную формулу
+    EncodeBatch(record_, cells);
+    sheet_->SetCells(std::move(cells));
+    Append();
+}
+
+void DurableSheet::ImportTable(std::istream& input, TableFormat format, Position origin) {
+    if (!origin.IsValid()) {
+        throw InvalidPositionException("Incorrect position");
+    }
+
+    // Таблица журналируется одной записью пакета: её поля могут ссылаться на
+    // ячейки, записанные позже, и по отдельности не всегда повторяемы
+    std::vector<std::pair<Position, std::string>> cells;
+    TableReader reader(input, format);
+    TableReader::Field field;
+    while (reader.Next(field)) {
+        cells.emplace_back(Position{origin.row + field.row, origin.col + field.col}, std::string(field.text));
+    }
+    SetCells(std::move(cells));
+}
+
+void DurableSheet::ClearCell(Position pos) {
+    CheckFailure();
+    record_.clear();
+    EncodeEdit(record_, Op::Clear, pos, {});
+    sheet_->ClearCell(pos);
+    Append();
+}
+
+const CellInterface* DurableSheet::GetCell(Position pos) const {
+    return sheet_->GetCell(pos);
+}
+
+CellInterface* DurableSheet::GetCell(Position pos) {
+    return sheet_->GetCell(pos);
+}
+
+Size DurableSheet::GetPrintableSize() const {
+    return sheet_->GetPrintableSize();
+}
+
+void DurableSheet::PrintValues(std::ostream& output) const {
+    sheet_->PrintValues(output);
+}
+
+void DurableSheet::PrintTexts(std::ostream& output) const {
+    sheet_->PrintTexts(output);
+}
+
+void DurableSheet::Recalculate() {
+    sheet_->Recalculate();
+}
+
+void DurableSheet::SetRecalculationThreads(size_t threads) {
+    sheet_->SetRecalculationThreads(threads);
+}
+
+size_t DurableSheet::GetLastInvalidationCount() const {
+    return sheet_->GetLastInvalidationCount();
+}
+
+SheetStats DurableSheet::GetStats() const {
+    return sheet_->GetStats();
+}
+
+void DurableSheet::ResetStats() {
+    sheet_->ResetStats();
+}
+
+void DurableSheet::StartTracing(size_t capacity) {
+    sheet_->StartTracing(capacity);
+}
+
+void DurableSheet::StopTracing() {
+    sheet_->StopTracing();
+}
+
+void DurableSheet::WriteTrace(std::ostream& output) const {
+    sheet_->WriteTrace(output);
+}
+
+void DurableSheet::SaveSnapshot(const std::string& path) const {
+    sheet_->SaveSnapshot(path);
+}
+
+void DurableSheet::Sync() {
+    std::unique_lock lock(mutex_);
+    const std::uint64_t target = appended_;
+    sync_requested_ = true;
+    flush_cv_.notify_one();
+    done_cv_.wait(lock, [this, target] {
+        return durable_ >= target || error_;
+    });
+    if (error_) {
+        std::rethrow_exception(error_);
+    }
+}
+
+void DurableSheet::Compact() {
+    std::unique_lock lock(mutex_);
+    const std::uint64_t target = segment_seq_;
+    rotate_requested_ = true;
+    flush_cv_.notify_one();
+    done_cv_.wait(lock, [this, target] {
+        return snapshot_seq_ >= target || error_;
+    });
+    if (error_) {
+        std::rethrow_exception(error_);
+    }
+}
+
+void DurableSheet::CheckFailure() const {
+    if (failed_.load(std::memory_order_relaxed)) {
+        throw JournalException("The journal of " + dir_ + " is not writable");
+    }
+}
+
+void DurableSheet::Append() {
+    bool full;
+    {
+        std::lock_guard lock(mutex_);
+        pending_ += record_;
+        appended_ += record_.size();
+        full = pending_.size() >= options_.group_bytes;
+    }
+    if (full) {
+        flush_cv_.notify_one();
+    }
+}
+
+void DurableSheet::Fail(std::exception_ptr error) {
+    std::lock_guard lock(mutex_);
+    error_ = error;
+    failed_.store(true, std::memory_order_relaxed);
+    done_cv_.notify_all();
+}
+
+void DurableSheet::FlushLoop() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+        flush_cv_.wait_for(lock, options_.flush_interval, [this] {
+            return stopping_ || sync_requested_ || rotate_requested_ || pending_.size() >= options_.group_bytes;
+        });
+
+        const bool stop = stopping_;
+        bool rotate = rotate_requested_;
+        const std::uint64_t batch_end = appended_;
+        batch_.clear();
+        batch_.swap(pending_);
+        sync_requested_ = false;
+        rotate_requested_ = false;
+        lock.unlock();
+
+        std::uint64_t sealed = 0;
+        try {
+            // Вся группа правок записывается одним вызовом и одним fsync
+            const std::string path = SegmentPath(dir_, segment_seq_);
+            if (!batch_.empty()) {
+                if (std::fwrite(batch_.data(), 1, batch_.size(), segment_file_) != batch_.size()) {
+                    throw JournalException("Cannot write journal: " + path);
+                }
+                SyncFile(segment_file_, path);
+                segment_size_ += batch_.size();
+            }
+
+            if (rotate || segment_size_ >= options_.segment_bytes) {
+                const std::string next_path = SegmentPath(dir_, segment_seq_ + 1);
+                std::FILE* next = OpenSegment(next_path);
+                SyncPath(dir_);
+                std::fclose(segment_file_);
+                segment_file_ = next;
+                segment_size_ = 0;
+                sealed = segment_seq_;
+            }
+        } catch (...) {
+            Fail(std::current_exception());
+            return;
+        }
+
+        lock.lock();
+        durable_ = batch_end;
+        if (sealed != 0) {
+            ++segment_seq_;
+            sealed_.push_back(sealed);
+            compact_cv_.notify_one();
+        }
+        done_cv_.notify_all();
+
+        if (stop && pending_.empty()) {
+            return;
+        }
+    }
+}
+
+void DurableSheet::CompactLoop() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+        compact_cv_.wait(lock, [this] {
+            return stopping_ || !sealed_.empty();
+        });
+        if (stopping_) {
+            return;
+        }
+
+        const std::vector<std::uint64_t> segments = std::move(sealed_);
+        sealed_.clear();
+        const std::uint64_t base = snapshot_seq_;
+        lock.unlock();
+
+        try {
+            CompactSegments(dir_, base, segments);
+        } catch (...) {
+            Fail(std::current_exception());
+            return;
+        }
+
+        lock.lock();
+        snapshot_seq_ = segments.back();
+        done_cv_.notify_all();
+    }
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+
+class Sheet;
+
+// Исключение, выбрасываемое при ошибке записи или чтения журнала правок
+class JournalException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Таблица с журналом правок (write-ahead log) для восстановления после сбоя.
+// Каталог хранилища содержит снимки snapshot-N и сегменты журнала wal-N.
+// Снимок snapshot-N включает правки всех сегментов с номерами до N
+// включительно, при открытии к нему применяются правки следующих сегментов.
+// Предыдущий снимок и сегменты после него удаляются только при следующей
+// свёртке: если последний снимок не загружается, таблица восстанавливается
+// из предыдущего.
+//
+// Успешная правка только дописывается в буфер в памяти. Фоновый поток
+// записывает накопленные правки группами, с одним fsync на группу, поэтому
+// правка переживает сбой, если с неё прошло больше flush_interval (или после
+// Sync). Заполненный сегмент закрывается, и второй фоновый поток сворачивает
+// его в новый снимок, не трогая рабочую таблицу: он загружает прежний снимок в
+// отдельную таблицу и применяет к ней правки сегмента.
+//
+// Как и Sheet, таблица рассчитана на работу из одного потока.
+class DurableSheet : public SheetInterface {
+public:
+    struct Options {
+        // Наибольшая задержка записи правок на диск
+        std::chrono::milliseconds flush_interval{10};
+        // Объём накопленных правок, при котором запись начинается, не дожидаясь интервала
+        size_t group_bytes = 1 << 20;
+        // Размер сегмента, после которого он сворачивается в снимок
+        size_t segment_bytes = 64 << 20;
+    };
+
+    // Восстанавливает таблицу из каталога (создаёт его, если нужно).
+    // Бросает JournalException или SnapshotException
+    static std::unique_ptr<DurableSheet> Open(const std::string& dir);
+    static std::unique_ptr<DurableSheet> Open(const std::string& dir, Options options);
+
+    DurableSheet(const DurableSheet&) = delete;
+    DurableSheet& operator=(const DurableSheet&) = delete;
+    // Записывает оставшиеся правки. Незавершённая свёртка прерывается и
+    // повторяется при следующем открытии
+    ~DurableSheet();
+
+    // Правки бросают JournalException, если фоновая запись завершилась ошибкой
+    void SetCell(Position pos, std::string text) override;
+    void SetCells(std::vector<std::pair<Position, std::string>> cells) override;
+    // Поля записываются в журнал одним пакетом, как правка SetCells
+    void ImportTable(std::istream& input, TableFormat format, Position origin) override;
+    void ClearCell(Position pos) override;
+
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+    Size GetPrintableSize() const override;
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+    void Recalculate() override;
+    void SetRecalculationThreads(size_t threads) override;
+    size_t GetLastInvalidationCount() const override;
+    SheetStats GetStats() const override;
+    void ResetStats() override;
+    void StartTracing(size_t capacity) override;
+    void StopTracing() override;
+    void WriteTrace(std::ostream& output) const override;
+    void SaveSnapshot(const std::string& path) const override;
+
+    // Дожидается записи на диск всех сделанных правок
+    void Sync();
+    // Закрывает текущий сегмент и дожидается, пока он будет свёрнут в снимок
+    void Compact();
+
+    // Число правок, применённых из журнала при открытии
+    size_t GetReplayedCount() const {
+        return replayed_count_;
+    }
+
+private:
+    DurableSheet(std::string dir, Options options, std::unique_ptr<Sheet> sheet, std::uint64_t snapshot_seq,
+                 std::uint64_t segment_seq, std::vector<std::uint64_t> sealed);
+
+    void CheckFailure() const;
+    // Передаёт закодированные правки из record_ потоку записи
+    void Append();
+    void Fail(std::exception_ptr error);
+
+    void FlushLoop();
+    void CompactLoop();
+
+    const std::string dir_;
+    const Options options_;
+    std::unique_ptr<Sheet> sheet_;
+    size_t replayed_count_ = 0;
+    std::string record_; // Буфер кодирования правок, переиспользуется
+
+    std::mutex mutex_;
+    std::condition_variable flush_cv_;   // будит поток записи
+    std::condition_variable compact_cv_; // будит поток свёртки
+    std::condition_variable done_cv_;    // правки записаны, сегмент свёрнут или произошла ошибка
+    std::string pending_;                // правки, ещё не взятые на запись
+    std::uint64_t appended_ = 0;         // байт правок принято
+    std::uint64_t durable_ = 0;          // байт правок записано на диск
+    bool sync_requested_ = false;
+    bool rotate_requested_ = false;
+    bool stopping_ = false;
+    std::uint64_t segment_seq_;          // номер текущего сегмента
+    std::vector<std::uint64_t> sealed_;  // закрытые сегменты, ожидающие свёртки
+    std::uint64_t snapshot_seq_;         // номер последнего снимка, 0 - снимка нет
+    std::exception_ptr error_;
+    std::atomic<bool> failed_{false};
+
+    // Используются только потоком записи
+    std::FILE* segment_file_ = nullptr;
+    size_t segment_size_ = 0;
+    std::string batch_;
+
+    std::thread flusher_;
+    std::thread compactor_;
+};
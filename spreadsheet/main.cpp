@@ -1,8 +1,21 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <limits>
+#include <map>
+#include <random>
+#include <set>
+#include <thread>
 
 #include "common.h"
 #include "formula.h"
+#include "FormulaAST.h"
+#include "journal.h"
+#include "table_reader.h"
 #include "test_runner_p.h"
+#include "trace.h"
 
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
@@ -26,6 +39,24 @@ inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value
     return output;
 }
 
+inline std::ostream& operator<<(std::ostream& output, const CellInterface::ValueView& value) {
+    std::visit(
+        [&](const auto& x) {
+            output << x;
+        },
+        value);
+    return output;
+}
+
+inline std::ostream& operator<<(std::ostream& output, const CellInterface::NumericValue& value) {
+    std::visit(
+        [&](const auto& x) {
+            output << x;
+        },
+        value);
+    return output;
+}
+
 namespace {
 
 void TestPositionAndStringConversion() {
@@ -289,6 +320,87 @@ void TestPrint() {
     ASSERT_EQUAL(values.str(), "\t\nmeow\t35\n");
 }
 
+void TestPrintSparse() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("C1"_pos, "'=text");
+    sheet->SetCell("A3"_pos, "=1/3");
+    sheet->SetCell("D3"_pos, "=Q1");  // Пустая ячейка Q1 не печатается
+    sheet->SetCell("B4"_pos, "=1/0");
+
+    std::ostringstream texts;
+    sheet->PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "\t\t'=text\t\n\t\t\t\n=1/3\t\t\t=Q1\n\t=1/0\t\t\n");
+
+    std::ostringstream values;
+    sheet->PrintValues(values);
+    ASSERT_EQUAL(values.str(), "\t\t=text\t\n\t\t\t\n0.333333\t\t\t0\n\t#ARITHM!\t\t\n");
+
+    // Числа форматируются с учётом настроек потока
+    std::ostringstream precise;
+    precise.precision(3);
+    sheet->PrintValues(precise);
+    ASSERT_EQUAL(precise.str(), "\t\t=text\t\n\t\t\t\n0.333\t\t\t0\n\t#ARITHM!\t\t\n");
+
+    std::ostringstream fixed;
+    fixed << std::fixed;
+    sheet->PrintValues(fixed);
+    ASSERT_EQUAL(fixed.str(), "\t\t=text\t\n\t\t\t\n0.333333\t\t\t0.000000\n\t#ARITHM!\t\t\n");
+}
+
+void TestPrintableSizeTracking() {
+    auto sheet = CreateSheet();
+    std::vector<std::vector<bool>> occupied(20, std::vector<bool>(20));
+    std::mt19937 rng(7);
+
+    for (int step = 0; step < 2000; ++step) {
+        Position pos{static_cast<int>(rng() % 20), static_cast<int>(rng() % 20)};
+        switch (rng() % 4) {
+            case 0:
+                sheet->ClearCell(pos);
+                break;
+            case 1:
+                sheet->SetCell(pos, "");
+                break;
+            case 2:
+                sheet->SetCell(pos, "text");
+                break;
+            default:
+                // Ссылка создаёт пустую ячейку, которая не входит в печатную область
+                try {
+                    sheet->SetCell(pos, "=" + Position{static_cast<int>(rng() % 20), static_cast<int>(rng() % 20)}.ToString());
+                } catch (const CircularDependencyException&) {
+                }
+        }
+        occupied[pos.row][pos.col] = !sheet->GetCell(pos) ? false : !sheet->GetCell(pos)->GetText().empty();
+
+        Size expected{0, 0};
+        for (int row = 0; row < 20; ++row) {
+            for (int col = 0; col < 20; ++col) {
+                if (occupied[row][col]) {
+                    expected.rows = std::max(expected.rows, row + 1);
+                    expected.cols = std::max(expected.cols, col + 1);
+                }
+            }
+        }
+        ASSERT_EQUAL(sheet->GetPrintableSize(), expected);
+    }
+}
+
+void TestFarApartCells() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "first");
+    sheet->SetCell("XFD16384"_pos, "last");
+    sheet->SetCell("Q17"_pos, "=A1");
+
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{Position::MAX_ROWS, Position::MAX_COLS}));
+    ASSERT_EQUAL(sheet->GetCell("XFD16384"_pos)->GetText(), "last");
+    ASSERT(sheet->GetCell("XFD16383"_pos) == nullptr);
+
+    sheet->ClearCell("XFD16384"_pos);
+    ASSERT(sheet->GetCell("XFD16384"_pos) == nullptr);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{17, 17}));
+}
+
 void TestCellReferences() {
     auto sheet = CreateSheet();
     sheet->SetCell("A1"_pos, "1");
@@ -330,6 +442,957 @@ void TestFormulaIncorrect() {
     ASSERT(isIncorrect("2+4-"));
 }
 
+void TestSetCells() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("C1"_pos, "=A1*10");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(10.0));
+
+    sheet->SetCells({
+        {"B1"_pos, "=A1+A2"},
+        {"A2"_pos, "2"},
+        {"A1"_pos, "0"},
+        {"A1"_pos, "3"},
+    });
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "3");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(5.0));
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(30.0));
+
+    auto expect_unchanged = [&sheet]() {
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "3");
+        ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetText(), "2");
+        ASSERT(sheet->GetCell("D1"_pos) == nullptr);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 3}));
+    };
+
+    // Цикл, который возникает только внутри пакета
+    try {
+        sheet->SetCells({{"D1"_pos, "=A2"}, {"A2"_pos, "=B1"}});
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    expect_unchanged();
+
+    try {
+        sheet->SetCells({{"D1"_pos, "5"}, {"A1"_pos, "=1+"}});
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+    expect_unchanged();
+
+    try {
+        sheet->SetCells({{"D1"_pos, "5"}, {Position{-1, 0}, "1"}});
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+    expect_unchanged();
+}
+
+void TestRecalculateOrder() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("B1"_pos, "=C1+1");
+    sheet->SetCell("D1"_pos, "=5");
+    // Ссылка на ячейку, созданную позже, требует перестановки порядка
+    sheet->SetCell("C1"_pos, "=D1*2");
+    sheet->SetCell("E1"_pos, "=B1+C1+D1");
+
+    sheet->Recalculate();
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(11.0));
+    ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(26.0));
+
+    sheet->SetCell("D1"_pos, "=7");
+    sheet->Recalculate();
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(14.0));
+    ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(36.0));
+}
+
+void TestLongChain() {
+    constexpr int LENGTH = 100'000;
+    auto chain_pos = [](int i) {
+        return Position{i % Position::MAX_ROWS, i / Position::MAX_ROWS};
+    };
+
+    auto sheet = CreateSheet();
+    std::vector<std::pair<Position, std::string>> cells{{chain_pos(0), "1"}};
+    for (int i = 1; i < LENGTH; ++i) {
+        cells.emplace_back(chain_pos(i), "=" + chain_pos(i - 1).ToString() + "+1");
+    }
+    sheet->SetCells(std::move(cells));
+
+    // Значение в конце цепочки вычисляется без рекурсии по ссылкам
+    ASSERT_EQUAL(sheet->GetCell(chain_pos(LENGTH - 1))->GetValue(), CellInterface::Value(double(LENGTH)));
+
+    sheet->SetCell(chain_pos(0), "2");
+    sheet->Recalculate();
+    ASSERT_EQUAL(sheet->GetCell(chain_pos(LENGTH - 1))->GetValue(), CellInterface::Value(double(LENGTH + 1)));
+}
+
+void TestTextNumericValue() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("B1"_pos, "=A1*2");
+
+    auto value_of = [&sheet](const std::string& text) {
+        sheet->SetCell("A1"_pos, text);
+        return sheet->GetCell("B1"_pos)->GetValue();
+    };
+    const CellInterface::Value value_error = FormulaError(FormulaError::Category::Value);
+
+    ASSERT_EQUAL(value_of("12"), CellInterface::Value(24.0));
+    ASSERT_EQUAL(value_of(" \t12"), CellInterface::Value(24.0));
+    ASSERT_EQUAL(value_of("+.5e1"), CellInterface::Value(10.0));
+    ASSERT_EQUAL(value_of("-3."), CellInterface::Value(-6.0));
+    ASSERT_EQUAL(value_of("'7"), CellInterface::Value(14.0));
+    ASSERT_EQUAL(value_of("'"), CellInterface::Value(0.0));
+    ASSERT_EQUAL(value_of("12 "), value_error);
+    ASSERT_EQUAL(value_of("+-5"), value_error);
+    ASSERT_EQUAL(value_of("1e"), value_error);
+    ASSERT_EQUAL(value_of("0x10"), value_error);
+    ASSERT_EQUAL(value_of("inf"), value_error);
+    ASSERT_EQUAL(value_of("nan"), value_error);
+    ASSERT_EQUAL(value_of("1e999"), value_error);
+
+
+    sheet->SetCell("A2"_pos, "3.5");
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetNumericValue(), CellInterface::NumericValue(3.5));
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetValue(), CellInterface::Value("3.5"));
+}
+
+void TestValueView() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "'=escaped");
+    sheet->SetCell("A2"_pos, "=1/0");
+    sheet->SetCell("A3"_pos, "=A1");
+    sheet->SetCell("A4"_pos, "=2*3");
+    sheet->SetCell("B1"_pos, "=A5");
+
+    using View = CellInterface::ValueView;
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValueView(), View(std::string_view("=escaped")));
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetValueView(), View(FormulaError(FormulaError::Category::Arithmetic)));
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValueView(), View(FormulaError(FormulaError::Category::Value)));
+    ASSERT_EQUAL(sheet->GetCell("A4"_pos)->GetValueView(), View(6.0));
+    ASSERT_EQUAL(sheet->GetCell("A5"_pos)->GetValueView(), View(std::string_view()));
+}
+
+void TestAggregateFunctions() {
+    auto sheet = CreateSheet();
+    auto value = [&sheet](const std::string& formula) {
+        sheet->SetCell("BA1"_pos, formula);
+        return sheet->GetCell("BA1"_pos)->GetValue();
+    };
+
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("A2"_pos, "=A1+1");
+    sheet->SetCell("B1"_pos, "3");
+
+    ASSERT_EQUAL(value("=SUM(A1:B2)"), CellInterface::Value(6.0));
+    ASSERT_EQUAL(value("=MIN(A1:B2)"), CellInterface::Value(1.0));
+    ASSERT_EQUAL(value("=MAX(A1:B2)"), CellInterface::Value(3.0));
+    ASSERT_EQUAL(value("=AVERAGE(A1:B2)"), CellInterface::Value(2.0));
+    ASSERT_EQUAL(value("=SUM(B2:A1, 10, A1*2)"), CellInterface::Value(18.0));
+    ASSERT_EQUAL(value("=AVERAGE(A1:B2, 6)"), CellInterface::Value(3.0));
+    ASSERT_EQUAL(value("=-MAX(-5, MIN(A1:A2))*2"), CellInterface::Value(-2.0));
+
+    // Пустые ячейки пропускаются
+    ASSERT_EQUAL(value("=MIN(C1:C5)"), CellInterface::Value(0.0));
+    ASSERT_EQUAL(value("=MAX(C1:C5, -1)"), CellInterface::Value(-1.0));
+    ASSERT_EQUAL(value("=AVERAGE(C1:C5)"), CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+
+    sheet->SetCell("C3"_pos, "text");
+    ASSERT_EQUAL(value("=SUM(C1:C5)"), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+    sheet->SetCell("C3"_pos, "=1/0");
+    ASSERT_EQUAL(value("=MAX(A1:C5)"), CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+    sheet->ClearCell("C3"_pos);
+
+    // Значение пересчитывается при изменении ячейки диапазона
+    sheet->SetCell("Y1"_pos, "=SUM(A1:B2)");
+    ASSERT_EQUAL(sheet->GetCell("Y1"_pos)->GetValue(), CellInterface::Value(6.0));
+    sheet->SetCell("B2"_pos, "4");
+    ASSERT_EQUAL(sheet->GetCell("Y1"_pos)->GetValue(), CellInterface::Value(10.0));
+
+    ASSERT_EQUAL(sheet->GetCell("Y1"_pos)->GetText(), "=SUM(A1:B2)");
+    ASSERT_EQUAL(sheet->GetCell("Y1"_pos)->GetReferencedCells(),
+                 (std::vector{"A1"_pos, "B1"_pos, "A2"_pos, "B2"_pos}));
+    sheet->SetCell("Y1"_pos, "=SUM( B2:A1 , (1+2) )*2");
+    ASSERT_EQUAL(sheet->GetCell("Y1"_pos)->GetText(), "=SUM(A1:B2,1+2)*2");
+
+    // Широкий диапазон через несколько тайлов
+    for (int row = 0; row < 100; ++row) {
+        sheet->SetCell({row + 1, 10}, std::to_string(row + 1));
+        sheet->SetCell({row + 1, 40}, std::to_string(-row));
+    }
+    ASSERT_EQUAL(value("=SUM(K2:AO101)"), CellInterface::Value(5050.0 - 4950.0));
+    ASSERT_EQUAL(value("=MIN(K2:AO101)"), CellInterface::Value(-99.0));
+    ASSERT_EQUAL(value("=MAX(K2:AO101)"), CellInterface::Value(100.0));
+    ASSERT_EQUAL(value("=AVERAGE(K2:K101)"), CellInterface::Value(50.5));
+
+    try {
+        sheet->SetCell("B2"_pos, "=SUM(A1:C3)");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    for (std::string incorrect : {"=A1:B2", "=SUM()", "=SUM(A1:B2+1)", "=FOO(1)", "=SUM(A1:)", "=sum(1)", "=SUM(A1:ZZZZ1)"}) {
+        try {
+            sheet->SetCell("Z2"_pos, incorrect);
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+    }
+}
+
+void TestRangeDependencies() {
+    auto sheet = CreateSheet();
+
+    // Ссылка на диапазон не создаёт пустых ячеек
+    sheet->SetCell("B1"_pos, "=SUM(A1:A16384)");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(0.0));
+    ASSERT(sheet->GetCell("A1"_pos) == nullptr);
+    ASSERT(sheet->GetCell("A8000"_pos) == nullptr);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 2}));
+
+    // Ячейка, появившаяся внутри диапазона, сбрасывает кеш формулы
+    sheet->SetCell("A15000"_pos, "5");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(5.0));
+    sheet->SetCell("A3"_pos, "=A15000*2");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(15.0));
+    sheet->ClearCell("A15000"_pos);
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+    // Пересекающиеся диапазоны и отдельная ссылка на ту же ячейку
+    sheet->SetCell("C1"_pos, "=SUM(A1:A5, A3:B4, A3)");
+    sheet->SetCell("A4"_pos, "1");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(1.0));
+
+    // Заменённая формула больше не зависит от диапазона
+    sheet->SetCell("C1"_pos, "=A4");
+    sheet->Recalculate();
+    sheet->SetCell("A2"_pos, "7");
+    ASSERT_EQUAL(sheet->GetLastInvalidationCount(), 2u);
+
+    // Цикл через ячейку, созданную позже диапазона
+    sheet->SetCell("D1"_pos, "=MAX(E1:E10)");
+    sheet->SetCell("E5"_pos, "=F1");
+    try {
+        sheet->SetCell("F1"_pos, "=D1+1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    try {
+        sheet->SetCells({{"F1"_pos, "=G1"}, {"G1"_pos, "=D1"}});
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    // Порядок пересчёта учитывает ячейки диапазона, ставшие формулами позже
+    sheet->SetCell("F1"_pos, "=G1*2");
+    sheet->SetCells({{"G1"_pos, "3"}, {"E7"_pos, "=SUM(A1:A5)"}});
+    sheet->Recalculate();
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(8.0));
+    sheet->SetCell("G1"_pos, "5");
+    sheet->Recalculate();
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(10.0));
+}
+
+void TestFormulaTemplates() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A2"_pos, "3");
+    sheet->SetCell("B2"_pos, "4");
+
+    FormulaTemplates templates;
+    auto c1 = templates.Parse("A1*B1", "C1"_pos);
+    auto c2 = templates.Parse("A2*B2", "C2"_pos);
+    ASSERT_EQUAL(templates.GetLiveCount(), 1u);
+    ASSERT_EQUAL(c2->GetExpression(), "A2*B2");
+    ASSERT_EQUAL(c2->GetReferencedCells(), (std::vector{"A2"_pos, "B2"_pos}));
+    ASSERT_EQUAL(std::get<double>(c2->Evaluate(*sheet)), 12.0);
+    ASSERT_EQUAL(std::get<double>(c1->Evaluate(*sheet)), 0.0);
+
+    // Те же абсолютные ссылки из другой ячейки дают другую форму
+    auto d2 = templates.Parse("A1*B1", "D2"_pos);
+    ASSERT_EQUAL(templates.GetLiveCount(), 2u);
+    ASSERT_EQUAL(d2->GetExpression(), "A1*B1");
+
+    auto e1 = templates.Parse("SUM(A1:B2)+1e2-.5", "E1"_pos);
+    auto e2 = templates.Parse("SUM(A2:B3)+1e2-.5", "E2"_pos);
+    ASSERT_EQUAL(templates.GetLiveCount(), 3u);
+    ASSERT_EQUAL(e2->GetExpression(), "SUM(A2:B3)+100-0.5");
+    ASSERT_EQUAL(e2->GetRangeReferences().size(), 1u);
+    ASSERT_EQUAL(e2->GetRangeReferences().front().ToString(), "A2:B3");
+
+    // Ссылки берутся из общего выражения со сдвигом, отсортированные и без повторов
+    {
+        auto f5 = templates.Parse("B2+A1+B2*A3", "C5"_pos);
+        auto f6 = templates.Parse("B3+A2+B3*A4", "C6"_pos);
+        ASSERT(f5->GetAST() == f6->GetAST());
+        auto singles = f6->GetSingleCellReferences();
+        ASSERT_EQUAL(singles.size(), 3u);
+        ASSERT_EQUAL(std::vector<Position>(singles.begin(), singles.end()),
+                     (std::vector{"A2"_pos, "B3"_pos, "A4"_pos}));
+        ASSERT_EQUAL(f6->GetReferencedCells(), (std::vector{"A2"_pos, "B3"_pos, "A4"_pos}));
+        ASSERT(templates.Parse("1+2", "A1"_pos)->GetSingleCellReferences().empty());
+    }
+    ASSERT_EQUAL(std::get<double>(e2->Evaluate(*sheet)), 106.5);
+
+    // Без источника диапазонов ячейки диапазона запрашиваются через GetCell
+    sheet->SetCell("A3"_pos, "x");
+    ASSERT(std::get<FormulaError>(e2->Evaluate(*sheet)).GetCategory() == FormulaError::Category::Value);
+    sheet->ClearCell("A3"_pos);
+
+    c1.reset();
+    c2.reset();
+    ASSERT_EQUAL(templates.GetLiveCount(), 2u);
+
+    // Некорректная формула не становится шаблоном
+    for (Position pos : {"F1"_pos, "F2"_pos}) {
+        try {
+            templates.Parse("A1+", pos);
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+    }
+
+    // Заполненный вниз столбец
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < 100; ++row) {
+        std::string index = std::to_string(row + 1);
+        cells.emplace_back(Position{row, 0}, index);
+        cells.emplace_back(Position{row, 1}, "2");
+        cells.emplace_back(Position{row, 2}, "=A" + index + "*B" + index + "+SUM(A1:A" + index + ")");
+    }
+    auto column = CreateSheet();
+    column->SetCells(std::move(cells));
+    ASSERT_EQUAL(column->GetCell("C10"_pos)->GetText(), "=A10*B10+SUM(A1:A10)");
+    ASSERT_EQUAL(column->GetCell("C10"_pos)->GetValue(), CellInterface::Value(75.0));
+    column->SetCell("A5"_pos, "0");
+    ASSERT_EQUAL(column->GetCell("C4"_pos)->GetValue(), CellInterface::Value(18.0));
+    ASSERT_EQUAL(column->GetCell("C5"_pos)->GetValue(), CellInterface::Value(10.0));
+    ASSERT_EQUAL(column->GetCell("C10"_pos)->GetValue(), CellInterface::Value(70.0));
+}
+
+void TestInvalidationPruning() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("B1"_pos, "=A1+1");
+    sheet->SetCell("C1"_pos, "=B1+A1");
+    sheet->SetCell("D1"_pos, "=C1*2");
+    sheet->Recalculate();
+
+    // Первая правка обходит все зависимые формулы
+    sheet->SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet->GetLastInvalidationCount(), 5u);
+
+    // Кеши уже сброшены, обход останавливается на прямых зависимых
+    sheet->SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(sheet->GetLastInvalidationCount(), 3u);
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(14.0));
+
+    sheet->SetCell("A1"_pos, "4");
+    ASSERT_EQUAL(sheet->GetLastInvalidationCount(), 5u);
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(18.0));
+
+    sheet->SetCell("D1"_pos, "=C1*2");
+    ASSERT_EQUAL(sheet->GetLastInvalidationCount(), 0u);
+}
+
+void TestParallelRecalculate() {
+    constexpr int ROWS = 20;
+    constexpr int COLS = 200;
+
+    // Каждая формула ссылается на две формулы предыдущей строки, уровни
+    // зависимостей совпадают со строками
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < ROWS; ++row) {
+        cells.emplace_back(Position{row, 0}, std::to_string(row));
+        for (int col = 1; col <= COLS; ++col) {
+            std::string text = row == 0
+                ? "=A1+" + std::to_string(col)
+                : "=" + Position{row - 1, col}.ToString() + "+" + Position{row - 1, col - 1}.ToString() + "/2";
+            cells.emplace_back(Position{row, col}, std::move(text));
+        }
+    }
+
+    auto sequential = CreateSheet();
+    auto parallel = CreateSheet();
+    parallel->SetRecalculationThreads(4);
+    sequential->SetCells(cells);
+    parallel->SetCells(std::move(cells));
+
+    for (const char* input : {"1", "-3.5", "x"}) {
+        sequential->SetCell("A1"_pos, input);
+        parallel->SetCell("A1"_pos, input);
+        sequential->ResetStats();
+        parallel->ResetStats();
+        sequential->Recalculate();
+        parallel->Recalculate();
+#ifndef SPREADSHEET_NO_STATS
+        // Чтения из кеша, накопленные в потоках, доходят до счётчика
+        ASSERT(sequential->GetStats().cache_hits > 0);
+        ASSERT_EQUAL(parallel->GetStats().cache_hits, sequential->GetStats().cache_hits);
+#endif
+
+        for (int row = 0; row < ROWS; ++row) {
+            for (int col = 1; col <= COLS; ++col) {
+                ASSERT_EQUAL(parallel->GetCell({row, col})->GetValue(), sequential->GetCell({row, col})->GetValue());
+            }
+        }
+    }
+}
+
+void TestSnapshot() {
+    const auto dir = std::filesystem::temp_directory_path();
+    const std::string path = (dir / "spreadsheet_test.snapshot").string();
+    const std::string broken_path = (dir / "spreadsheet_test_broken.snapshot").string();
+
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1.5");
+    sheet->SetCell("A2"_pos, "'=escaped");
+    sheet->SetCell("A3"_pos, "text");
+    sheet->SetCell("B1"_pos, "=A1*1.23456789");
+    sheet->SetCell("B2"_pos, "=A2*1.23456789");
+    sheet->SetCell("B3"_pos, "=1/0");
+    // E5 и E6 пустые, но на них ссылаются
+    sheet->SetCell("C1"_pos, "=SUM(A1:B1)+E5");
+    sheet->SetCell("C2"_pos, "=SUM(A2:B2)+E6");
+    for (int row = 0; row < 20; ++row) {
+        sheet->SetCell({row, 3}, "=A" + std::to_string(row + 1) + "*2");
+    }
+    // Часть формул вычислена до сохранения, часть нет
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(1.5 + 1.5 * 1.23456789));
+    ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+
+    sheet->SaveSnapshot(path);
+    auto loaded = LoadSnapshot(path);
+
+    auto print = [](const SheetInterface& sheet, bool values) {
+        std::ostringstream out;
+        values ? sheet.PrintValues(out) : sheet.PrintTexts(out);
+        return out.str();
+    };
+    ASSERT_EQUAL(print(*loaded, false), print(*sheet, false));
+    ASSERT_EQUAL(print(*loaded, true), print(*sheet, true));
+    ASSERT(loaded->GetPrintableSize() == sheet->GetPrintableSize());
+    for (Position pos : {"A2"_pos, "C1"_pos, "C2"_pos, "D20"_pos, "E5"_pos}) {
+        ASSERT_EQUAL(loaded->GetCell(pos)->GetText(), sheet->GetCell(pos)->GetText());
+        ASSERT_EQUAL(loaded->GetCell(pos)->GetReferencedCells(), sheet->GetCell(pos)->GetReferencedCells());
+    }
+    // Числа формул сохраняются точно, а не в печатном виде
+    ASSERT_EQUAL(loaded->GetCell("B1"_pos)->GetValue(), CellInterface::Value(1.5 * 1.23456789));
+
+    // Правки распространяются по восстановленным зависимостям
+    loaded->SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(loaded->GetCell("C1"_pos)->GetValue(), CellInterface::Value(2 + 2 * 1.23456789));
+    ASSERT_EQUAL(loaded->GetCell("D1"_pos)->GetValue(), CellInterface::Value(4.0));
+    loaded->SetCell("E5"_pos, "10");
+    ASSERT_EQUAL(loaded->GetCell("C1"_pos)->GetValue(), CellInterface::Value(12 + 2 * 1.23456789));
+    loaded->SetCell("B2"_pos, "7");
+    ASSERT_EQUAL(loaded->GetCell("C2"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+    loaded->SetCell("A2"_pos, "1");
+    ASSERT_EQUAL(loaded->GetCell("C2"_pos)->GetValue(), CellInterface::Value(8.0));
+
+    // Загруженные выражения разделяются с новыми формулами той же формы
+    const size_t templates = loaded->GetStats().formula_templates;
+    ASSERT(templates > 0u);
+    loaded->SetCell("D21"_pos, "=A21*2");
+    loaded->SetCell("B4"_pos, "=A4*1.23456789");
+    ASSERT_EQUAL(loaded->GetStats().formula_templates, templates);
+
+    try {
+        loaded->SetCell("A1"_pos, "=C1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    try {
+        loaded->SetCell("E6"_pos, "=C2");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "1.5");
+
+    // Отсутствующий, обрезанный и чужой файлы
+    auto expect_failure = [](const std::string& path) {
+        try {
+            LoadSnapshot(path);
+            ASSERT(false);
+        } catch (const SnapshotException&) {
+        }
+    };
+    std::filesystem::remove(broken_path);
+    expect_failure(broken_path);
+
+    std::string bytes;
+    {
+        std::ifstream in(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    auto write_broken = [&broken_path](const std::string& data) {
+        std::ofstream out(broken_path, std::ios::binary | std::ios::trunc);
+        out << data;
+    };
+    write_broken(bytes.substr(0, bytes.size() - 1));
+    expect_failure(broken_path);
+    write_broken(bytes.substr(0, 10));
+    expect_failure(broken_path);
+    write_broken("A1;B1;C1\n" + bytes);
+    expect_failure(broken_path);
+
+    // Правильно устроенный файл с испорченными рангами: формулы перестают
+    // стоять после своих ссылок. Ранг - третье поле записи ячейки, записи
+    // (по 56 байт) идут сразу за 64-байтным заголовком
+    {
+        std::uint64_t cell_count;
+        std::memcpy(&cell_count, bytes.data() + 16, sizeof(cell_count));
+        std::string damaged = bytes;
+        for (std::uint64_t i = 0; i < cell_count; ++i) {
+            std::memset(damaged.data() + 64 + i * 56 + 8, 0, sizeof(std::int64_t));
+        }
+        write_broken(damaged);
+        expect_failure(broken_path);
+    }
+
+    std::filesystem::remove(path);
+    std::filesystem::remove(broken_path);
+}
+
+void TestDurableSheet() {
+    const auto dir = std::filesystem::temp_directory_path() / "spreadsheet_test_journal";
+    std::filesystem::remove_all(dir);
+
+    DurableSheet::Options options;
+    options.segment_bytes = 256;  // по нескольку правок на сегмент
+
+    // Номера файлов вида <prefix><N> по возрастанию
+    auto list_files = [&dir](const std::string& prefix) {
+        std::vector<std::uint64_t> seqs;
+        for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+            const std::string name = entry.path().filename().string();
+            if (name.rfind(prefix, 0) == 0 && name.find('.') == std::string::npos) {
+                seqs.push_back(std::stoull(name.substr(prefix.size())));
+            }
+        }
+        std::sort(seqs.begin(), seqs.end());
+        return seqs;
+    };
+
+    {
+        auto sheet = DurableSheet::Open(dir.string(), options);
+        ASSERT_EQUAL(sheet->GetReplayedCount(), 0u);
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("B1"_pos, "=A1+1");
+        // Неудачные правки в журнал не попадают
+        try {
+            sheet->SetCell("A1"_pos, "=B1");
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        sheet->SetCells({{"A2"_pos, "text"}, {"B2"_pos, "=A1*10"}});
+        sheet->ClearCell("A2"_pos);
+        // Повтор этих правок поверх итогового состояния привёл бы к циклу,
+        // поэтому журнал не должен применяться к снимку, который их уже содержит
+        sheet->SetCell("C1"_pos, "=A1");
+        sheet->SetCell("C1"_pos, "1");
+        sheet->SetCell("A1"_pos, "=C1+5");
+        sheet->Sync();
+    }
+
+    {
+        auto sheet = DurableSheet::Open(dir.string(), options);
+        ASSERT_EQUAL(sheet->GetReplayedCount(), 8u);
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(7.0));
+        ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(60.0));
+        ASSERT(sheet->GetCell("A2"_pos) == nullptr || sheet->GetCell("A2"_pos)->GetText().empty());
+
+        for (int row = 0; row < 50; ++row) {
+            sheet->SetCell({row, 5}, std::to_string(row));
+        }
+        sheet->Compact();
+        // Остаются новый снимок, предыдущий и сегменты после предыдущего
+        const auto snapshots = list_files("snapshot-");
+        const auto segments = list_files("wal-");
+        ASSERT_EQUAL(snapshots.size(), 2u);
+        ASSERT_EQUAL(segments.front(), snapshots.front() + 1);
+        ASSERT_EQUAL(segments.back(), snapshots.back() + 1);
+        ASSERT_EQUAL(segments.size(), segments.back() - segments.front() + 1);
+        sheet->SetCell("A1"_pos, "2");
+    }
+
+    {
+        auto sheet = DurableSheet::Open(dir.string(), options);
+        ASSERT_EQUAL(sheet->GetReplayedCount(), 1u);
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(3.0));
+        ASSERT_EQUAL(sheet->GetCell("F50"_pos)->GetText(), "49");
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetText(), "1");
+    }
+
+    // Запись, оборванная сбоем, отбрасывается
+    const std::uint64_t last_segment = list_files("wal-").back();
+    {
+        std::ofstream out(dir / ("wal-" + std::to_string(last_segment)), std::ios::binary | std::ios::app);
+        out.write("\x20\0\0\0\1\2", 6);
+    }
+    {
+        auto sheet = DurableSheet::Open(dir.string(), options);
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "2");
+        sheet->SetCell("A3"_pos, "after");
+    }
+    {
+        auto sheet = DurableSheet::Open(dir.string(), options);
+        ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetText(), "after");
+        ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(20.0));
+        sheet->Compact();
+        sheet->SetCell("A4"_pos, "compacted");
+        sheet->Compact();
+    }
+
+    // Повреждённый последний снимок заменяется предыдущим и сегментами после него
+    {
+        const auto snapshot = dir / ("snapshot-" + std::to_string(list_files("snapshot-").back()));
+        std::filesystem::resize_file(snapshot, std::filesystem::file_size(snapshot) / 2);
+    }
+    {
+        auto sheet = DurableSheet::Open(dir.string(), options);
+        ASSERT_EQUAL(sheet->GetReplayedCount(), 1u);
+        ASSERT_EQUAL(sheet->GetCell("A4"_pos)->GetText(), "compacted");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "2");
+        ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetText(), "after");
+        ASSERT_EQUAL(sheet->GetCell("F50"_pos)->GetText(), "49");
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(3.0));
+    }
+
+    // Пакет восстанавливается целиком: по отдельности его правки образуют
+    // временный цикл или содержат перезаписанную в пакете некорректную формулу
+    const auto batch_dir = dir / "batch";
+    {
+        auto sheet = DurableSheet::Open(batch_dir.string(), options);
+        sheet->SetCell("B1"_pos, "=A1");
+        sheet->SetCells({{"A1"_pos, "=B1"}, {"B1"_pos, "1"}});
+        sheet->SetCells({{"A2"_pos, "=("}, {"A2"_pos, "2"}});
+        // Импорт, поле которого ссылается на поле дальше в таблице
+        sheet->SetCell("C3"_pos, "=A3");
+        std::istringstream tsv("=C3\t\t5\n");
+        sheet->ImportTable(tsv, TableFormat::Tsv, "A3"_pos);
+        sheet->Sync();
+    }
+    {
+        auto sheet = DurableSheet::Open(batch_dir.string(), options);
+        ASSERT_EQUAL(sheet->GetReplayedCount(), 8u);
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(1.0));
+        ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetText(), "2");
+        ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(), CellInterface::Value(5.0));
+    }
+
+    std::filesystem::remove_all(dir);
+}
+
+void TestImportTable() {
+    auto source = CreateSheet();
+    source->SetCell("A1"_pos, "name");
+    source->SetCell("B1"_pos, "'=escaped");
+    source->SetCell("A2"_pos, "1.5");
+    source->SetCell("B2"_pos, "=A2*2");
+    source->SetCell("D3"_pos, "=SUM(A2:B2)");
+    std::ostringstream texts;
+    source->PrintTexts(texts);
+
+    // PrintTexts и ImportTable обратны друг другу
+    auto sheet = CreateSheet();
+    std::istringstream tsv(texts.str());
+    sheet->ImportTable(tsv, TableFormat::Tsv, {0, 0});
+    std::ostringstream imported_texts;
+    sheet->PrintTexts(imported_texts);
+    ASSERT_EQUAL(imported_texts.str(), texts.str());
+    ASSERT_EQUAL(sheet->GetCell("D3"_pos)->GetValue(), CellInterface::Value(4.5));
+
+    // Кавычки CSV, переводы строк \r\n и сдвиг начала таблицы
+    const std::string csv = "a,\"b,c\",\"say \"\"hi\"\"\",,=B2*2\r\n"
+                            "1,2\n"
+                            "\"multi\nline\"x,\"unterminated";
+    std::istringstream csv_input(csv);
+    sheet->ImportTable(csv_input, TableFormat::Csv, "B2"_pos);
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetText(), "a");
+    ASSERT_EQUAL(sheet->GetCell("C2"_pos)->GetText(), "b,c");
+    ASSERT_EQUAL(sheet->GetCell("D2"_pos)->GetText(), "say \"hi\"");
+    ASSERT(sheet->GetCell("E2"_pos) == nullptr);
+    ASSERT_EQUAL(sheet->GetCell("F2"_pos)->GetText(), "=B2*2");
+    ASSERT_EQUAL(sheet->GetCell("F2"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+    ASSERT_EQUAL(sheet->GetCell("C3"_pos)->GetText(), "2");
+    ASSERT_EQUAL(sheet->GetCell("B4"_pos)->GetText(), "multi\nlinex");
+    ASSERT_EQUAL(sheet->GetCell("C4"_pos)->GetText(), "unterminated");
+    // Существующие ячейки перезаписываются, остальные не меняются
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "name");
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(std::string("a")));
+    ASSERT_EQUAL(sheet->GetCell("D3"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+
+    // Поля, разорванные границей блока чтения, собираются так же
+    auto read_all = [&csv](size_t chunk_size) {
+        std::istringstream input(csv);
+        TableReader reader(input, TableFormat::Csv, chunk_size);
+        std::vector<std::string> fields;
+        TableReader::Field field;
+        while (reader.Next(field)) {
+            fields.push_back(std::to_string(field.row) + ":" + std::to_string(field.col) + ":" + std::string(field.text));
+        }
+        return fields;
+    };
+    const auto expected = read_all(TableReader::DEFAULT_CHUNK_SIZE);
+    ASSERT_EQUAL(expected.size(), 8u);
+    for (size_t chunk_size = 1; chunk_size < 12; ++chunk_size) {
+        ASSERT_EQUAL(read_all(chunk_size), expected);
+    }
+
+    // Загрузка атомарна
+    auto expect_unchanged = [&sheet](const std::string& table, Position origin, auto exception) {
+        std::ostringstream before;
+        sheet->PrintTexts(before);
+        std::istringstream input(table);
+        try {
+            sheet->ImportTable(input, TableFormat::Tsv, origin);
+            ASSERT(false);
+        } catch (const decltype(exception)&) {
+        }
+        std::ostringstream after;
+        sheet->PrintTexts(after);
+        ASSERT_EQUAL(after.str(), before.str());
+    };
+    expect_unchanged("x\t=1+\n", {0, 0}, FormulaException(""));
+    expect_unchanged("=B1\t=A1\n", {0, 0}, CircularDependencyException(""));
+    expect_unchanged("x\ty\n", {0, Position::MAX_COLS - 1}, InvalidPositionException(""));
+}
+
+void TestSheetStats() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("B1"_pos, "=A1+1");
+    sheet->SetCell("C1"_pos, "=B1*2");
+    sheet->SetCell("D1"_pos, "=Z9");
+    sheet->SetCell("E1"_pos, "long text that does not fit into a short string");
+
+    // Память по видам ячеек считается и без счётчиков
+    SheetStats stats = sheet->GetStats();
+    ASSERT_EQUAL(stats.text.cells, 2u);
+    ASSERT_EQUAL(stats.formula.cells, 3u);
+    ASSERT_EQUAL(stats.empty.cells, 1u); // Z9
+    ASSERT_EQUAL(stats.formula_templates, 3u);
+    ASSERT(stats.text.bytes > std::string("long text that does not fit into a short string").size());
+    ASSERT(stats.formula.bytes > 0 && stats.empty.bytes > 0);
+    // Шесть ячеек занимают два тайла: свободные слоты весят больше самих ячеек
+    const size_t overhead = stats.storage_overhead_bytes;
+    ASSERT(overhead > stats.empty.bytes + stats.text.bytes + stats.formula.bytes);
+    // Ячейка в новом тайле добавляет тайл целиком
+    sheet->SetCell("ZZ999"_pos, "x");
+    const SheetStats far_cell = sheet->GetStats();
+    const size_t cell_bytes = far_cell.text.bytes - stats.text.bytes;
+    ASSERT(far_cell.storage_overhead_bytes - overhead >= (16 * 16 - 1) * cell_bytes);
+    sheet->ClearCell("ZZ999"_pos);
+    ASSERT_EQUAL(sheet->GetStats().storage_overhead_bytes, overhead);
+
+#ifndef SPREADSHEET_NO_STATS
+    ASSERT_EQUAL(stats.formulas_parsed, 3u);
+    // От новых формул ничего не зависит, обход при проверке на циклы не нужен
+    ASSERT_EQUAL(stats.cycle_check_visits, 0u);
+    ASSERT_EQUAL(stats.evaluations, 0u);
+
+    sheet->ResetStats();
+    // C1 вычисляется вместе с B1, значение B1 берётся из кеша
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(4.0));
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(4.0));
+    stats = sheet->GetStats();
+    ASSERT_EQUAL(stats.cache_misses, 1u);
+    ASSERT_EQUAL(stats.cache_hits, 2u);
+    ASSERT_EQUAL(stats.evaluations, 2u);
+    ASSERT(stats.evaluation_ns > 0);
+    ASSERT_EQUAL(stats.formulas_parsed, 0u);
+
+    sheet->ResetStats();
+    sheet->SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet->GetStats().invalidation_visits, sheet->GetLastInvalidationCount());
+    ASSERT_EQUAL(sheet->GetStats().invalidation_visits, 3u);
+    sheet->Recalculate();
+    ASSERT_EQUAL(sheet->GetStats().evaluations, 3u); // B1, C1 и D1
+
+    // От A1 зависит B1. Проверка проходит D1 (ранг больше, чем у A1), но не
+    // Z9: пустая ячейка стоит в начале топологического порядка
+    sheet->ResetStats();
+    sheet->SetCell("A1"_pos, "=D1");
+    ASSERT_EQUAL(sheet->GetStats().cycle_check_visits, 1u);
+
+    // Пакетная проверка циклов тоже учитывается, в том числе при ошибке
+    sheet->ResetStats();
+    try {
+        sheet->SetCells({{"F1"_pos, "=G1"}, {"G1"_pos, "=F1"}});
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    stats = sheet->GetStats();
+    ASSERT_EQUAL(stats.formulas_parsed, 2u);
+    ASSERT(stats.cycle_check_visits >= 2u);
+    ASSERT(stats.parse_ns > 0);
+#endif
+}
+
+void TestTracing() {
+    auto sheet = CreateSheet();
+    auto trace = [&sheet] {
+        std::ostringstream output;
+        sheet->WriteTrace(output);
+        return output.str();
+    };
+    auto count = [](const std::string& text, const std::string& pattern) {
+        size_t result = 0;
+        for (size_t pos = text.find(pattern); pos != std::string::npos; pos = text.find(pattern, pos + 1)) {
+            ++result;
+        }
+        return result;
+    };
+
+    ASSERT_EQUAL(count(trace(), "\"ph\":\"X\""), 0u);
+
+    sheet->SetCell("A1"_pos, "1");
+    sheet->StartTracing(1024);
+    sheet->SetCell("B1"_pos, "=A1+1");
+    sheet->SetCells({{"C1"_pos, "=B1*2"}, {"D1"_pos, "=C1"}});
+    sheet->GetCell("C1"_pos)->GetValue();
+    sheet->Recalculate();
+    sheet->StopTracing();
+    sheet->SetCell("A1"_pos, "2");
+
+    const std::string events = trace();
+    ASSERT(events.rfind("{\"traceEvents\":[", 0) == 0);
+    ASSERT_EQUAL(count(events, "\"name\":\"set_cell\",\"cat\":\"spreadsheet\",\"ph\":\"X\""), 1u);
+    ASSERT_EQUAL(count(events, "\"name\":\"parse\""), 3u);
+    // Одна проверка для B1 и одна для пакета
+    ASSERT_EQUAL(count(events, "\"name\":\"cycle_check\""), 2u);
+    ASSERT_EQUAL(count(events, "\"name\":\"invalidate\""), 2u);
+    // C1 вычисляется по запросу вместе с B1, D1 - при пересчёте
+    ASSERT_EQUAL(count(events, "\"name\":\"evaluate_upstream\""), 1u);
+    ASSERT_EQUAL(count(events, "\"name\":\"evaluate\""), 3u);
+    ASSERT(events.find("\"args\":{\"cell\":\"D1\"}") != std::string::npos);
+    ASSERT(events.find("\"name\":\"recalculate\"") != std::string::npos);
+    ASSERT(events.find("\"formulas\":1}") != std::string::npos);
+    ASSERT(events.find("\"dropped_events\":0") != std::string::npos);
+    // Правка после остановки не записана
+    ASSERT_EQUAL(count(events, "\"ph\":\"X\""), 13u);
+
+    // Переполненный буфер хранит последние события
+    sheet->StartTracing(4);
+    for (int i = 0; i < 10; ++i) {
+        sheet->SetCell("A1"_pos, std::to_string(i));
+    }
+    const std::string last = trace();
+    ASSERT_EQUAL(count(last, "\"ph\":\"X\""), 4u);
+    ASSERT(last.find("\"dropped_events\":16") != std::string::npos);
+
+    // Несколько потоков многократно переполняют маленький буфер, пока он
+    // выводится. Выведенные события целы, а вместе с потерянными дают все
+    // записанные (под ThreadSanitizer проверяет и отсутствие гонок)
+    Tracer tracer(16);
+    constexpr int THREADS = 4;
+    constexpr int EVENTS_PER_THREAD = 20000;
+    std::atomic<int> running{THREADS};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; ++t) {
+        threads.emplace_back([&tracer, &running, t] {
+            for (int i = 0; i < EVENTS_PER_THREAD; ++i) {
+                tracer.Record(Tracer::Kind::CycleCheck, {t, i % 100}, 1000 * i, 1000 * i + 1000, t);
+            }
+            --running;
+        });
+    }
+    auto check = [&count](const std::string& text) {
+        const size_t events = count(text, "\"ph\":\"X\"");
+        ASSERT(events <= 16u);
+        ASSERT_EQUAL(count(text, "\"dur\":1.000,"), events);
+    };
+    while (running > 0) {
+        std::ostringstream output;
+        tracer.Write(output);
+        check(output.str());
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    std::ostringstream output;
+    tracer.Write(output);
+    const std::string stressed = output.str();
+    check(stressed);
+    const size_t dropped_at = stressed.find("\"dropped_events\":") + 17;
+    ASSERT_EQUAL(count(stressed, "\"ph\":\"X\"") + std::stoull(stressed.substr(dropped_at)),
+                 static_cast<size_t>(THREADS * EVENTS_PER_THREAD));
+}
+
+void TestFormulaParserTree() {
+    auto tree = [](const std::string& expr) {
+        std::ostringstream out;
+        ParseFormulaAST(expr).Print(out);
+        return out.str();
+    };
+
+    ASSERT_EQUAL(tree("1-2-3"), "(- (- 1 2) 3)");
+    ASSERT_EQUAL(tree("1+2*3"), "(+ 1 (* 2 3))");
+    ASSERT_EQUAL(tree("-1*2"), "(* (- 1) 2)");
+    ASSERT_EQUAL(tree("2*-A1"), "(* 2 (- A1))");
+    ASSERT_EQUAL(tree("-+-(B2)"), "(- (+ (- B2)))");
+    ASSERT_EQUAL(tree("\t.5e1 /\r\n2E-1"), "(/ 5 0.2)");
+
+    auto isIncorrect = [](std::string expression) {
+        try {
+            ParseFormula(std::move(expression));
+        } catch (const FormulaException&) {
+            return true;
+        }
+        return false;
+    };
+
+    ASSERT(isIncorrect(""));
+    ASSERT(isIncorrect("1."));
+    ASSERT(isIncorrect("1e"));
+    ASSERT(isIncorrect("1 2"));
+    ASSERT(isIncorrect("a1"));
+    ASSERT(isIncorrect("A"));
+    ASSERT(isIncorrect("()"));
+    ASSERT(isIncorrect("1+(2"));
+    ASSERT(isIncorrect("1)"));
+}
+
+#ifdef SPREADSHEET_WITH_ANTLR
+// Рукописный парсер должен строить те же деревья, что и парсер ANTLR
+void TestFormulaParsersAgree() {
+    auto parse = [](FormulaParserKind kind, const std::string& expr) -> std::string {
+        SetFormulaParser(kind);
+        try {
+            auto ast = ParseFormulaAST(expr);
+            std::ostringstream out;
+            ast.Print(out);
+            out << " | ";
+            ast.PrintFormula(out);
+            out << " | ";
+            ast.PrintCells(out);
+            return out.str();
+        } catch (const std::exception&) {
+            return "error";
+        }
+    };
+
+    const std::vector<std::string> formulas = {
+        "1", "42", "  -1  ", "2 + 2*2", "4/2 + 6/3", "(2+3)*4 + (3-4)*5",
+        "(12+13) * (14+(13-24/(1+1))*55-46)", "A1+A2+A1+A3", "-A1*B2/C3-D4",
+        "--1", "+-+1", "1-(2-3)", "1/(2*3)", "-(A1+B1)", "1e5", "1E+5", ".5",
+        "0.25e-3", "1e400", "1e-400", "XFD16384", "ZZZ1", "A1B2", "3X", "A0++",
+        "((1)", "2+4-", "1.", "1e", "", "()", "1 2", "1..2", "A 1", "a1", "#",
+        "SUM(A1:B2)", "MAX(B2:A1, 1+2)*2", "-MIN(A1,B1:C3,(2))", "AVERAGE(A1+1,A1:A1)",
+        "SUM(A1:B2+1)", "A1:B2", "SUM()", "SUM(1,)", "SUMA(1)", "SUM1+1", "Sum(1)",
+        "AVERAGE(-B1:C1)", "MAX(A1:B)", "SUM(MIN(A1:A3),MAX(B1:B3))",
+    };
+
+    for (const auto& formula : formulas) {
+        ASSERT_EQUAL(parse(FormulaParserKind::Pratt, formula), parse(FormulaParserKind::Antlr, formula));
+    }
+
+    SetFormulaParser(FormulaParserKind::Pratt);
+}
+#endif
+
 void TestCellCircularReferences() {
     auto sheet = CreateSheet();
     sheet->SetCell("E2"_pos, "=E4");
@@ -347,6 +1410,71 @@ void TestCellCircularReferences() {
     ASSERT(caught);
     ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
 }
+
+// Проверка на циклы, ограниченная рангами, против полного обхода по модели листа
+void TestCircularReferencesRandom() {
+    constexpr int SIZE = 6;
+    auto sheet = CreateSheet();
+    std::map<Position, std::vector<Position>> references; // Модель: ссылки формул
+    std::mt19937 rng(11);
+
+    auto random_pos = [&rng] {
+        return Position{static_cast<int>(rng() % SIZE), static_cast<int>(rng() % SIZE)};
+    };
+    auto reaches = [&references](std::vector<Position> stack, Position target) {
+        std::set<Position> visits;
+        while (!stack.empty()) {
+            Position pos = stack.back();
+            stack.pop_back();
+            if (pos == target) {
+                return true;
+            }
+            if (visits.insert(pos).second && references.count(pos) > 0) {
+                stack.insert(stack.end(), references[pos].begin(), references[pos].end());
+            }
+        }
+        return false;
+    };
+
+    for (int step = 0; step < 3000; ++step) {
+        Position pos = random_pos();
+        if (rng() % 5 == 0) {
+            sheet->ClearCell(pos);
+            references.erase(pos);
+            continue;
+        }
+
+        std::string text;
+        std::vector<Position> refs;
+        if (rng() % 2 == 0) {
+            Position a = random_pos();
+            Position b = random_pos();
+            text = "=" + a.ToString() + "+" + b.ToString();
+            refs = {a, b};
+        } else {
+            Position a = random_pos();
+            Position b{a.row + static_cast<int>(rng() % 2), a.col + static_cast<int>(rng() % 2)};
+            text = "=SUM(" + a.ToString() + ":" + b.ToString() + ")";
+            for (int row = a.row; row <= b.row; ++row) {
+                for (int col = a.col; col <= b.col; ++col) {
+                    refs.push_back({row, col});
+                }
+            }
+        }
+
+        const bool expected = reaches(refs, pos);
+        bool caught = false;
+        try {
+            sheet->SetCell(pos, text);
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT_EQUAL(caught, expected);
+        if (!caught) {
+            references[pos] = refs;
+        }
+    }
+}
 }  // namespace
 
 int main() {
@@ -369,7 +1497,30 @@ int main() {
     RUN_TEST(tr, TestEmptyCellTreatedAsZero);
     RUN_TEST(tr, TestFormulaInvalidPosition);
     RUN_TEST(tr, TestPrint);
+    RUN_TEST(tr, TestPrintSparse);
+    RUN_TEST(tr, TestPrintableSizeTracking);
+    RUN_TEST(tr, TestFarApartCells);
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestCircularReferencesRandom);
+    RUN_TEST(tr, TestFormulaParserTree);
+    RUN_TEST(tr, TestSetCells);
+    RUN_TEST(tr, TestRecalculateOrder);
+    RUN_TEST(tr, TestLongChain);
+    RUN_TEST(tr, TestTextNumericValue);
+    RUN_TEST(tr, TestValueView);
+    RUN_TEST(tr, TestAggregateFunctions);
+    RUN_TEST(tr, TestRangeDependencies);
+    RUN_TEST(tr, TestFormulaTemplates);
+    RUN_TEST(tr, TestInvalidationPruning);
+    RUN_TEST(tr, TestParallelRecalculate);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestDurableSheet);
+    RUN_TEST(tr, TestImportTable);
+    RUN_TEST(tr, TestSheetStats);
+    RUN_TEST(tr, TestTracing);
+#ifdef SPREADSHEET_WITH_ANTLR
+    RUN_TEST(tr, TestFormulaParsersAgree);
+#endif
 }
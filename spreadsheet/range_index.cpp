@@ -0,0 +1,80 @@
+#include "range_index.h"
+
+#include <algorithm>
+#include <cassert>
+
+RangeIndex::RangeIndex() = default;
+
+RangeIndex::~RangeIndex() = default;
+
+void RangeIndex::Add(Range range, Position formula) {
+    assert(range.IsValid());
+
+    if (col_nodes_.empty()) {
+        col_nodes_.resize(2 * LEAVES);
+    }
+
+    ForEachNode(range.from.col, range.to.col, [this, range, formula](int col_node) {
+        auto& row_tree = col_nodes_[col_node];
+        if (!row_tree) {
+            row_tree = std::make_unique<RowTree>();
+        }
+
+        ForEachNode(range.from.row, range.to.row, [&row_tree, formula](int row_node) {
+            (*row_tree)[row_node].push_back(formula);
+        });
+    });
+
+    ++size_;
+}
+
+void RangeIndex::Remove(Range range, Position formula) {
+    assert(!Empty());
+
+    ForEachNode(range.from.col, range.to.col, [this, range, formula](int col_node) {
+        auto& row_tree = col_nodes_[col_node];
+        assert(row_tree);
+
+        ForEachNode(range.from.row, range.to.row, [&row_tree, formula](int row_node) {
+            auto it = row_tree->find(row_node);
+            assert(it != row_tree->end());
+
+            auto& formulas = it->second;
+            auto pos = std::find(formulas.begin(), formulas.end(), formula);
+            assert(pos != formulas.end());
+            *pos = formulas.back();
+            formulas.pop_back();
+
+            if (formulas.empty()) {
+                row_tree->erase(it);
+            }
+        });
+
+        if (row_tree->empty()) {
+            row_tree.reset();
+        }
+    });
+
+    --size_;
+}
+
+bool RangeIndex::Contains(Position pos) const {
+    if (Empty()) {
+        return false;
+    }
+
+    // Опустевшие узлы удаляются, поэтому любой найденный узел непуст
+    for (int col_node = pos.col + LEAVES; col_node >= 1; col_node >>= 1) {
+        const auto& row_tree = col_nodes_[col_node];
+        if (!row_tree) {
+            continue;
+        }
+
+        for (int row_node = pos.row + LEAVES; row_node >= 1; row_node >>= 1) {
+            if (row_tree->count(row_node) != 0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
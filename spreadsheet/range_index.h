@@ -0,0 +1,78 @@
+#pragma once
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+
+// Пространственный индекс зависимостей от диапазонов: по позиции находит
+// формулы, диапазоны которых её содержат. Диапазон хранится один раз, а не в
+// каждой своей ячейке.
+// Устроен как двумерное дерево отрезков: дерево по столбцам, в узлах которого
+// деревья по строкам. Диапазон раскладывается на O(log C * log R) канонических
+// узлов, поиск проходит от листа к корню и просматривает O(log C * log R) узлов.
+class RangeIndex {
+public:
+    RangeIndex();
+    ~RangeIndex();
+
+    void Add(Range range, Position formula);
+    void Remove(Range range, Position formula);
+
+    bool Empty() const {
+        return size_ == 0;
+    }
+
+    // Есть ли диапазон, содержащий pos
+    bool Contains(Position pos) const;
+
+    // Вызывает func(Position) для формулы каждого диапазона, содержащего pos.
+    // Формула встретится столько раз, сколько её диапазонов содержат pos
+    template <typename Func>
+    void ForEachContaining(Position pos, Func&& func) const {
+        if (Empty()) {
+            return;
+        }
+
+        for (int col_node = pos.col + LEAVES; col_node >= 1; col_node >>= 1) {
+            const auto& row_tree = col_nodes_[col_node];
+            if (!row_tree) {
+                continue;
+            }
+
+            for (int row_node = pos.row + LEAVES; row_node >= 1; row_node >>= 1) {
+                auto it = row_tree->find(row_node);
+                if (it != row_tree->end()) {
+                    for (Position formula : it->second) {
+                        func(formula);
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    // Дерево хранится в массиве: листы [LEAVES; 2 * LEAVES), у узла i потомки 2i и 2i + 1
+    static constexpr int LEAVES = Position::MAX_ROWS;
+    static_assert(Position::MAX_ROWS == Position::MAX_COLS && (LEAVES & (LEAVES - 1)) == 0,
+                  "the index assumes a square sheet with a power of two side");
+
+    using RowTree = std::unordered_map<int, std::vector<Position>>;
+
+    // Вызывает func(node) для канонических узлов отрезка [from; to]
+    template <typename Func>
+    static void ForEachNode(int from, int to, Func&& func) {
+        for (int lo = from + LEAVES, hi = to + LEAVES + 1; lo < hi; lo >>= 1, hi >>= 1) {
+            if (lo & 1) {
+                func(lo++);
+            }
+            if (hi & 1) {
+                func(--hi);
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<RowTree>> col_nodes_; // Выделяется при первом добавлении
+    size_t size_ = 0;
+};
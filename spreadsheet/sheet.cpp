@@ -1,12 +1,15 @@
 #include "sheet.h"
 
 #include <algorithm>
+#include <cstdio>
 #include <iostream>
+#include <locale>
 #include <type_traits>
 #include <queue>
 
 #include "cell.h"
 #include "common.h"
+#include "table_reader.h"
 
 using namespace std::literals;
 
@@ -18,14 +21,202 @@ void Sheet::SetCell(Position pos, std::string text) {
         throw InvalidPositionException("Incorrect position");
     }
 
-    if (auto it = cells_.find(pos); it != cells_.end()) {
-        it->second.Set(std::move(text));
+    if (Cell* cell = cells_.Find(pos); cell != nullptr) {
+        cell->Set(std::move(text));
     } else {
-        auto& new_cell = cells_.insert({pos, Cell(*this, pos)}).first->second;
+        auto& new_cell = cells_.Emplace(pos, *this, pos);
         new_cell.Set(std::move(text));
     }
 }
 
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells) {
+    for (const auto& [pos, text] : cells) {
+        if (!pos.IsValid()) {
+            throw InvalidPositionException("Incorrect position");
+        }
+    }
+
+    // Для повторяющейся позиции действует последний текст
+    PositionMap<size_t> last_write;
+    for (size_t i = 0; i < cells.size(); ++i) {
+        last_write[cells[i].first] = i;
+    }
+
+    // Все тексты разбираются до изменения таблицы
+    std::vector<std::pair<Position, Cell::Content>> updates;
+    updates.reserve(last_write.size());
+    for (size_t i = 0; i < cells.size(); ++i) {
+        if (last_write.at(cells[i].first) == i) {
+            updates.emplace_back(cells[i].first, Cell::Parse(std::move(cells[i].second), *this, cells[i].first));
+        }
+    }
+
+    ApplyBatch(std::move(updates));
+}
+
+void Sheet::ImportTable(std::istream& input, TableFormat format, Position origin) {
+    if (!origin.IsValid()) {
+        throw InvalidPositionException("Incorrect position");
+    }
+
+    // Позиции полей не повторяются, поэтому поля разбираются сразу по мере чтения
+    std::vector<std::pair<Position, Cell::Content>> updates;
+    TableReader reader(input, format);
+    TableReader::Field field;
+    while (reader.Next(field)) {
+        Position pos{origin.row + field.row, origin.col + field.col};
+        if (!pos.IsValid()) {
+            throw InvalidPositionException("Incorrect position");
+        }
+        updates.emplace_back(pos, Cell::Parse(field.text, *this, pos));
+    }
+
+    ApplyBatch(std::move(updates));
+}
+
+void Sheet::ApplyBatch(std::vector<std::pair<Position, Cell::Content>> updates) {
+    // Формулы пакета по позициям. Остальные ячейки пакета отмечены nullptr:
+    // они ни на что не ссылаются, и цикл может пройти только через формулы
+    TiledStorage<Cell::Content*> batch;
+    std::vector<Position> formulas;
+    for (auto& [pos, content] : updates) {
+        batch.Emplace(pos, content.IsFormula() ? &content : nullptr);
+        if (content.IsFormula()) {
+            formulas.push_back(pos);
+        }
+    }
+
+    std::vector<Position> order;
+    if (!formulas.empty()) {
+        order = SortByDependencies(batch, formulas);
+    }
+
+    std::vector<Position> changed;
+    changed.reserve(updates.size());
+
+    // Значения записываются первыми и в любом порядке
+    for (auto& [pos, content] : updates) {
+        if (content.IsFormula()) {
+            continue;
+        }
+        Cell* cell = cells_.Find(pos);
+        if (cell == nullptr) {
+            cell = &cells_.Emplace(pos, *this, pos);
+        }
+        if (cell->Apply(std::move(content))) {
+            changed.push_back(pos);
+        }
+    }
+
+    // Ячейки формул создаются заранее, чтобы связывание зависимостей не создавало их пустыми
+    for (Position pos : formulas) {
+        if (cells_.Find(pos) == nullptr) {
+            cells_.Emplace(pos, *this, pos);
+        }
+    }
+
+    // Формулы применяются в топологическом порядке пакета: ссылки формулы
+    // записываются раньше неё, и поддержка порядка обходится без перестановок
+    for (Position pos : order) {
+        if (cells_.Find(pos)->Apply(std::move(**batch.Find(pos)))) {
+            changed.push_back(pos);
+        }
+    }
+
+    Cell::InvalidateCaches(*this, changed);
+}
+
+// Поиск цикла в графе, где для ячеек пакета ссылки берутся из нового содержимого.
+// Старый граф ацикличен, поэтому цикл обязан проходить через формулу пакета, и
+// достаточно одного обхода в глубину из них с общими отметками посещения.
+// Возвращает формулы пакета в порядке завершения обхода (ссылки раньше формул)
+// или бросает CircularDependencyException.
+std::vector<Position> Sheet::SortByDependencies(const TiledStorage<Cell::Content*>& batch,
+                                                const std::vector<Position>& formulas) const {
+    enum class Mark { InProgress, Done };
+
+    struct Frame {
+        Position pos;
+        std::vector<Position> references;
+        size_t next = 0;
+    };
+
+    // Диапазоны раскрываются только в существующие ячейки и ячейки пакета
+    // (которых может ещё не быть в таблице): остальные пусты и ни на что не ссылаются
+    auto references_of = [this, &batch](Position pos) {
+        ReferenceSpan<Position> singles;
+        ReferenceSpan<Range> ranges;
+        if (Cell::Content* const* content = batch.Find(pos); content != nullptr) {
+            if (*content != nullptr) {
+                singles = (*content)->GetSingleCellReferences();
+                ranges = (*content)->GetRangeReferences();
+            }
+        } else if (const Cell* cell = GetCell(pos); cell != nullptr) {
+            singles = cell->GetSingleCellReferences();
+            ranges = cell->GetRangeReferences();
+        }
+
+        std::vector<Position> references(singles.begin(), singles.end());
+
+        auto add = [&references](Position ref, const auto&) {
+            references.push_back(ref);
+        };
+        for (Range range : ranges) {
+            cells_.ForEachInRange(range.from, range.to, add);
+            batch.ForEachInRange(range.from, range.to, add);
+        }
+        return references;
+    };
+
+    TraceSpan span(tracer_, Tracer::Kind::CycleCheck);
+    TiledStorage<Mark> marks;
+    size_t visited = 0;
+    std::vector<Frame> stack;
+    std::vector<Position> order;
+    order.reserve(formulas.size());
+
+    for (Position start : formulas) {
+        if (marks.Find(start) != nullptr) {
+            continue;
+        }
+
+        marks.Emplace(start, Mark::InProgress);
+        ++visited;
+        stack.push_back({start, references_of(start)});
+
+        while (!stack.empty()) {
+            Frame& frame = stack.back();
+            if (frame.next == frame.references.size()) {
+                *marks.Find(frame.pos) = Mark::Done;
+                if (Cell::Content* const* content = batch.Find(frame.pos); content != nullptr && *content != nullptr) {
+                    order.push_back(frame.pos);
+                }
+                stack.pop_back();
+                continue;
+            }
+
+            Position ref = frame.references[frame.next++];
+            if (const Mark* mark = marks.Find(ref); mark != nullptr) {
+                if (*mark == Mark::InProgress) {
+                    stats_.cycle_check_visits.Add(visited);
+                    span.SetCount(visited);
+                    throw CircularDependencyException("Cycle detected");
+                }
+                continue;
+            }
+
+            marks.Emplace(ref, Mark::InProgress);
+            ++visited;
+            stack.push_back({ref, references_of(ref)});
+        }
+    }
+
+    stats_.cycle_check_visits.Add(visited);
+    span.SetCount(visited);
+
+    return order;
+}
+
 const Cell* Sheet::GetCell(Position pos) const {
     return const_cast<Sheet*>(this)->GetCell(pos);
 }
@@ -37,8 +228,7 @@ Cell* Sheet::GetCell(Position pos) {
         throw InvalidPositionException("Incorrect position");
     }
 
-    auto it = cells_.find(pos);
-    return it == cells_.end() ? nullptr : &it->second;
+    return cells_.Find(pos);
 }
 
 void Sheet::ClearCell(Position pos) {
@@ -46,73 +236,266 @@ void Sheet::ClearCell(Position pos) {
         throw InvalidPositionException("Incorrect position");
     }
 
-    // Ячейка полностью удаляется только в случа, если на нее никто не ссылается
-    if (auto cell = cells_.find(pos); cell != cells_.end()) {
-        if (!cell->second.IsReferenced()) {
-            cells_.erase(cell);
-        } else {
-            cell->second.Set("");
+    // Ячейка полностью удаляется только в случа, если на нее никто не ссылается.
+    // Очистка перед удалением отвязывает зависимости её формулы
+    if (Cell* cell = cells_.Find(pos); cell != nullptr) {
+        cell->Set("");
+        if (!cell->IsReferenced()) {
+            cells_.Erase(pos);
         }
     }
 }
 
 Size Sheet::GetPrintableSize() const {
-    if (cells_.empty()) {
+    if (row_occupancy_.empty()) {
         return {0, 0};
     }
 
-    int max_row = 0;
-    int max_col = 0;
+    return Size{row_occupancy_.rbegin()->first + 1, col_occupancy_.rbegin()->first + 1};
+}
+
+std::optional<FormulaError> Sheet::CollectRangeValues(Range range, std::vector<double>& values) const {
+    std::optional<FormulaError> error;
 
-    for (const auto& [pos, cell] : cells_) {
-        // В таблице не могут находиться пустые ячейки, на которые никто не ссылается
-        if (!cell.IsEmpty()) {
-            max_row = std::max(max_row, pos.row);
-            max_col = std::max(max_col, pos.col);
+    // Ячейки берутся прямо из тайлов, без поиска каждой позиции
+    cells_.ForEachInRange(range.from, range.to, [&values, &error](Position, const Cell& cell) {
+        if (error || cell.IsEmpty()) {
+            return;
         }
-    }
 
-    return Size{max_row + 1, max_col + 1};
-}
+        auto value = cell.GetNumericValue();
+        if (const double* number = std::get_if<double>(&value)) {
+            values.push_back(*number);
+        } else {
+            error = std::get<FormulaError>(value);
+        }
+    });
 
-void Sheet::PrintValues(std::ostream& output) const {
-    Size size = GetPrintableSize();
+    return error;
+}
 
-    auto printer = [&output](auto&& val) {
-        output << std::forward<decltype(val)>(val);
+void Sheet::UpdateOccupancy(Position pos, int delta) {
+    auto update = [delta](std::map<int, int>& occupancy, int key) {
+        auto it = occupancy.emplace(key, 0).first;
+        it->second += delta;
+        if (it->second == 0) {
+            occupancy.erase(it);
+        }
     };
 
-    for (int i = 0; i < size.rows; ++i) {
-        for (int j = 0; j < size.cols; ++j) {
-            if (j > 0) {
-                output << '\t';
-            }
+    update(row_occupancy_, pos.row);
+    update(col_occupancy_, pos.col);
+}
+
+namespace {
+
+// Накапливает вывод в буфере и передаёт его в поток крупными блоками
+class BufferedWriter {
+public:
+    explicit BufferedWriter(std::ostream& output)
+        : output_(output),
+          precision_(static_cast<int>(output.precision())),
+          // Числа форматируются самостоятельно, только если поток настроен по
+          // умолчанию, иначе форматирование остаётся за потоком
+          plain_numbers_((output.flags() & (std::ios::floatfield | std::ios::showpoint
+                                            | std::ios::showpos | std::ios::uppercase)) == 0
+                         && output.getloc() == std::locale::classic()) {
+        buffer_.reserve(CAPACITY);
+    }
 
-            const CellInterface* cell = GetCell(Position{i, j});
-            if (cell != nullptr) {
-                std::visit(printer, cell->GetValue());
+    ~BufferedWriter() {
+        Flush();
+    }
+
+    void Write(std::string_view text) {
+        if (buffer_.size() + text.size() > CAPACITY) {
+            Flush();
+        }
+        buffer_.append(text);
+    }
+
+    void Write(double value) {
+        if (!plain_numbers_) {
+            Flush();
+            output_ << value;
+            return;
+        }
+
+        // Тот же формат, что у operator<< для double
+        char number[64];
+        int length = std::snprintf(number, sizeof(number), "%.*g", precision_, value);
+        Write(std::string_view(number, static_cast<size_t>(length)));
+    }
+
+    void Write(FormulaError error) {
+        Write(error.ToString());
+    }
+
+    void WriteRun(char c, size_t count) {
+        while (count > 0) {
+            if (buffer_.size() == CAPACITY) {
+                Flush();
             }
+            size_t chunk = std::min(count, CAPACITY - buffer_.size());
+            buffer_.append(chunk, c);
+            count -= chunk;
+        }
+    }
+
+    void Flush() {
+        output_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+        buffer_.clear();
+    }
+
+private:
+    static constexpr size_t CAPACITY = 64 * 1024;
+
+    std::ostream& output_;
+    int precision_;
+    bool plain_numbers_;
+    std::string buffer_;
+};
+
+// Построчно обходит непустые ячейки в пределах size и печатает их через
+// print(const Cell&, BufferedWriter&), заполняя промежутки табуляциями.
+// Стоимость пропорциональна числу занятых ячеек, а не площади листа.
+template <typename Print>
+void PrintCells(const TiledStorage<Cell>& cells, Size size, std::ostream& output, Print print) {
+    BufferedWriter writer(output);
+    int row = 0;
+    int col = 0; // Столбец, перед которым уже выведены все табуляции строки
+
+    auto finish_row = [&] {
+        writer.WriteRun('\t', static_cast<size_t>(size.cols - 1 - col));
+        writer.Write("\n"sv);
+        ++row;
+        col = 0;
+    };
+
+    cells.ForEach([&](Position pos, const Cell& cell) {
+        if (cell.IsEmpty()) {
+            return;
+        }
+
+        while (row < pos.row) {
+            finish_row();
         }
-        output << '\n';
+        writer.WriteRun('\t', static_cast<size_t>(pos.col - col));
+        col = pos.col;
+
+        print(cell, writer);
+    });
+
+    while (row < size.rows) {
+        finish_row();
     }
 }
 
+} // namespace
+
+void Sheet::PrintValues(std::ostream& output) const {
+    PrintCells(cells_, GetPrintableSize(), output, [](const Cell& cell, BufferedWriter& writer) {
+        std::visit([&writer](auto value) {
+            writer.Write(value);
+        }, cell.GetValueView());
+    });
+}
+
 void Sheet::PrintTexts(std::ostream& output) const {
-    Size size = GetPrintableSize();
+    PrintCells(cells_, GetPrintableSize(), output, [](const Cell& cell, BufferedWriter& writer) {
+        // Текст выводится прямо из ячейки, строку собирает только формула
+        if (const auto* text = std::get_if<Cell::Text>(&cell.data_)) {
+            writer.Write(std::string_view(text->data));
+        } else {
+            writer.Write(cell.GetText());
+        }
+    });
+}
 
-    for (int i = 0; i < size.rows; ++i) {
-        for (int j = 0; j < size.cols; ++j) {
-            if (j > 0) {
-                output << '\t';
-            }
+void Sheet::MarkDirty(Position pos) {
+    dirty_.push_back(pos);
 
-            const CellInterface* cell = GetCell(Position{i, j});
-            if (cell != nullptr) {
-                output << cell->GetText();
-            }
+    // Ленивые вычисления не удаляют позиции из списка, поэтому он изредка
+    // очищается от уже вычисленных формул и повторов
+    if (dirty_.size() > 2 * cells_.Size() + 1024) {
+        std::sort(dirty_.begin(), dirty_.end());
+        dirty_.erase(std::unique(dirty_.begin(), dirty_.end()), dirty_.end());
+        dirty_.erase(std::remove_if(dirty_.begin(), dirty_.end(), [this](Position pos) {
+            const Cell* cell = cells_.Find(pos);
+            return cell == nullptr || !cell->IsDirty();
+        }), dirty_.end());
+    }
+}
+
+void Sheet::Recalculate() {
+    StatTimer timer(stats_.evaluation_ns);
+    TraceSpan span(tracer_, Tracer::Kind::Recalculate);
+    std::vector<const Cell*> pending;
+    pending.reserve(dirty_.size());
+    for (Position pos : dirty_) {
+        const Cell* cell = cells_.Find(pos);
+        if (cell != nullptr && cell->IsDirty()) {
+            pending.push_back(cell);
         }
-        output << '\n';
     }
+    dirty_.clear();
+    span.SetCount(pending.size());
+
+    // На малом числе формул запуск потоков обходится дороже самого вычисления
+    constexpr size_t MIN_PARALLEL_CELLS = 1024;
+    if (recalc_threads_ <= 1 || pending.size() < MIN_PARALLEL_CELLS) {
+        Cell::EvaluateInOrder(pending);
+        return;
+    }
+
+    if (pool_ == nullptr || pool_->GetThreadCount() != recalc_threads_) {
+        pool_ = std::make_unique<ThreadPool>(recalc_threads_);
+    }
+    Cell::EvaluateInLevels(pending, *pool_);
+}
+
+SheetStats Sheet::GetStats() const {
+    SheetStats stats;
+    stats_.CopyTo(stats);
+
+    cells_.ForEach([&stats](Position, const Cell& cell) {
+        SheetStats::Memory* memory = &stats.empty;
+        if (std::holds_alternative<Cell::Text>(cell.data_)) {
+            memory = &stats.text;
+        } else if (std::holds_alternative<Cell::Formula>(cell.data_)) {
+            memory = &stats.formula;
+        }
+        ++memory->cells;
+        memory->bytes += cell.GetMemoryUsage();
+    });
+    stats.formula_templates = formula_templates_.GetLiveCount();
+    stats.storage_overhead_bytes = cells_.GetMemoryUsage() - cells_.Size() * sizeof(Cell);
+    return stats;
+}
+
+void Sheet::ResetStats() {
+    stats_.Reset();
+}
+
+void Sheet::StartTracing(size_t capacity) {
+    trace_buffer_ = std::make_unique<Tracer>(capacity);
+    tracer_ = trace_buffer_.get();
+}
+
+void Sheet::StopTracing() {
+    tracer_ = nullptr;
+}
+
+void Sheet::WriteTrace(std::ostream& output) const {
+    if (trace_buffer_ != nullptr) {
+        trace_buffer_->Write(output);
+    } else {
+        Tracer(1).Write(output);
+    }
+}
+
+void Sheet::SetRecalculationThreads(size_t threads) {
+    recalc_threads_ = std::max<size_t>(threads, 1);
 }
 
 std::unique_ptr<SheetInterface> CreateSheet() {
@@ -1,13 +1,22 @@
 #pragma once
 
+#include <map>
+
 #include "cell.h"
 #include "common.h"
+#include "range_index.h"
+#include "stats.h"
+#include "storage.h"
+#include "thread_pool.h"
+#include "trace.h"
 
-class Sheet : public SheetInterface {
+class Sheet : public SheetInterface, public RangeSource {
 public:
     ~Sheet();
 
     void SetCell(Position pos, std::string text) override;
+    void SetCells(std::vector<std::pair<Position, std::string>> cells) override;
+    void ImportTable(std::istream& input, TableFormat format, Position origin) override;
 
     const Cell* GetCell(Position pos) const override;
     Cell* GetCell(Position pos) override;
@@ -16,10 +25,84 @@ public:
 
     Size GetPrintableSize() const override;
 
+    std::optional<FormulaError> CollectRangeValues(Range range, std::vector<double>& values) const override;
+
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
 
+    void Recalculate() override;
+    void SetRecalculationThreads(size_t threads) override;
+
+    size_t GetLastInvalidationCount() const override {
+        return last_invalidation_count_;
+    }
+
+    SheetStats GetStats() const override;
+    void ResetStats() override;
+
+    void StartTracing(size_t capacity) override;
+    void StopTracing() override;
+    void WriteTrace(std::ostream& output) const override;
+
+    // Бинарный снимок таблицы (snapshot.cpp)
+    void SaveSnapshot(const std::string& path) const override;
+    static std::unique_ptr<Sheet> LoadSnapshot(const std::string& path);
 
 private:
-    PositionMap<Cell> cells_;
+    friend class Cell;
+
+    // Записывает разобранное содержимое ячеек (позиции без повторов): проверяет
+    // циклы, применяет содержимое и сбрасывает кеши зависимых формул
+    void ApplyBatch(std::vector<std::pair<Position, Cell::Content>> updates);
+    std::vector<Position> SortByDependencies(const TiledStorage<Cell::Content*>& batch,
+                                             const std::vector<Position>& formulas) const;
+
+    // Новые ячейки ни на что не ссылаются и ставятся в начало топологического
+    // порядка, новые формулы без зависимых - в конец
+    std::int64_t NextSourceRank() {
+        return --min_rank_;
+    }
+
+    std::int64_t NextSinkRank() {
+        return ++max_rank_;
+    }
+
+    void MarkDirty(Position pos);
+
+    // Номер нового обхода графа ячеек (см. Cell::MarkVisited). Обходы не
+    // вкладываются друг в друга, поэтому одного счётчика достаточно
+    std::uint64_t NextVisitEpoch() {
+        return ++visit_epoch_;
+    }
+
+    // Учитывает появление (delta = 1) или исчезновение (delta = -1) непустой ячейки
+    void UpdateOccupancy(Position pos, int delta);
+
+    // Общие разобранные выражения формул одинаковой формы
+    FormulaTemplates formula_templates_;
+    TiledStorage<Cell> cells_;
+    // Формулы, ссылающиеся на диапазоны. Отдельные ссылки хранятся в самих
+    // ячейках (Cell::dependents_)
+    RangeIndex range_dependents_;
+    std::int64_t min_rank_ = 0;
+    std::int64_t max_rank_ = 0;
+    // Формулы, значения которых сброшены и ещё не вычислены (возможны повторы
+    // и уже вычисленные позиции, они отбрасываются при пересчёте)
+    std::vector<Position> dirty_;
+    // Буфер обхода при сбросе кешей, переиспользуется между правками
+    std::vector<Position> invalidation_stack_;
+    // Буфер обхода при проверке новой формулы на циклы
+    std::vector<const Cell*> cycle_check_stack_;
+    std::uint64_t visit_epoch_ = 0;
+    size_t last_invalidation_count_ = 0;
+    // Увеличиваются и в константных методах (вычисление по запросу)
+    mutable SheetCounters stats_;
+    std::unique_ptr<Tracer> trace_buffer_;
+    Tracer* tracer_ = nullptr; // Буфер активной трассировки, nullptr - трассировка выключена
+    // Число непустых ячеек в каждой занятой строке и в каждом занятом столбце.
+    // Последние ключи задают печатную область
+    std::map<int, int> row_occupancy_;
+    std::map<int, int> col_occupancy_;
+    size_t recalc_threads_ = 1;
+    std::unique_ptr<ThreadPool> pool_; // Создаётся при первом параллельном пересчёте
 };
\ No newline at end of file
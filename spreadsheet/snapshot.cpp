@@ -0,0 +1,547 @@
+#include "sheet.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SPREADSHEET_SNAPSHOT_MMAP
+#endif
+
+#include "FormulaAST.h"
+#include "cell.h"
+#include "common.h"
+
+// Формат снимка. Числа записаны в порядке байт машины, сохранившей снимок
+// (при загрузке он сверяется по метке byte_order):
+//   Header
+//   CellRecord[cell_count]            - ячейки в порядке обхода хранилища
+//   TemplateRecord[template_count]    - выражения формул, по одному на форму
+//   SerializedNode[node_count]        - деревья выражений в постфиксной записи
+//   char[string_bytes]                - тексты ячеек
+// Разбирать при загрузке не нужно ничего: записи копируются из отображённого
+// файла как есть, а каждое выражение строится из готовых узлов один раз.
+// Граф зависимостей не сохраняется: он строится по ссылкам формул и потому
+// всегда с ними согласован.
+
+namespace {
+
+constexpr char SNAPSHOT_MAGIC[8] = {'S', 'P', 'S', 'H', 'E', 'E', 'T', '\0'};
+constexpr std::uint32_t SNAPSHOT_VERSION = 2;
+constexpr std::uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+struct Header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    std::uint64_t cell_count;
+    std::uint64_t template_count;
+    std::uint64_t node_count;
+    std::uint64_t string_bytes;
+    std::int64_t min_rank;
+    std::int64_t max_rank;
+};
+
+enum class CellKind : std::uint8_t {
+    Empty,
+    Text,
+    Formula,
+};
+
+enum class CacheKind : std::uint8_t {
+    None,  // значение не вычислено
+    Number,
+    Error,
+};
+
+struct CellRecord {
+    std::int32_t row;
+    std::int32_t col;
+    std::int64_t rank;
+    std::uint64_t text_offset;
+    std::uint32_t text_size;
+    std::uint32_t template_index;
+    // Смещение формулы относительно ячейки, для которой разбиралось выражение
+    std::int32_t offset_row;
+    std::int32_t offset_col;
+    // Числовое значение текста (NaN, если текст не число) или вычисленное
+    // значение формулы
+    double value;
+    CellKind kind;
+    CacheKind cache;
+    std::uint8_t error;  // FormulaError::Category
+    std::uint8_t reserved[5];
+};
+
+struct TemplateRecord {
+    std::uint64_t first_node;
+    std::uint32_t node_count;
+    std::uint32_t reserved;
+};
+
+template <typename T>
+constexpr bool IS_RECORD = std::is_trivially_copyable_v<T> && sizeof(T) % 8 == 0;
+
+static_assert(IS_RECORD<Header> && IS_RECORD<CellRecord> && IS_RECORD<TemplateRecord>
+              && IS_RECORD<ASTImpl::SerializedNode>);
+
+[[noreturn]] void ThrowCorrupted(const std::string& path) {
+    throw SnapshotException("Corrupted snapshot: " + path);
+}
+
+// Файл снимка, отображённый в память только для чтения. Там, где mmap
+// недоступен, файл читается целиком
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+#ifdef SPREADSHEET_SNAPSHOT_MMAP
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw SnapshotException("Cannot open snapshot: " + path);
+        }
+
+        struct stat info {};
+        if (::fstat(fd, &info) != 0) {
+            ::close(fd);
+            throw SnapshotException("Cannot open snapshot: " + path);
+        }
+
+        size_ = static_cast<size_t>(info.st_size);
+        if (size_ > 0) {
+            void* data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                ::close(fd);
+                throw SnapshotException("Cannot map snapshot: " + path);
+            }
+            // Файл читается один раз от начала до конца
+            ::madvise(data, size_, MADV_SEQUENTIAL);
+            data_ = static_cast<const char*>(data);
+        }
+        ::close(fd);
+#else
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            throw SnapshotException("Cannot open snapshot: " + path);
+        }
+        buffer_.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+#ifdef SPREADSHEET_SNAPSHOT_MMAP
+        if (data_ != nullptr) {
+            ::munmap(const_cast<char*>(data_), size_);
+        }
+#endif
+    }
+
+    const char* GetData() const {
+        return data_;
+    }
+
+    size_t GetSize() const {
+        return size_;
+    }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+#ifndef SPREADSHEET_SNAPSHOT_MMAP
+    std::vector<char> buffer_;
+#endif
+};
+
+// Массив записей внутри отображённого файла. Записи копируются при чтении,
+// поэтому их выравнивание в файле не важно
+template <typename T>
+class RecordArray {
+public:
+    RecordArray(const char* data, size_t size)
+        : data_(data)
+        , size_(size) {}
+
+    size_t size() const {
+        return size_;
+    }
+
+    T operator[](size_t index) const {
+        T record;
+        std::memcpy(&record, data_ + index * sizeof(T), sizeof(T));
+        return record;
+    }
+
+    const char* data() const {
+        return data_;
+    }
+
+private:
+    const char* data_;
+    size_t size_;
+};
+
+// Последовательное чтение секций с проверкой границ файла
+class SnapshotReader {
+public:
+    SnapshotReader(const MappedFile& file, const std::string& path)
+        : data_(file.GetData())
+        , size_(file.GetSize())
+        , path_(path) {}
+
+    template <typename T>
+    RecordArray<T> ReadArray(std::uint64_t count) {
+        if (count > (size_ - offset_) / sizeof(T)) {
+            ThrowCorrupted(path_);
+        }
+        RecordArray<T> records(data_ + offset_, static_cast<size_t>(count));
+        offset_ += static_cast<size_t>(count) * sizeof(T);
+        return records;
+    }
+
+    bool AtEnd() const {
+        return offset_ == size_;
+    }
+
+private:
+    const char* data_;
+    size_t size_;
+    size_t offset_ = 0;
+    const std::string& path_;
+};
+
+template <typename T>
+void WriteRecords(std::ostream& out, const std::vector<T>& records) {
+    out.write(reinterpret_cast<const char*>(records.data()),
+              static_cast<std::streamsize>(records.size() * sizeof(T)));
+}
+
+// Записывает на диск содержимое файла или каталога (для каталога - его
+// записи: новые имена и переименования)
+void SyncPath(const std::string& path, const std::string& snapshot_path) {
+#ifdef SPREADSHEET_SNAPSHOT_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw SnapshotException("Cannot write snapshot: " + snapshot_path);
+    }
+    const int result = ::fsync(fd);
+    ::close(fd);
+    if (result != 0) {
+        throw SnapshotException("Cannot write snapshot: " + snapshot_path);
+    }
+#endif
+}
+
+// Прямоугольник, в котором лежат все ссылки выражения. Позволяет проверить
+// ссылки формулы со смещением без обхода её дерева
+struct ReferenceBounds {
+    bool empty = true;
+    std::int64_t min_row = 0;
+    std::int64_t min_col = 0;
+    std::int64_t max_row = 0;
+    std::int64_t max_col = 0;
+
+    void Add(std::int64_t row, std::int64_t col) {
+        if (empty) {
+            min_row = max_row = row;
+            min_col = max_col = col;
+            empty = false;
+            return;
+        }
+        min_row = std::min(min_row, row);
+        min_col = std::min(min_col, col);
+        max_row = std::max(max_row, row);
+        max_col = std::max(max_col, col);
+    }
+
+    bool IsValidWithOffset(Position offset) const {
+        return empty
+            || (min_row + offset.row >= 0 && min_col + offset.col >= 0
+                && max_row + offset.row < Position::MAX_ROWS && max_col + offset.col < Position::MAX_COLS);
+    }
+};
+
+ReferenceBounds GetReferenceBounds(const std::vector<ASTImpl::SerializedNode>& nodes) {
+    ReferenceBounds bounds;
+    for (const auto& node : nodes) {
+        if (node.kind == ASTImpl::SerializedNode::Kind::Cell) {
+            bounds.Add(node.coords[0], node.coords[1]);
+        } else if (node.kind == ASTImpl::SerializedNode::Kind::Range) {
+            bounds.Add(node.coords[0], node.coords[1]);
+            bounds.Add(node.coords[2], node.coords[3]);
+        }
+    }
+    return bounds;
+}
+
+}  // namespace
+
+void Sheet::SaveSnapshot(const std::string& path) const {
+    std::vector<CellRecord> cells;
+    std::vector<TemplateRecord> templates;
+    std::vector<ASTImpl::SerializedNode> nodes;
+    std::string strings;
+
+    cells.reserve(cells_.Size());
+    // Формулы одной формы ссылаются на одно выражение, оно сохраняется один раз
+    std::unordered_map<const FormulaAST*, std::uint32_t> template_indices;
+
+    cells_.ForEach([&](Position pos, const Cell& cell) {
+        CellRecord record{};
+        record.row = pos.row;
+        record.col = pos.col;
+        record.rank = cell.rank_;
+
+        if (const auto* text = std::get_if<Cell::Text>(&cell.data_)) {
+            record.kind = CellKind::Text;
+            record.text_offset = strings.size();
+            record.text_size = static_cast<std::uint32_t>(text->data.size());
+            record.value = text->number;
+            strings += text->data;
+        } else if (const auto* formula = std::get_if<Cell::Formula>(&cell.data_)) {
+            record.kind = CellKind::Formula;
+
+            const auto& ast = formula->formula->GetAST();
+            auto [it, inserted] = template_indices.emplace(ast.get(), static_cast<std::uint32_t>(templates.size()));
+            if (inserted) {
+                TemplateRecord tmpl{};
+                tmpl.first_node = nodes.size();
+                ast->Serialize(nodes);
+                tmpl.node_count = static_cast<std::uint32_t>(nodes.size() - tmpl.first_node);
+                templates.push_back(tmpl);
+            }
+            record.template_index = it->second;
+
+            Position offset = formula->formula->GetOffset();
+            record.offset_row = offset.row;
+            record.offset_col = offset.col;
+
+            if (formula->cache) {
+                if (const auto* value = std::get_if<double>(&*formula->cache)) {
+                    record.cache = CacheKind::Number;
+                    record.value = *value;
+                } else {
+                    record.cache = CacheKind::Error;
+                    record.error = static_cast<std::uint8_t>(std::get<FormulaError>(*formula->cache).GetCategory());
+                }
+            }
+        } else {
+            record.kind = CellKind::Empty;
+        }
+
+        cells.push_back(record);
+    });
+
+    Header header{};
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = BYTE_ORDER_MARK;
+    header.cell_count = cells.size();
+    header.template_count = templates.size();
+    header.node_count = nodes.size();
+    header.string_bytes = strings.size();
+    header.min_rank = min_rank_;
+    header.max_rank = max_rank_;
+
+    // Снимок пишется во временный файл и заменяет прежний целиком, поэтому
+    // сбой записи не портит уже существующий снимок. Файл записывается на диск
+    // до переименования: иначе после сбоя новое имя может указывать на
+    // обрезанный файл
+    const std::string temp_path = path + ".tmp";
+    {
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        WriteRecords(out, cells);
+        WriteRecords(out, templates);
+        WriteRecords(out, nodes);
+        out.write(strings.data(), static_cast<std::streamsize>(strings.size()));
+        out.close();
+        if (!out) {
+            std::remove(temp_path.c_str());
+            throw SnapshotException("Cannot write snapshot: " + path);
+        }
+    }
+
+    try {
+        SyncPath(temp_path, path);
+    } catch (const SnapshotException&) {
+        std::remove(temp_path.c_str());
+        throw;
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temp_path, path, error);
+    if (error) {
+        std::remove(temp_path.c_str());
+        throw SnapshotException("Cannot write snapshot: " + path);
+    }
+
+    const std::filesystem::path dir = std::filesystem::path(path).parent_path();
+    SyncPath(dir.empty() ? "." : dir.string(), path);
+}
+
+std::unique_ptr<Sheet> Sheet::LoadSnapshot(const std::string& path) {
+    MappedFile file(path);
+    SnapshotReader reader(file, path);
+
+    const Header header = reader.ReadArray<Header>(1)[0];
+    if (std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) {
+        throw SnapshotException("Not a spreadsheet snapshot: " + path);
+    }
+    if (header.version != SNAPSHOT_VERSION || header.byte_order != BYTE_ORDER_MARK) {
+        throw SnapshotException("Unsupported snapshot version or byte order: " + path);
+    }
+
+    const auto cells = reader.ReadArray<CellRecord>(header.cell_count);
+    const auto templates = reader.ReadArray<TemplateRecord>(header.template_count);
+    const auto nodes = reader.ReadArray<ASTImpl::SerializedNode>(header.node_count);
+    const auto strings = reader.ReadArray<char>(header.string_bytes);
+    if (!reader.AtEnd()) {
+        ThrowCorrupted(path);
+    }
+
+    // Выражения строятся из готовых узлов, по одному на форму формул
+    std::vector<std::shared_ptr<const FormulaAST>> asts;
+    std::vector<ReferenceBounds> bounds;
+    asts.reserve(templates.size());
+    bounds.reserve(templates.size());
+
+    std::vector<ASTImpl::SerializedNode> buffer;
+    for (size_t i = 0; i < templates.size(); ++i) {
+        const TemplateRecord tmpl = templates[i];
+        if (tmpl.first_node > nodes.size() || tmpl.node_count > nodes.size() - tmpl.first_node) {
+            ThrowCorrupted(path);
+        }
+
+        buffer.resize(tmpl.node_count);
+        std::memcpy(buffer.data(), nodes.data() + tmpl.first_node * sizeof(ASTImpl::SerializedNode),
+                    tmpl.node_count * sizeof(ASTImpl::SerializedNode));
+        try {
+            asts.push_back(std::make_shared<const FormulaAST>(FormulaAST::Deserialize(buffer.data(), buffer.size())));
+        } catch (const ParsingError&) {
+            ThrowCorrupted(path);
+        }
+        bounds.push_back(GetReferenceBounds(buffer));
+    }
+
+    auto sheet = std::make_unique<Sheet>();
+    // Шаблоны попадают в кеш формы при первой использующей их формуле
+    std::vector<bool> registered(asts.size(), false);
+
+    for (size_t i = 0; i < cells.size(); ++i) {
+        const CellRecord record = cells[i];
+        const Position pos{record.row, record.col};
+        if (!pos.IsValid() || sheet->cells_.Find(pos) != nullptr) {
+            ThrowCorrupted(path);
+        }
+
+        if (record.rank < header.min_rank || record.rank > header.max_rank) {
+            ThrowCorrupted(path);
+        }
+        Cell& cell = sheet->cells_.Emplace(pos, *sheet, pos);
+        cell.rank_ = record.rank;
+
+        switch (record.kind) {
+            case CellKind::Empty:
+                break;
+            case CellKind::Text: {
+                if (record.text_size == 0 || record.text_offset > strings.size()
+                    || record.text_size > strings.size() - record.text_offset) {
+                    ThrowCorrupted(path);
+                }
+                std::string text(strings.data() + record.text_offset, record.text_size);
+                cell.data_ = Cell::Text{std::move(text), record.value};
+                sheet->UpdateOccupancy(pos, 1);
+                break;
+            }
+            case CellKind::Formula: {
+                const Position offset{record.offset_row, record.offset_col};
+                if (record.template_index >= asts.size() || !bounds[record.template_index].IsValidWithOffset(offset)) {
+                    ThrowCorrupted(path);
+                }
+
+                Cell::Formula formula{FormulaTemplates::Instantiate(asts[record.template_index], offset), std::nullopt};
+                if (!registered[record.template_index]) {
+                    sheet->formula_templates_.Register(*formula.formula, pos);
+                    registered[record.template_index] = true;
+                }
+                switch (record.cache) {
+                    case CacheKind::None:
+                        sheet->dirty_.push_back(pos);
+                        break;
+                    case CacheKind::Number:
+                        formula.cache = record.value;
+                        break;
+                    case CacheKind::Error:
+                        if (record.error > static_cast<std::uint8_t>(FormulaError::Category::Arithmetic)) {
+                            ThrowCorrupted(path);
+                        }
+                        formula.cache = FormulaError(static_cast<FormulaError::Category>(record.error));
+                        break;
+                    default:
+                        ThrowCorrupted(path);
+                }
+                cell.data_ = std::move(formula);
+                sheet->UpdateOccupancy(pos, 1);
+                break;
+            }
+            default:
+                ThrowCorrupted(path);
+        }
+
+    }
+
+    // Зависимые связываются по ссылкам формул. Ячейки отдельных ссылок должны
+    // существовать, а ранг формулы - быть больше рангов всех её ссылок: на
+    // этот порядок опираются проверка циклов и вычисление, и он же исключает
+    // циклы в самом снимке
+    bool consistent = true;
+    sheet->cells_.ForEach([&sheet, &consistent](Position pos, Cell& cell) {
+        for (Position ref : cell.GetSingleCellReferences()) {
+            Cell* ref_cell = sheet->cells_.Find(ref);
+            if (ref_cell == nullptr || ref_cell->rank_ >= cell.rank_) {
+                consistent = false;
+                return;
+            }
+            if (!ref_cell->dependents_) {
+                ref_cell->dependents_ = std::make_unique<Cell::Dependents>();
+            }
+            ref_cell->dependents_->Insert(pos);
+        }
+
+        for (Range range : cell.GetRangeReferences()) {
+            sheet->range_dependents_.Add(range, pos);
+            sheet->cells_.ForEachInRange(range.from, range.to, [&cell, &consistent](Position, const Cell& ref_cell) {
+                if (ref_cell.rank_ >= cell.rank_) {
+                    consistent = false;
+                }
+            });
+        }
+    });
+    if (!consistent) {
+        ThrowCorrupted(path);
+    }
+
+    sheet->min_rank_ = header.min_rank;
+    sheet->max_rank_ = header.max_rank;
+    return sheet;
+}
+
+std::unique_ptr<SheetInterface> LoadSnapshot(const std::string& path) {
+    return Sheet::LoadSnapshot(path);
+}
@@ -0,0 +1,19 @@
+#include "stats.h"
+
+void SheetCounters::CopyTo(SheetStats& stats) const {
+    stats.formulas_parsed = formulas_parsed.Get();
+    stats.parse_ns = parse_ns.Get();
+    stats.cache_hits = cache_hits.Get();
+    stats.cache_misses = cache_misses.Get();
+    stats.invalidation_visits = invalidation_visits.Get();
+    stats.cycle_check_visits = cycle_check_visits.Get();
+    stats.evaluations = evaluations.Get();
+    stats.evaluation_ns = evaluation_ns.Get();
+}
+
+void SheetCounters::Reset() {
+    for (StatCounter* counter : {&formulas_parsed, &parse_ns, &cache_hits, &cache_misses, &invalidation_visits,
+                                 &cycle_check_visits, &evaluations, &evaluation_ns}) {
+        counter->Reset();
+    }
+}
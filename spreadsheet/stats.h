@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "common.h"
+
+// Счётчики работы листа (Sheet::GetStats). Сборка с SPREADSHEET_NO_STATS
+// (опция CMake SPREADSHEET_STATS=OFF) превращает прибавления и замеры времени
+// в пустые операции, счётчики тогда остаются нулевыми.
+
+// Счётчик, который увеличивают и потоки параллельного пересчёта. Порядок
+// прибавлений не важен, поэтому достаточно relaxed. Счётчик занимает отдельную
+// кеш-линию, чтобы потоки, увеличивающие соседние счётчики, не мешали друг другу
+class StatCounter {
+public:
+    void Add([[maybe_unused]] std::uint64_t value = 1) {
+#ifndef SPREADSHEET_NO_STATS
+        value_.fetch_add(value, std::memory_order_relaxed);
+#endif
+    }
+
+    std::uint64_t Get() const {
+        return value_.load(std::memory_order_relaxed);
+    }
+
+    void Reset() {
+        value_.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    alignas(64) std::atomic<std::uint64_t> value_{0};
+};
+
+// Копит единичные прибавления к счётчику в потоке, пока жив объект, и
+// переносит их в счётчик одним прибавлением. Так частые события параллельного
+// пересчёта (чтения из кеша) не перебрасывают кеш-линию счётчика между ядрами.
+// Пакеты вкладываются, в потоке действует последний открытый
+class StatBatch {
+public:
+    explicit StatBatch(StatCounter& counter)
+        : counter_(counter), outer_(current_) {
+        current_ = this;
+    }
+
+    ~StatBatch() {
+        current_ = outer_;
+        counter_.Add(pending_);
+    }
+
+    StatBatch(const StatBatch&) = delete;
+    StatBatch& operator=(const StatBatch&) = delete;
+
+    // Прибавляет единицу к counter: в открытый в потоке пакет этого счётчика,
+    // если он есть, иначе прямо в счётчик
+    static void Add([[maybe_unused]] StatCounter& counter) {
+#ifndef SPREADSHEET_NO_STATS
+        if (current_ != nullptr && &current_->counter_ == &counter) {
+            ++current_->pending_;
+            return;
+        }
+        counter.Add();
+#endif
+    }
+
+private:
+    StatCounter& counter_;
+    StatBatch* outer_;
+    std::uint64_t pending_ = 0;
+
+    inline static thread_local StatBatch* current_ = nullptr;
+};
+
+// Прибавляет к счётчику наносекунды, прошедшие за время жизни объекта
+class StatTimer {
+public:
+#ifndef SPREADSHEET_NO_STATS
+    explicit StatTimer(StatCounter& ns)
+        : ns_(ns), start_(std::chrono::steady_clock::now()) {}
+
+    ~StatTimer() {
+        auto elapsed = std::chrono::steady_clock::now() - start_;
+        ns_.Add(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+#else
+    explicit StatTimer(StatCounter&) {}
+#endif
+
+    StatTimer(const StatTimer&) = delete;
+    StatTimer& operator=(const StatTimer&) = delete;
+
+private:
+#ifndef SPREADSHEET_NO_STATS
+    StatCounter& ns_;
+    std::chrono::steady_clock::time_point start_;
+#endif
+};
+
+// Значения счётчиков соответствуют одноимённым полям SheetStats
+struct SheetCounters {
+    StatCounter formulas_parsed;
+    StatCounter parse_ns;
+    StatCounter cache_hits;
+    StatCounter cache_misses;
+    StatCounter invalidation_visits;
+    StatCounter cycle_check_visits;
+    StatCounter evaluations;
+    StatCounter evaluation_ns;
+
+    // Заполняет счётчиковые поля stats
+    void CopyTo(SheetStats& stats) const;
+    void Reset();
+};
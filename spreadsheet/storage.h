@@ -0,0 +1,243 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "common.h"
+
+// Плотное хранилище ячеек таблицы.
+// Лист делится на тайлы TILE_ROWS x TILE_COLS, которые выделяются по требованию.
+// Каталог двухуровневый: полоса из TILE_ROWS строк -> тайл внутри полосы. Его
+// размер рассчитан на Position::MAX_ROWS x Position::MAX_COLS, поэтому поиск
+// ячейки сводится к индексной арифметике, а соседние ячейки одной строки лежат
+// в памяти рядом.
+// Адреса элементов стабильны: вставка и удаление других элементов их не
+// инвалидируют (как и у узлового PositionMap, который заменяет хранилище).
+template <typename T>
+class TiledStorage {
+public:
+    static constexpr int TILE_ROWS = 16;
+    static constexpr int TILE_COLS = 16;
+
+    TiledStorage() : bands_(BANDS_COUNT) {}
+
+    TiledStorage(const TiledStorage&) = delete;
+    TiledStorage& operator=(const TiledStorage&) = delete;
+    TiledStorage(TiledStorage&&) = default;
+    TiledStorage& operator=(TiledStorage&&) = default;
+
+    T* Find(Position pos) {
+        return FindImpl(*this, pos);
+    }
+
+    const T* Find(Position pos) const {
+        return FindImpl(*this, pos);
+    }
+
+    // Создаёт элемент в свободной позиции. Позиция должна быть корректной.
+    template <typename... Args>
+    T& Emplace(Position pos, Args&&... args) {
+        assert(pos.IsValid());
+
+        auto& band = bands_[pos.row / TILE_ROWS];
+        if (!band) {
+            band = std::make_unique<Band>();
+        }
+
+        int tile_idx = pos.col / TILE_COLS;
+        auto& tile = band->tiles[tile_idx];
+        if (!tile) {
+            tile = std::make_unique<Tile>();
+            band->used.insert(std::lower_bound(band->used.begin(), band->used.end(), tile_idx), tile_idx);
+        }
+
+        auto& slot = tile->cells[SlotIndex(pos)];
+        assert(!slot.has_value());
+        slot.emplace(std::forward<Args>(args)...);
+        ++tile->count;
+        ++size_;
+
+        return *slot;
+    }
+
+    // Удаляет элемент. Пустые тайлы и полосы освобождаются сразу.
+    bool Erase(Position pos) {
+        if (!pos.IsValid()) {
+            return false;
+        }
+
+        auto& band = bands_[pos.row / TILE_ROWS];
+        if (!band) {
+            return false;
+        }
+
+        int tile_idx = pos.col / TILE_COLS;
+        auto& tile = band->tiles[tile_idx];
+        if (!tile) {
+            return false;
+        }
+
+        auto& slot = tile->cells[SlotIndex(pos)];
+        if (!slot.has_value()) {
+            return false;
+        }
+
+        slot.reset();
+        --size_;
+
+        if (--tile->count == 0) {
+            tile.reset();
+            band->used.erase(std::lower_bound(band->used.begin(), band->used.end(), tile_idx));
+            if (band->used.empty()) {
+                band.reset();
+            }
+        }
+
+        return true;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    bool Empty() const {
+        return size_ == 0;
+    }
+
+    // Память хранилища: каталог полос, выделенные полосы и тайлы целиком,
+    // вместе со свободными слотами. Память, которой владеют сами элементы, не
+    // входит
+    size_t GetMemoryUsage() const {
+        size_t bytes = bands_.capacity() * sizeof(std::unique_ptr<Band>);
+        for (const auto& band : bands_) {
+            if (band) {
+                bytes += sizeof(Band) + band->used.capacity() * sizeof(int) + band->used.size() * sizeof(Tile);
+            }
+        }
+        return bytes;
+    }
+
+    // Обходит занятые позиции построчно (row-major): func(Position, T&).
+    // Стоимость обхода пропорциональна числу выделенных тайлов, а не площади листа.
+    template <typename Func>
+    void ForEach(Func&& func) {
+        ForEachImpl(*this, func);
+    }
+
+    template <typename Func>
+    void ForEach(Func&& func) const {
+        ForEachImpl(*this, func);
+    }
+
+    // Обходит занятые позиции прямоугольника [from; to] построчно, пропуская
+    // невыделенные полосы и тайлы
+    template <typename Func>
+    void ForEachInRange(Position from, Position to, Func&& func) {
+        ForEachInRangeImpl(*this, from, to, func);
+    }
+
+    template <typename Func>
+    void ForEachInRange(Position from, Position to, Func&& func) const {
+        ForEachInRangeImpl(*this, from, to, func);
+    }
+
+private:
+    static constexpr int TILE_SIZE = TILE_ROWS * TILE_COLS;
+    static constexpr int BANDS_COUNT = (Position::MAX_ROWS + TILE_ROWS - 1) / TILE_ROWS;
+    static constexpr int BAND_TILES = (Position::MAX_COLS + TILE_COLS - 1) / TILE_COLS;
+
+    struct Tile {
+        std::array<std::optional<T>, TILE_SIZE> cells;
+        int count = 0;
+    };
+
+    struct Band {
+        std::array<std::unique_ptr<Tile>, BAND_TILES> tiles;
+        std::vector<int> used; // Отсортированные индексы выделенных тайлов полосы
+    };
+
+    template <typename Self, typename Func>
+    static void ForEachInRangeImpl(Self& self, Position from, Position to, Func& func) {
+        for (int band_idx = from.row / TILE_ROWS; band_idx <= to.row / TILE_ROWS; ++band_idx) {
+            const auto& band = self.bands_[band_idx];
+            if (!band) {
+                continue;
+            }
+
+            const int first_tile = from.col / TILE_COLS;
+            const int last_tile = to.col / TILE_COLS;
+            auto tiles_begin = std::lower_bound(band->used.begin(), band->used.end(), first_tile);
+            auto tiles_end = std::upper_bound(tiles_begin, band->used.end(), last_tile);
+
+            const int row_begin = std::max(from.row, band_idx * TILE_ROWS);
+            const int row_end = std::min(to.row + 1, (band_idx + 1) * TILE_ROWS);
+            for (int row = row_begin; row < row_end; ++row) {
+                for (auto it = tiles_begin; it != tiles_end; ++it) {
+                    auto& tile = *band->tiles[*it];
+                    const int col_begin = std::max(from.col, *it * TILE_COLS);
+                    const int col_end = std::min(to.col + 1, (*it + 1) * TILE_COLS);
+                    for (int col = col_begin; col < col_end; ++col) {
+                        auto& slot = tile.cells[SlotIndex({row, col})];
+                        if (slot.has_value()) {
+                            func(Position{row, col}, *slot);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    static int SlotIndex(Position pos) {
+        return (pos.row % TILE_ROWS) * TILE_COLS + pos.col % TILE_COLS;
+    }
+
+    template <typename Self>
+    static auto FindImpl(Self& self, Position pos) -> decltype(self.Find(pos)) {
+        if (!pos.IsValid()) {
+            return nullptr;
+        }
+
+        const auto& band = self.bands_[pos.row / TILE_ROWS];
+        if (!band) {
+            return nullptr;
+        }
+
+        const auto& tile = band->tiles[pos.col / TILE_COLS];
+        if (!tile) {
+            return nullptr;
+        }
+
+        auto& slot = tile->cells[SlotIndex(pos)];
+        return slot.has_value() ? &*slot : nullptr;
+    }
+
+    template <typename Self, typename Func>
+    static void ForEachImpl(Self& self, Func& func) {
+        for (int band_idx = 0; band_idx < BANDS_COUNT; ++band_idx) {
+            const auto& band = self.bands_[band_idx];
+            if (!band) {
+                continue;
+            }
+
+            for (int row = 0; row < TILE_ROWS; ++row) {
+                for (int tile_idx : band->used) {
+                    auto& tile = *band->tiles[tile_idx];
+                    for (int col = 0; col < TILE_COLS; ++col) {
+                        auto& slot = tile.cells[row * TILE_COLS + col];
+                        if (slot.has_value()) {
+                            func(Position{band_idx * TILE_ROWS + row, tile_idx * TILE_COLS + col}, *slot);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<Band>> bands_;
+    size_t size_ = 0;
+};
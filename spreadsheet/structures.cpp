@@ -107,4 +107,31 @@ Position Position::FromString(std::string_view str) {
 
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
+}
+
+bool Range::operator==(Range rhs) const {
+    return from == rhs.from && to == rhs.to;
+}
+
+bool Range::IsValid() const {
+    return from.IsValid() && to.IsValid() && from.row <= to.row && from.col <= to.col;
+}
+
+bool Range::Contains(Position pos) const {
+    return from.row <= pos.row && pos.row <= to.row && from.col <= pos.col && pos.col <= to.col;
+}
+
+std::string Range::ToString() const {
+    if (!IsValid()) {
+        return {};
+    }
+
+    return from.ToString() + ':' + to.ToString();
+}
+
+Range Range::FromCorners(Position first, Position second) {
+    return {
+        {std::min(first.row, second.row), std::min(first.col, second.col)},
+        {std::max(first.row, second.row), std::max(first.col, second.col)},
+    };
 }
\ No newline at end of file
@@ -0,0 +1,142 @@
+#include "table_reader.h"
+
+#include <algorithm>
+#include <cstring>
+
+TableReader::TableReader(std::istream& input, TableFormat format, size_t chunk_size)
+    : input_(input)
+    , delimiter_(format == TableFormat::Csv ? ',' : '\t')
+    , quoting_(format == TableFormat::Csv)
+    , buffer_(std::max<size_t>(chunk_size, 1)) {}
+
+bool TableReader::Next(Field& field) {
+    while (true) {
+        if (begin_ == end_ && !Fill()) {
+            return false;
+        }
+
+        std::string_view text;
+        char terminator;
+        if (!ScanField(text, terminator)) {
+            // Поле продолжается в следующем блоке (или поток закончился,
+            // и тогда следующий просмотр дойдёт до его конца)
+            Fill();
+            continue;
+        }
+
+        field = {row_, col_, text};
+        if (terminator == delimiter_) {
+            ++col_;
+        } else {
+            ++row_;
+            col_ = 0;
+        }
+
+        if (!text.empty()) {
+            return true;
+        }
+    }
+}
+
+bool TableReader::Fill() {
+    if (eof_) {
+        return false;
+    }
+
+    if (begin_ > 0) {
+        std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+        end_ -= begin_;
+        begin_ = 0;
+    }
+    // Поле не помещается в блок целиком
+    if (end_ == buffer_.size()) {
+        buffer_.resize(buffer_.size() * 2);
+    }
+
+    input_.read(buffer_.data() + end_, static_cast<std::streamsize>(buffer_.size() - end_));
+    const size_t count = static_cast<size_t>(input_.gcount());
+    end_ += count;
+    if (!input_) {
+        eof_ = true;
+    }
+    return count > 0;
+}
+
+bool TableReader::ScanField(std::string_view& text, char& terminator) {
+    if (quoting_ && begin_ < end_ && buffer_[begin_] == '"') {
+        return ScanQuotedField(text, terminator);
+    }
+
+    const char* data = buffer_.data();
+    size_t i = begin_;
+    while (i < end_ && data[i] != delimiter_ && data[i] != '\n') {
+        ++i;
+    }
+    if (i == end_ && !eof_) {
+        return false;
+    }
+
+    terminator = i == end_ ? '\0' : data[i];
+    size_t field_end = i;
+    // Переводы строк \r\n
+    if (terminator != delimiter_ && field_end > begin_ && data[field_end - 1] == '\r') {
+        --field_end;
+    }
+
+    text = std::string_view(data + begin_, field_end - begin_);
+    begin_ = i == end_ ? i : i + 1;
+    return true;
+}
+
+// Поле в кавычках может содержать разделители и переводы строк, а кавычка
+// внутри него удваивается. Символы между закрывающей кавычкой и разделителем
+// добавляются к полю как есть, незакрытая кавычка продолжает поле до конца потока
+bool TableReader::ScanQuotedField(std::string_view& text, char& terminator) {
+    const char* data = buffer_.data();
+    unquoted_.clear();
+    size_t i = begin_ + 1;
+    size_t quoted_size = 0;
+
+    while (true) {
+        const void* quote = std::memchr(data + i, '"', end_ - i);
+        if (quote == nullptr) {
+            if (!eof_) {
+                return false;
+            }
+            unquoted_.append(data + i, end_ - i);
+            quoted_size = unquoted_.size();
+            i = end_;
+            break;
+        }
+
+        const size_t quote_pos = static_cast<const char*>(quote) - data;
+        unquoted_.append(data + i, quote_pos - i);
+        if (quote_pos + 1 == end_ && !eof_) {
+            return false;
+        }
+        if (quote_pos + 1 < end_ && data[quote_pos + 1] == '"') {
+            unquoted_ += '"';
+            i = quote_pos + 2;
+            continue;
+        }
+
+        quoted_size = unquoted_.size();
+        i = quote_pos + 1;
+        while (i < end_ && data[i] != delimiter_ && data[i] != '\n') {
+            unquoted_ += data[i++];
+        }
+        if (i == end_ && !eof_) {
+            return false;
+        }
+        break;
+    }
+
+    terminator = i == end_ ? '\0' : data[i];
+    if (terminator != delimiter_ && unquoted_.size() > quoted_size && unquoted_.back() == '\r') {
+        unquoted_.pop_back();
+    }
+
+    text = unquoted_;
+    begin_ = i == end_ ? i : i + 1;
+    return true;
+}
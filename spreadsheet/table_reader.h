@@ -0,0 +1,50 @@
+#pragma once
+
+#include <istream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "common.h"
+
+// Чтение текстовой таблицы (TSV или CSV) крупными блоками. Поля отдаются
+// ссылками на буфер чтения, поэтому отдельная память на каждое поле не
+// выделяется. Только поле CSV в кавычках собирается в переиспользуемую строку,
+// так как из него удаляются кавычки.
+class TableReader {
+public:
+    struct Field {
+        int row;
+        int col;
+        // Действителен до следующего вызова Next
+        std::string_view text;
+    };
+
+    static constexpr size_t DEFAULT_CHUNK_SIZE = 1 << 20;
+
+    TableReader(std::istream& input, TableFormat format, size_t chunk_size = DEFAULT_CHUNK_SIZE);
+
+    // Читает следующее непустое поле. Возвращает false в конце потока
+    bool Next(Field& field);
+
+private:
+    // Дочитывает блок, сдвинув непрочитанный остаток в начало буфера.
+    // Возвращает false, если поток закончился
+    bool Fill();
+    // Находит конец поля, начинающегося с begin_, и переходит за него.
+    // terminator - символ после поля: разделитель, '\n' или '\0' в конце потока.
+    // Возвращает false, если поле не поместилось в прочитанную часть потока
+    bool ScanField(std::string_view& text, char& terminator);
+    bool ScanQuotedField(std::string_view& text, char& terminator);
+
+    std::istream& input_;
+    const char delimiter_;
+    const bool quoting_;
+    std::vector<char> buffer_;
+    size_t begin_ = 0; // Начало непрочитанных данных
+    size_t end_ = 0;   // Конец прочитанных данных
+    bool eof_ = false;
+    std::string unquoted_;
+    int row_ = 0;
+    int col_ = 0;
+};
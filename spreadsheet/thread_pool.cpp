@@ -0,0 +1,126 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(size_t threads) {
+    threads = std::max<size_t>(threads, 1);
+
+    for (size_t i = 0; i < threads; ++i) {
+        queues_.push_back(std::make_unique<Queue>());
+    }
+
+    // Поток с индексом 0 - вызывающий
+    for (size_t i = 1; i < threads; ++i) {
+        workers_.emplace_back([this, i] {
+            WorkerLoop(i);
+        });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t)>& func) {
+    if (count == 0) {
+        return;
+    }
+
+    // Несколько порций на поток, чтобы было что перераспределять
+    const size_t threads = queues_.size();
+    const size_t chunk_size = std::max<size_t>(1, count / (threads * 4));
+    const size_t chunks = (count + chunk_size - 1) / chunk_size;
+
+    func_ = &func;
+    remaining_.store(chunks);
+
+    for (size_t i = 0; i < chunks; ++i) {
+        Queue& queue = *queues_[i % threads];
+        std::lock_guard lock(queue.mutex);
+        queue.chunks.push_back({i * chunk_size, std::min(count, (i + 1) * chunk_size)});
+    }
+
+    {
+        std::lock_guard lock(mutex_);
+        ++generation_;
+    }
+    wake_.notify_all();
+
+    RunChunks(0);
+
+    std::unique_lock lock(mutex_);
+    done_.wait(lock, [this] {
+        return remaining_.load() == 0;
+    });
+}
+
+void ThreadPool::WorkerLoop(size_t index) {
+    size_t seen_generation = 0;
+
+    while (true) {
+        {
+            std::unique_lock lock(mutex_);
+            wake_.wait(lock, [this, seen_generation] {
+                return stop_ || generation_ != seen_generation;
+            });
+
+            if (stop_) {
+                return;
+            }
+            seen_generation = generation_;
+        }
+
+        RunChunks(index);
+    }
+}
+
+void ThreadPool::RunChunks(size_t index) {
+    Chunk chunk;
+    while (PopChunk(index, chunk)) {
+        // Порция снята из очереди под мьютексом после записи func_, поэтому
+        // указатель относится к текущему вызову ParallelFor
+        const auto& func = *func_;
+        for (size_t i = chunk.begin; i < chunk.end; ++i) {
+            func(i);
+        }
+
+        if (remaining_.fetch_sub(1) == 1) {
+            {
+                std::lock_guard lock(mutex_);
+            }
+            done_.notify_all();
+        }
+    }
+}
+
+bool ThreadPool::PopChunk(size_t index, Chunk& chunk) {
+    {
+        Queue& own = *queues_[index];
+        std::lock_guard lock(own.mutex);
+        if (!own.chunks.empty()) {
+            chunk = own.chunks.back();
+            own.chunks.pop_back();
+            return true;
+        }
+    }
+
+    for (size_t step = 1; step < queues_.size(); ++step) {
+        Queue& victim = *queues_[(index + step) % queues_.size()];
+        std::lock_guard lock(victim.mutex);
+        if (!victim.chunks.empty()) {
+            chunk = victim.chunks.front();
+            victim.chunks.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Пул потоков для параллельного пересчёта.
+// Диапазон задач делится на порции, которые раскладываются по очередям
+// потоков. Поток берёт порции из конца своей очереди, а опустев, забирает
+// их из начала чужих (work stealing). Вызывающий поток тоже выполняет задачи.
+class ThreadPool {
+public:
+    // threads - общее число потоков, включая вызывающий
+    explicit ThreadPool(size_t threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t GetThreadCount() const {
+        return queues_.size();
+    }
+
+    // Вызывает func(i) для всех i из [0, count) и возвращает управление, когда
+    // все вызовы завершены. Вызовы выполняются параллельно в произвольном порядке
+    void ParallelFor(size_t count, const std::function<void(size_t)>& func);
+
+private:
+    struct Chunk {
+        size_t begin;
+        size_t end;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Chunk> chunks;
+    };
+
+    void WorkerLoop(size_t index);
+    void RunChunks(size_t index);
+    bool PopChunk(size_t index, Chunk& chunk);
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    size_t generation_ = 0;
+    bool stop_ = false;
+
+    const std::function<void(size_t)>* func_ = nullptr;
+    std::atomic<size_t> remaining_{0}; // Порции, которые ещё не выполнены
+};
@@ -0,0 +1,164 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace {
+
+// Короткий номер потока для trace_event: 1 - первый записавший поток и т.д.
+std::uint32_t CurrentThreadNumber() {
+    static std::atomic<std::uint32_t> next{1};
+    thread_local const std::uint32_t number = next.fetch_add(1, std::memory_order_relaxed);
+    return number;
+}
+
+size_t RoundUpToPowerOfTwo(size_t value) {
+    size_t result = 1;
+    while (result < value) {
+        result <<= 1;
+    }
+    return result;
+}
+
+const char* KindName(Tracer::Kind kind) {
+    switch (kind) {
+        case Tracer::Kind::SetCell:
+            return "set_cell";
+        case Tracer::Kind::Parse:
+            return "parse";
+        case Tracer::Kind::CycleCheck:
+            return "cycle_check";
+        case Tracer::Kind::Invalidate:
+            return "invalidate";
+        case Tracer::Kind::Evaluate:
+            return "evaluate";
+        case Tracer::Kind::EvaluateUpstream:
+            return "evaluate_upstream";
+        case Tracer::Kind::Recalculate:
+            return "recalculate";
+    }
+    return "unknown";
+}
+
+// Имя аргумента count, nullptr - у события его нет
+const char* CountName(Tracer::Kind kind) {
+    switch (kind) {
+        case Tracer::Kind::CycleCheck:
+        case Tracer::Kind::Invalidate:
+            return "cells";
+        case Tracer::Kind::Recalculate:
+            return "formulas";
+        default:
+            return nullptr;
+    }
+}
+
+// Версия места с записанным событием index (см. Tracer::Slot)
+std::uint64_t PublishedSequence(std::uint64_t index) {
+    return 2 * index + 2;
+}
+
+std::uint64_t PackPosition(Position pos) {
+    return (static_cast<std::uint64_t>(static_cast<std::uint32_t>(pos.row)) << 32)
+        | static_cast<std::uint32_t>(pos.col);
+}
+
+Position UnpackPosition(std::uint64_t packed) {
+    return {static_cast<std::int32_t>(packed >> 32), static_cast<std::int32_t>(packed & 0xFFFFFFFFu)};
+}
+
+// Микросекунды с дробной частью, как ожидает trace_event
+void PrintMicroseconds(std::ostream& output, std::int64_t ns) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%lld.%03lld", static_cast<long long>(ns / 1000),
+                  static_cast<long long>(ns % 1000));
+    output << buffer;
+}
+
+}  // namespace
+
+Tracer::Tracer(size_t capacity)
+    : slots_(std::make_unique<Slot[]>(RoundUpToPowerOfTwo(std::max<size_t>(capacity, 1))))
+    , mask_(RoundUpToPowerOfTwo(std::max<size_t>(capacity, 1)) - 1)
+    , origin_(std::chrono::steady_clock::now()) {}
+
+void Tracer::Record(Kind kind, Position pos, std::int64_t start_ns, std::int64_t end_ns, std::uint64_t count) {
+    const std::uint64_t index = head_.fetch_add(1, std::memory_order_relaxed);
+    Slot& slot = slots_[index & mask_];
+    const std::uint64_t published = PublishedSequence(index);
+
+    // Место занимается нечётной версией. Если его пишет другой поток (после
+    // переполнения кольца) или в нём уже более новое событие, событие теряется
+    std::uint64_t sequence = slot.sequence.load(std::memory_order_relaxed);
+    do {
+        if (sequence % 2 != 0 || sequence >= published) {
+            return;
+        }
+    } while (!slot.sequence.compare_exchange_weak(sequence, published - 1, std::memory_order_relaxed));
+    // Поля не могут стать видны раньше нечётной версии
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.start_ns.store(start_ns, std::memory_order_relaxed);
+    slot.end_ns.store(end_ns, std::memory_order_relaxed);
+    slot.count.store(count, std::memory_order_relaxed);
+    slot.pos.store(PackPosition(pos), std::memory_order_relaxed);
+    slot.thread_kind.store(static_cast<std::uint64_t>(CurrentThreadNumber()) << 8 | static_cast<std::uint8_t>(kind),
+                           std::memory_order_relaxed);
+    slot.sequence.store(published, std::memory_order_release);
+}
+
+bool Tracer::Read(std::uint64_t index, Event& event) const {
+    const Slot& slot = slots_[index & mask_];
+    const std::uint64_t published = PublishedSequence(index);
+    // Место ещё не записано, записывается или уже занято более новым событием
+    if (slot.sequence.load(std::memory_order_acquire) != published) {
+        return false;
+    }
+
+    event.start_ns = slot.start_ns.load(std::memory_order_relaxed);
+    event.end_ns = slot.end_ns.load(std::memory_order_relaxed);
+    event.count = slot.count.load(std::memory_order_relaxed);
+    event.pos = UnpackPosition(slot.pos.load(std::memory_order_relaxed));
+    const std::uint64_t thread_kind = slot.thread_kind.load(std::memory_order_relaxed);
+    event.thread = static_cast<std::uint32_t>(thread_kind >> 8);
+    event.kind = static_cast<Kind>(thread_kind & 0xFF);
+
+    // Событие не перезаписывалось, пока копировалось
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot.sequence.load(std::memory_order_relaxed) == published;
+}
+
+void Tracer::Write(std::ostream& output) const {
+    const std::uint64_t head = head_.load(std::memory_order_acquire);
+    const std::uint64_t capacity = mask_ + 1;
+    const std::uint64_t first = head > capacity ? head - capacity : 0;
+
+    output << "{\"traceEvents\":[";
+    bool separator = false;
+    std::uint64_t written = 0;
+    for (std::uint64_t index = first; index < head; ++index) {
+        Event event;
+        if (!Read(index, event)) {
+            continue;
+        }
+
+        ++written;
+        output << (separator ? ",\n" : "\n") << "{\"name\":\"" << KindName(event.kind)
+               << "\",\"cat\":\"spreadsheet\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread << ",\"ts\":";
+        PrintMicroseconds(output, event.start_ns);
+        output << ",\"dur\":";
+        PrintMicroseconds(output, event.end_ns - event.start_ns);
+        output << ",\"args\":{";
+        bool arg_separator = false;
+        if (event.pos.IsValid()) {
+            output << "\"cell\":\"" << event.pos.ToString() << "\"";
+            arg_separator = true;
+        }
+        if (const char* count_name = CountName(event.kind); count_name != nullptr) {
+            output << (arg_separator ? "," : "") << "\"" << count_name << "\":" << event.count;
+        }
+        output << "}}";
+        separator = true;
+    }
+    output << "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped_events\":" << head - written << "}}\n";
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+
+#include "common.h"
+
+// Трассировка работы листа (SheetInterface::StartTracing). События пишутся в
+// кольцевой буфер фиксированного размера: место под событие занимается одним
+// атомарным прибавлением, поэтому записывать могут и потоки параллельного
+// пересчёта без блокировок. При переполнении старые события затираются.
+// Каждое место защищено счётчиком версий (seqlock): запись занимает место
+// сравнением с обменом, а чтение пропускает место, изменившееся за время
+// копирования. Если место занято другой записью или уже хранит более новое
+// событие, событие отбрасывается и учитывается как потерянное.
+class Tracer {
+public:
+    enum class Kind : std::uint8_t {
+        SetCell,          // запись ячейки целиком
+        Parse,            // разбор формулы
+        CycleCheck,       // проверка на циклы (count - пройдено ячеек)
+        Invalidate,       // сброс кешей (count - пройдено ячеек)
+        Evaluate,         // вычисление одной формулы
+        EvaluateUpstream, // вычисление по запросу значения вместе с невычисленными ссылками
+        Recalculate,      // пересчёт листа (count - число формул)
+    };
+
+    // Ёмкость округляется вверх до степени двойки
+    explicit Tracer(size_t capacity);
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    // Наносекунды с создания трассировки
+    std::int64_t Now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin_)
+            .count();
+    }
+
+    // pos может быть недействительной, если событие не относится к одной ячейке
+    void Record(Kind kind, Position pos, std::int64_t start_ns, std::int64_t end_ns, std::uint64_t count);
+
+    // Записывает события в формате Chrome trace_event (JSON), который открывают
+    // chrome://tracing и Perfetto. Может выполняться одновременно с записью:
+    // события, изменившиеся при чтении, считаются потерянными
+    void Write(std::ostream& output) const;
+
+private:
+    struct Event {
+        std::int64_t start_ns;
+        std::int64_t end_ns;
+        std::uint64_t count;
+        Position pos;
+        std::uint32_t thread;
+        Kind kind;
+    };
+
+    // sequence - удвоенный номер записанного в место события плюс два, 0 -
+    // место пусто, нечётное значение - событие записывается. Поля события
+    // атомарны, чтобы чтение одновременно с записью не было гонкой
+    struct Slot {
+        std::atomic<std::uint64_t> sequence{0};
+        std::atomic<std::int64_t> start_ns{0};
+        std::atomic<std::int64_t> end_ns{0};
+        std::atomic<std::uint64_t> count{0};
+        std::atomic<std::uint64_t> pos{0};         // строка и столбец
+        std::atomic<std::uint64_t> thread_kind{0}; // номер потока и вид события
+    };
+
+    // Копирует событие index, если место хранит именно его
+    bool Read(std::uint64_t index, Event& event) const;
+
+    std::unique_ptr<Slot[]> slots_;
+    size_t mask_;
+    std::atomic<std::uint64_t> head_{0}; // Число занятых мест за всё время
+    const std::chrono::steady_clock::time_point origin_;
+};
+
+// Записывает событие о промежутке от создания до уничтожения объекта.
+// Без трассировки (tracer == nullptr) ничего не делает
+class TraceSpan {
+public:
+    TraceSpan(Tracer* tracer, Tracer::Kind kind, Position pos = Position::NONE)
+        : tracer_(tracer), kind_(kind), pos_(pos), start_ns_(tracer != nullptr ? tracer->Now() : 0) {}
+
+    ~TraceSpan() {
+        if (tracer_ != nullptr) {
+            tracer_->Record(kind_, pos_, start_ns_, tracer_->Now(), count_);
+        }
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    void SetCount(std::uint64_t count) {
+        count_ = count;
+    }
+
+private:
+    Tracer* tracer_;
+    Tracer::Kind kind_;
+    Position pos_;
+    std::int64_t start_ns_;
+    std::uint64_t count_ = 0;
+};